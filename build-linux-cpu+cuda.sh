@@ -1,2 +1,4 @@
 #!/bin/sh
 nvcc -arch compute_30 src/ebsynth.cpp src/ebsynth_cpu.cpp src/ebsynth_cuda.cu -I"include" -DNDEBUG -D__CORRECT_ISO_CPP11_MATH_H_PROTO -O6 -std=c++11 -w -Xcompiler -fopenmp -o bin/ebsynth
+g++ src/ebsynth_bench.cpp src/ebsynth_cpu.cpp -DNDEBUG -O6 -fopenmp -I"include" -std=c++11 -o bin/ebsynth-bench
+g++ src/ebsynth_kernelbench.cpp -DNDEBUG -O6 -fopenmp -I"include" -std=c++11 -o bin/ebsynth-kernelbench
@@ -1,2 +1,4 @@
 #!/bin/sh
 g++ src/ebsynth.cpp src/ebsynth_cpu.cpp src/ebsynth_nocuda.cpp -DNDEBUG -O6 -fopenmp -I"include" -std=c++11 -o bin/ebsynth
+g++ src/ebsynth_bench.cpp src/ebsynth_cpu.cpp -DNDEBUG -O6 -fopenmp -I"include" -std=c++11 -o bin/ebsynth-bench
+g++ src/ebsynth_kernelbench.cpp -DNDEBUG -O6 -fopenmp -I"include" -std=c++11 -o bin/ebsynth-kernelbench
@@ -1,2 +1,4 @@
 #!/bin/sh
 clang++ src/ebsynth.cpp src/ebsynth_cpu.cpp src/ebsynth_nocuda.cpp -DNDEBUG -O3 -I"include" -std=c++11 -o bin/ebsynth
+clang++ src/ebsynth_bench.cpp src/ebsynth_cpu.cpp -DNDEBUG -O3 -I"include" -std=c++11 -o bin/ebsynth-bench
+clang++ src/ebsynth_kernelbench.cpp -DNDEBUG -O3 -I"include" -std=c++11 -o bin/ebsynth-kernelbench
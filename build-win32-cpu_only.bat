@@ -5,7 +5,9 @@ call "vcvarsall.bat" x86
 
 cl src\ebsynth.cpp src\ebsynth_cpu.cpp src\ebsynth_nocuda.cpp /DNDEBUG /O2 /openmp /EHsc /nologo /I"include" /Fe"bin\ebsynth.exe" || goto error
 cl src\ebsynth.cpp src\ebsynth_cpu.cpp src\ebsynth_nocuda.cpp /DNDEBUG /O2 /openmp /EHsc /nologo /I"include" /Fe"bin\ebsynth.dll" /DEBSYNTH_API="__declspec(dllexport)" /link /IMPLIB:"lib\ebsynth.lib" || goto error
-del ebsynth.obj;ebsynth_cpu.obj;ebsynth_nocuda.obj 2> NUL
+cl src\ebsynth_bench.cpp src\ebsynth_cpu.cpp /DNDEBUG /O2 /openmp /EHsc /nologo /I"include" /Fe"bin\ebsynth-bench.exe" || goto error
+cl src\ebsynth_kernelbench.cpp /DNDEBUG /O2 /openmp /EHsc /nologo /I"include" /Fe"bin\ebsynth-kernelbench.exe" || goto error
+del ebsynth.obj;ebsynth_cpu.obj;ebsynth_nocuda.obj;ebsynth_bench.obj;ebsynth_kernelbench.obj 2> NUL
 goto :EOF
 
 :error
@@ -27,6 +27,77 @@ extern "C" {
 #define EBSYNTH_VOTEMODE_PLAIN      0x0001         // weight = 1
 #define EBSYNTH_VOTEMODE_WEIGHTED   0x0002         // weight = 1/(1+error)
 
+#define EBSYNTH_SCHEDULE_AUTO       0x0000         // row bands, or tiled when the deterministic mode needs it
+#define EBSYNTH_SCHEDULE_ROWBANDS   0x0001         // one horizontal band per thread, propagation stops at the band seams
+#define EBSYNTH_SCHEDULE_TILED      0x0002         // checkerboard of square tiles processed in two phases, propagation crosses the tile seams
+
+#define EBSYNTH_MAX_PYRAMID_LEVELS  32
+
+typedef struct EbsynthState EbsynthState;          // what a run leaves behind for incremental re-runs: the NNF and the output of every pyramid level
+
+typedef struct EbsynthOptions                      // zero-initialize to get the defaults
+{
+  int   schedule;                                  // how the CPU backend parallelizes Patch-Match, one of EBSYNTH_SCHEDULE_*
+  int   deterministic;                             // non-zero makes the CPU backend produce the same output for the same seed regardless of the number of threads (implies EBSYNTH_SCHEDULE_TILED)
+  unsigned int seed;                               // seed of the deterministic mode
+  const void* initialNnfData;                      // (targetWidth * targetHeight * 2) ints, scan-line order, e.g. outputNnfData of the previous frame; seeds the synthesis instead of the random initialization; pass NULL to ignore
+  int   startPyramidLevel;                         // number of coarse levels to skip, the synthesis starts at this level (0 = coarsest); mostly useful together with initialNnfData
+  int   memoryBudgetMB;                            // CPU backend: when the target-sized buffers of a run would need more, the target is synthesized in overlapping tiles that fit; 0 = no limit
+  const void* targetMaskData;                      // (targetWidth * targetHeight) bytes, non-zero where new pixels are wanted; the CPU backend then searches and votes only there and within the patch radius around, and takes the rest of the output from baseImageData; pass NULL to synthesize the whole target
+  const void* baseImageData;                       // (targetWidth * targetHeight * numStyleChannels) bytes, the output outside of targetMaskData, which the patches at its edge are matched against; the mask is ignored without it
+  const void* sourceMaskData;                      // (sourceWidth * sourceHeight) bytes, non-zero where the source may be used, at least one pixel; the CPU backend searches only the bounding box of it and matches only patches that fit into it; pass NULL to use the whole source
+  EbsynthState* state;                             // CPU backend: the run saves its per-level NNFs and outputs here (not with memoryBudgetMB tiling); pass NULL to ignore
+  int   incremental;                               // non-zero: state holds a run with the same source and settings, and only dirtyRect of the target guide changed since; the run redoes the area around it and reuses the rest (an empty rect reuses everything); falls back to a full run when state doesn't match
+  int   dirtyRect[4];                              // x, y, width and height of the changed part of the target guide
+} EbsynthOptions;
+
+#define EBSYNTH_MAX_STATS_ITERS     32
+
+typedef struct EbsynthLevelStats                   // what one pyramid level of a run did; filled in by the CPU backend only
+{
+  int    targetWidth;
+  int    targetHeight;
+  float  seconds;                                  // wall time of the whole level, the phases below included
+  float  initSeconds;                              // allocation and NNF initialization or upscale
+  float  errorSeconds;                             // evaluation of the current matches at the start of every Patch-Match call
+  float  patchmatchSeconds;                        // propagation and random search
+  float  voteSeconds;
+  float  maskSeconds;                              // evaluation and dilation of the stopThresholdPerLevel masks
+  double numPatchEvals;                            // number of patch error evaluations
+  double numEarlyTerminations;                     // evaluations that stopped before the last patch row because the candidate was already worse
+  double numAcceptedPropagation;                   // candidates accepted in the propagation steps
+  double numAcceptedRandomSearch;                  // candidates accepted in the random search steps
+  int    numIterations;                            // number of search-vote iterations, the extra 3x3 pass included
+  float  energy[EBSYNTH_MAX_STATS_ITERS];          // mean patch error over the target after the Patch-Match of each iteration
+} EbsynthLevelStats;
+
+typedef struct EbsynthStats                        // filled in by ebsynthRunEx
+{
+  int   numPyramidLevels;                            // number of levels the run went through
+  float skippedPixelFraction[EBSYNTH_MAX_PYRAMID_LEVELS]; // fraction of target pixels that were not searched and voted again because they fell under stopThresholdPerLevel (coarse first, fine last)
+  float totalSeconds;                              // wall time of the run; CPU backend only from here on
+  float pyramidSeconds;                            // building the source and target guide pyramids
+  float copySeconds;                               // copying the results out
+  int   memoryBudgetExceeded;                      // 1 when even the smallest tiles didn't fit memoryBudgetMB, e.g. because the source pyramid alone takes more, and the run went over it
+  EbsynthLevelStats levels[EBSYNTH_MAX_PYRAMID_LEVELS]; // coarse first, fine last
+} EbsynthStats;
+
+typedef struct EbsynthPlane                        // consecutive channels of an image in caller memory
+{
+  void* data;                                      // the first channel of the top-left pixel
+  int   numChannels;
+  int   pixelStride;                               // bytes from one pixel to the next one in a row
+  int   rowPitch;                                  // bytes from one row to the next one, may be negative for bottom-up images
+} EbsynthPlane;
+
+#define EBSYNTH_MAX_PLANES          EBSYNTH_MAX_GUIDE_CHANNELS
+
+typedef struct EbsynthImage                        // an image whose channels are the channels of its planes in order, e.g. the RGB of several decoded RGBA images (pixelStride 4)
+{
+  int          numPlanes;
+  EbsynthPlane planes[EBSYNTH_MAX_PLANES];
+} EbsynthImage;
+
 EBSYNTH_API
 int ebsynthBackendAvailable(int ebsynthBackend);   // returns non-zero if the specified backend is available
 
@@ -69,6 +140,170 @@ void ebsynthRun(int    ebsynthBackend,             // use BACKEND_CUDA for maxim
                 void*  outputImageData             // (width * height * numStyleChannels) bytes, scan-line order
                 );
 
+EBSYNTH_API
+void ebsynthRunEx(int    ebsynthBackend,           // same as ebsynthRun, additionally takes options and reports what the run did
+                  int    numStyleChannels,
+                  int    numGuideChannels,
+                  int    sourceWidth,
+                  int    sourceHeight,
+                  void*  sourceStyleData,
+                  void*  sourceGuideData,
+                  int    targetWidth,
+                  int    targetHeight,
+                  void*  targetGuideData,
+                  void*  targetModulationData,
+                  float* styleWeights,
+                  float* guideWeights,
+                  float  uniformityWeight,
+                  int    patchSize,
+                  int    voteMode,
+                  int    numPyramidLevels,
+                  int*   numSearchVoteItersPerLevel,
+                  int*   numPatchMatchItersPerLevel,
+                  int*   stopThresholdPerLevel,
+                  int    extraPass3x3,
+                  void*  outputNnfData,
+                  void*  outputImageData,
+                  const EbsynthOptions* options,   // pass NULL for the defaults
+                  EbsynthStats* stats              // filled in when the run finishes; pass NULL to ignore
+                  );
+
+EBSYNTH_API
+void ebsynthRunStrided(int    ebsynthBackend,      // same as ebsynthRunEx with the images described by planes instead of packed buffers; the CPU backend gathers them straight into its padded working copies, without packing them first
+                       int    numStyleChannels,
+                       int    numGuideChannels,
+                       int    sourceWidth,
+                       int    sourceHeight,
+                       const EbsynthImage* sourceStyle,
+                       const EbsynthImage* sourceGuide,
+                       int    targetWidth,
+                       int    targetHeight,
+                       const EbsynthImage* targetGuide,
+                       const EbsynthImage* targetModulation, // pass NULL to switch off the modulation
+                       float* styleWeights,
+                       float* guideWeights,
+                       float  uniformityWeight,
+                       int    patchSize,
+                       int    voteMode,
+                       int    numPyramidLevels,
+                       int*   numSearchVoteItersPerLevel,
+                       int*   numPatchMatchItersPerLevel,
+                       int*   stopThresholdPerLevel,
+                       int    extraPass3x3,
+                       void*  outputNnfData,
+                       const EbsynthImage* outputImage,
+                       const EbsynthOptions* options,
+                       EbsynthStats* stats
+                       );
+
+typedef struct EbsynthContext EbsynthContext;     // keeps the source side of the synthesis across runs, e.g. one keyframe for a whole shot
+
+EBSYNTH_API
+EbsynthContext* ebsynthCreateContext(int ebsynthBackend); // returns NULL if the backend is not available
+
+EBSYNTH_API
+void ebsynthSetContextSource(EbsynthContext* context,   // prepares the source pyramid for all the following runs; the data is copied, so it can be freed afterwards
+                             int    numStyleChannels,
+                             int    numGuideChannels,
+                             int    sourceWidth,
+                             int    sourceHeight,
+                             void*  sourceStyleData,
+                             void*  sourceGuideData
+                             );
+
+EBSYNTH_API
+void ebsynthRunContext(EbsynthContext* context,         // same as ebsynthRunEx with the source of the context; does nothing until a source is set
+                       int    targetWidth,
+                       int    targetHeight,
+                       void*  targetGuideData,
+                       void*  targetModulationData,
+                       float* styleWeights,
+                       float* guideWeights,
+                       float  uniformityWeight,
+                       int    patchSize,
+                       int    voteMode,
+                       int    numPyramidLevels,
+                       int*   numSearchVoteItersPerLevel,
+                       int*   numPatchMatchItersPerLevel,
+                       int*   stopThresholdPerLevel,
+                       int    extraPass3x3,
+                       void*  outputNnfData,
+                       void*  outputImageData,
+                       const EbsynthOptions* options,
+                       EbsynthStats* stats
+                       );
+
+typedef struct EbsynthTarget                       // one target of ebsynthRunContextBatch
+{
+  int    width;
+  int    height;
+  void*  guideData;                                // (width * height * numGuideChannels) bytes, scan-line order
+  void*  modulationData;                           // (width * height * numGuideChannels) bytes, scan-line order; pass NULL to switch off the modulation
+  void*  outputNnfData;                            // (width * height * 2) ints, scan-line order; pass NULL to ignore
+  void*  outputImageData;                          // (width * height * numStyleChannels) bytes, scan-line order
+  EbsynthStats* stats;                             // pass NULL to ignore
+} EbsynthTarget;
+
+EBSYNTH_API
+void ebsynthRunContextBatch(EbsynthContext* context,    // synthesizes many targets against the source of the context in one call; the CPU backend runs them concurrently and splits the threads between them
+                            int    numTargets,
+                            const EbsynthTarget* targets,
+                            float* styleWeights,
+                            float* guideWeights,
+                            float  uniformityWeight,
+                            int    patchSize,
+                            int    voteMode,
+                            int    numPyramidLevels,
+                            int*   numSearchVoteItersPerLevel,
+                            int*   numPatchMatchItersPerLevel,
+                            int*   stopThresholdPerLevel,
+                            int    extraPass3x3,
+                            const EbsynthOptions* options
+                            );
+
+EBSYNTH_API
+void ebsynthDestroyContext(EbsynthContext* context);
+
+EBSYNTH_API
+EbsynthState* ebsynthCreateState(void);            // an empty state, the first run that gets it through EbsynthOptions fills it in
+
+EBSYNTH_API
+void ebsynthDestroyState(EbsynthState* state);
+
+typedef struct EbsynthJob                          // one independent run of ebsynthRunJobs, the fields are the arguments of ebsynthRunEx
+{
+  int    backend;
+  int    numStyleChannels;
+  int    numGuideChannels;
+  int    sourceWidth;
+  int    sourceHeight;
+  void*  sourceStyleData;
+  void*  sourceGuideData;
+  int    targetWidth;
+  int    targetHeight;
+  void*  targetGuideData;
+  void*  targetModulationData;
+  float* styleWeights;
+  float* guideWeights;
+  float  uniformityWeight;
+  int    patchSize;
+  int    voteMode;
+  int    numPyramidLevels;
+  int*   numSearchVoteItersPerLevel;
+  int*   numPatchMatchItersPerLevel;
+  int*   stopThresholdPerLevel;
+  int    extraPass3x3;
+  void*  outputNnfData;
+  void*  outputImageData;
+  const EbsynthOptions* options;
+  EbsynthStats* stats;
+} EbsynthJob;
+
+EBSYNTH_API
+void ebsynthRunJobs(int numJobs,                   // runs many independent jobs; the CPU backend runs small jobs concurrently, one thread each, and gives large ones all the threads
+                    const EbsynthJob* jobs
+                    );
+
 #ifdef __cplusplus
 }
 #endif
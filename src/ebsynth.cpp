@@ -8,33 +8,36 @@
 
 #include <cstdio>
 #include <cmath>
+#include <vector>
 
 EBSYNTH_API
-void ebsynthRun(int    ebsynthBackend,
-                int    numStyleChannels,
-                int    numGuideChannels,
-                int    sourceWidth,
-                int    sourceHeight,
-                void*  sourceStyleData,
-                void*  sourceGuideData,
-                int    targetWidth,
-                int    targetHeight,
-                void*  targetGuideData,
-                void*  targetModulationData,
-                float* styleWeights,
-                float* guideWeights,
-                float  uniformityWeight,
-                int    patchSize,
-                int    voteMode,
-                int    numPyramidLevels,
-                int*   numSearchVoteItersPerLevel,
-                int*   numPatchMatchItersPerLevel,
-                int*   stopThresholdPerLevel,
-                int    extraPass3x3,
-                void*  outputNnfData,
-                void*  outputImageData)
+void ebsynthRunEx(int    ebsynthBackend,
+                  int    numStyleChannels,
+                  int    numGuideChannels,
+                  int    sourceWidth,
+                  int    sourceHeight,
+                  void*  sourceStyleData,
+                  void*  sourceGuideData,
+                  int    targetWidth,
+                  int    targetHeight,
+                  void*  targetGuideData,
+                  void*  targetModulationData,
+                  float* styleWeights,
+                  float* guideWeights,
+                  float  uniformityWeight,
+                  int    patchSize,
+                  int    voteMode,
+                  int    numPyramidLevels,
+                  int*   numSearchVoteItersPerLevel,
+                  int*   numPatchMatchItersPerLevel,
+                  int*   stopThresholdPerLevel,
+                  int    extraPass3x3,
+                  void*  outputNnfData,
+                  void*  outputImageData,
+                  const EbsynthOptions* options,
+                  EbsynthStats* stats)
 {
-  void (*backendDispatch)(int,int,int,int,void*,void*,int,int,void*,void*,float*,float*,float,int,int,int,int*,int*,int*,int,void*,void*) = 0;
+  void (*backendDispatch)(int,int,int,int,void*,void*,int,int,void*,void*,float*,float*,float,int,int,int,int*,int*,int*,int,void*,void*,const EbsynthOptions*,EbsynthStats*) = 0;
   
   if      (ebsynthBackend==EBSYNTH_BACKEND_CPU ) { backendDispatch = ebsynthRunCpu;  }
   else if (ebsynthBackend==EBSYNTH_BACKEND_CUDA) { backendDispatch = ebsynthRunCuda; }
@@ -63,7 +66,182 @@ void ebsynthRun(int    ebsynthBackend,
                     stopThresholdPerLevel,
                     extraPass3x3,
                     outputNnfData,
-                    outputImageData);
+                    outputImageData,
+                    options,
+                    stats);
+  }
+}
+
+EBSYNTH_API
+void ebsynthRun(int    ebsynthBackend,
+                int    numStyleChannels,
+                int    numGuideChannels,
+                int    sourceWidth,
+                int    sourceHeight,
+                void*  sourceStyleData,
+                void*  sourceGuideData,
+                int    targetWidth,
+                int    targetHeight,
+                void*  targetGuideData,
+                void*  targetModulationData,
+                float* styleWeights,
+                float* guideWeights,
+                float  uniformityWeight,
+                int    patchSize,
+                int    voteMode,
+                int    numPyramidLevels,
+                int*   numSearchVoteItersPerLevel,
+                int*   numPatchMatchItersPerLevel,
+                int*   stopThresholdPerLevel,
+                int    extraPass3x3,
+                void*  outputNnfData,
+                void*  outputImageData)
+{
+  ebsynthRunEx(ebsynthBackend,
+               numStyleChannels,
+               numGuideChannels,
+               sourceWidth,
+               sourceHeight,
+               sourceStyleData,
+               sourceGuideData,
+               targetWidth,
+               targetHeight,
+               targetGuideData,
+               targetModulationData,
+               styleWeights,
+               guideWeights,
+               uniformityWeight,
+               patchSize,
+               voteMode,
+               numPyramidLevels,
+               numSearchVoteItersPerLevel,
+               numPatchMatchItersPerLevel,
+               stopThresholdPerLevel,
+               extraPass3x3,
+               outputNnfData,
+               outputImageData,
+               NULL,
+               NULL);
+}
+
+static int numImageChannels(const EbsynthImage* image)
+{
+  if (image==NULL || image->numPlanes<1 || image->numPlanes>EBSYNTH_MAX_PLANES) { return 0; }
+
+  int numChannels = 0;
+  for(int i=0;i<image->numPlanes;i++) { numChannels += image->planes[i].numChannels; }
+  return numChannels;
+}
+
+EBSYNTH_API
+void ebsynthRunStrided(int    ebsynthBackend,
+                       int    numStyleChannels,
+                       int    numGuideChannels,
+                       int    sourceWidth,
+                       int    sourceHeight,
+                       const EbsynthImage* sourceStyle,
+                       const EbsynthImage* sourceGuide,
+                       int    targetWidth,
+                       int    targetHeight,
+                       const EbsynthImage* targetGuide,
+                       const EbsynthImage* targetModulation,
+                       float* styleWeights,
+                       float* guideWeights,
+                       float  uniformityWeight,
+                       int    patchSize,
+                       int    voteMode,
+                       int    numPyramidLevels,
+                       int*   numSearchVoteItersPerLevel,
+                       int*   numPatchMatchItersPerLevel,
+                       int*   stopThresholdPerLevel,
+                       int    extraPass3x3,
+                       void*  outputNnfData,
+                       const EbsynthImage* outputImage,
+                       const EbsynthOptions* options,
+                       EbsynthStats* stats)
+{
+  if (numImageChannels(sourceStyle)!=numStyleChannels ||
+      numImageChannels(sourceGuide)!=numGuideChannels ||
+      numImageChannels(targetGuide)!=numGuideChannels ||
+      (targetModulation!=NULL && numImageChannels(targetModulation)!=numGuideChannels) ||
+      numImageChannels(outputImage)!=numStyleChannels)
+  {
+    fprintf(stderr,"error: the channel counts of the images don't match numStyleChannels=%d and numGuideChannels=%d\n",numStyleChannels,numGuideChannels);
+    return;
+  }
+
+  int backend = -1;
+  if      (ebsynthBackend==EBSYNTH_BACKEND_CPU ) { backend = EBSYNTH_BACKEND_CPU;  }
+  else if (ebsynthBackend==EBSYNTH_BACKEND_CUDA) { backend = EBSYNTH_BACKEND_CUDA; }
+  else if (ebsynthBackend==EBSYNTH_BACKEND_AUTO) { backend = ebsynthBackendAvailableCuda() ? EBSYNTH_BACKEND_CUDA : EBSYNTH_BACKEND_CPU; }
+
+  if (backend==EBSYNTH_BACKEND_CPU)
+  {
+    ebsynthRunStridedCpu(numStyleChannels,
+                         numGuideChannels,
+                         sourceWidth,
+                         sourceHeight,
+                         sourceStyle,
+                         sourceGuide,
+                         targetWidth,
+                         targetHeight,
+                         targetGuide,
+                         targetModulation,
+                         styleWeights,
+                         guideWeights,
+                         uniformityWeight,
+                         patchSize,
+                         voteMode,
+                         numPyramidLevels,
+                         numSearchVoteItersPerLevel,
+                         numPatchMatchItersPerLevel,
+                         stopThresholdPerLevel,
+                         extraPass3x3,
+                         outputNnfData,
+                         outputImage,
+                         options,
+                         stats);
+  }
+  else if (backend==EBSYNTH_BACKEND_CUDA)
+  {
+    // the CUDA backend uploads packed buffers, so pack the planes first
+    std::vector<unsigned char> sourceStyleData(sourceWidth*sourceHeight*numStyleChannels);
+    std::vector<unsigned char> sourceGuideData(sourceWidth*sourceHeight*numGuideChannels);
+    std::vector<unsigned char> targetGuideData(targetWidth*targetHeight*numGuideChannels);
+    std::vector<unsigned char> targetModulationData(targetModulation!=NULL ? targetWidth*targetHeight*numGuideChannels : 0);
+    std::vector<unsigned char> outputImageData(targetWidth*targetHeight*numStyleChannels);
+
+    ebsynthGatherImageCpu(sourceStyle,sourceWidth,sourceHeight,sourceStyleData.data(),numStyleChannels,sourceWidth*numStyleChannels);
+    ebsynthGatherImageCpu(sourceGuide,sourceWidth,sourceHeight,sourceGuideData.data(),numGuideChannels,sourceWidth*numGuideChannels);
+    ebsynthGatherImageCpu(targetGuide,targetWidth,targetHeight,targetGuideData.data(),numGuideChannels,targetWidth*numGuideChannels);
+    if (targetModulation!=NULL) { ebsynthGatherImageCpu(targetModulation,targetWidth,targetHeight,targetModulationData.data(),numGuideChannels,targetWidth*numGuideChannels); }
+
+    ebsynthRunCuda(numStyleChannels,
+                   numGuideChannels,
+                   sourceWidth,
+                   sourceHeight,
+                   sourceStyleData.data(),
+                   sourceGuideData.data(),
+                   targetWidth,
+                   targetHeight,
+                   targetGuideData.data(),
+                   targetModulation!=NULL ? targetModulationData.data() : NULL,
+                   styleWeights,
+                   guideWeights,
+                   uniformityWeight,
+                   patchSize,
+                   voteMode,
+                   numPyramidLevels,
+                   numSearchVoteItersPerLevel,
+                   numPatchMatchItersPerLevel,
+                   stopThresholdPerLevel,
+                   extraPass3x3,
+                   outputNnfData,
+                   outputImageData.data(),
+                   options,
+                   stats);
+
+    ebsynthScatterImageCpu(outputImage,targetWidth,targetHeight,outputImageData.data(),numStyleChannels,targetWidth*numStyleChannels);
   }
 }
 
@@ -77,6 +255,282 @@ int ebsynthBackendAvailable(int ebsynthBackend)
   return 0;
 }
 
+struct EbsynthContext
+{
+  int backend;
+
+  int numStyleChannels;
+  int numGuideChannels;
+  int sourceWidth;
+  int sourceHeight;
+
+  EbsynthSourceCpu* sourceCpu;            // the CPU backend builds the source pyramid once
+
+  std::vector<unsigned char> sourceStyle; // the CUDA backend uploads the source on every run
+  std::vector<unsigned char> sourceGuide;
+};
+
+EBSYNTH_API
+EbsynthContext* ebsynthCreateContext(int ebsynthBackend)
+{
+  int backend = -1;
+
+  if      (ebsynthBackend==EBSYNTH_BACKEND_CPU ) { backend = EBSYNTH_BACKEND_CPU;  }
+  else if (ebsynthBackend==EBSYNTH_BACKEND_CUDA) { backend = EBSYNTH_BACKEND_CUDA; }
+  else if (ebsynthBackend==EBSYNTH_BACKEND_AUTO) { backend = ebsynthBackendAvailableCuda() ? EBSYNTH_BACKEND_CUDA : EBSYNTH_BACKEND_CPU; }
+
+  if (backend<0 || !ebsynthBackendAvailable(backend)) { return NULL; }
+
+  EbsynthContext* context = new EbsynthContext();
+  context->backend = backend;
+  context->numStyleChannels = 0;
+  context->numGuideChannels = 0;
+  context->sourceWidth = 0;
+  context->sourceHeight = 0;
+  context->sourceCpu = NULL;
+
+  return context;
+}
+
+EBSYNTH_API
+void ebsynthSetContextSource(EbsynthContext* context,
+                             int    numStyleChannels,
+                             int    numGuideChannels,
+                             int    sourceWidth,
+                             int    sourceHeight,
+                             void*  sourceStyleData,
+                             void*  sourceGuideData)
+{
+  if (context==NULL) { return; }
+
+  context->numStyleChannels = numStyleChannels;
+  context->numGuideChannels = numGuideChannels;
+  context->sourceWidth = sourceWidth;
+  context->sourceHeight = sourceHeight;
+
+  if (context->backend==EBSYNTH_BACKEND_CPU)
+  {
+    ebsynthDestroySourceCpu(context->sourceCpu);
+    context->sourceCpu = ebsynthCreateSourceCpu(numStyleChannels,
+                                                numGuideChannels,
+                                                sourceWidth,
+                                                sourceHeight,
+                                                sourceStyleData,
+                                                sourceGuideData);
+  }
+  else
+  {
+    const unsigned char* style = (const unsigned char*)sourceStyleData;
+    const unsigned char* guide = (const unsigned char*)sourceGuideData;
+    context->sourceStyle.assign(style,style+sourceWidth*sourceHeight*numStyleChannels);
+    context->sourceGuide.assign(guide,guide+sourceWidth*sourceHeight*numGuideChannels);
+  }
+}
+
+EBSYNTH_API
+void ebsynthRunContext(EbsynthContext* context,
+                       int    targetWidth,
+                       int    targetHeight,
+                       void*  targetGuideData,
+                       void*  targetModulationData,
+                       float* styleWeights,
+                       float* guideWeights,
+                       float  uniformityWeight,
+                       int    patchSize,
+                       int    voteMode,
+                       int    numPyramidLevels,
+                       int*   numSearchVoteItersPerLevel,
+                       int*   numPatchMatchItersPerLevel,
+                       int*   stopThresholdPerLevel,
+                       int    extraPass3x3,
+                       void*  outputNnfData,
+                       void*  outputImageData,
+                       const EbsynthOptions* options,
+                       EbsynthStats* stats)
+{
+  if (context==NULL) { return; }
+
+  if (context->backend==EBSYNTH_BACKEND_CPU)
+  {
+    ebsynthRunSourceCpu(context->sourceCpu,
+                        targetWidth,
+                        targetHeight,
+                        targetGuideData,
+                        targetModulationData,
+                        styleWeights,
+                        guideWeights,
+                        uniformityWeight,
+                        patchSize,
+                        voteMode,
+                        numPyramidLevels,
+                        numSearchVoteItersPerLevel,
+                        numPatchMatchItersPerLevel,
+                        stopThresholdPerLevel,
+                        extraPass3x3,
+                        outputNnfData,
+                        outputImageData,
+                        options,
+                        stats);
+  }
+  else if (!context->sourceStyle.empty())
+  {
+    ebsynthRunCuda(context->numStyleChannels,
+                   context->numGuideChannels,
+                   context->sourceWidth,
+                   context->sourceHeight,
+                   context->sourceStyle.data(),
+                   context->sourceGuide.data(),
+                   targetWidth,
+                   targetHeight,
+                   targetGuideData,
+                   targetModulationData,
+                   styleWeights,
+                   guideWeights,
+                   uniformityWeight,
+                   patchSize,
+                   voteMode,
+                   numPyramidLevels,
+                   numSearchVoteItersPerLevel,
+                   numPatchMatchItersPerLevel,
+                   stopThresholdPerLevel,
+                   extraPass3x3,
+                   outputNnfData,
+                   outputImageData,
+                   options,
+                   stats);
+  }
+}
+
+EBSYNTH_API
+void ebsynthRunContextBatch(EbsynthContext* context,
+                            int    numTargets,
+                            const EbsynthTarget* targets,
+                            float* styleWeights,
+                            float* guideWeights,
+                            float  uniformityWeight,
+                            int    patchSize,
+                            int    voteMode,
+                            int    numPyramidLevels,
+                            int*   numSearchVoteItersPerLevel,
+                            int*   numPatchMatchItersPerLevel,
+                            int*   stopThresholdPerLevel,
+                            int    extraPass3x3,
+                            const EbsynthOptions* options)
+{
+  if (context==NULL) { return; }
+
+  if (context->backend==EBSYNTH_BACKEND_CPU)
+  {
+    ebsynthRunSourceBatchCpu(context->sourceCpu,
+                             numTargets,
+                             targets,
+                             styleWeights,
+                             guideWeights,
+                             uniformityWeight,
+                             patchSize,
+                             voteMode,
+                             numPyramidLevels,
+                             numSearchVoteItersPerLevel,
+                             numPatchMatchItersPerLevel,
+                             stopThresholdPerLevel,
+                             extraPass3x3,
+                             options);
+  }
+  else
+  {
+    // a single target already fills the GPU
+    for(int i=0;i<numTargets;i++)
+    {
+      ebsynthRunContext(context,
+                        targets[i].width,
+                        targets[i].height,
+                        targets[i].guideData,
+                        targets[i].modulationData,
+                        styleWeights,
+                        guideWeights,
+                        uniformityWeight,
+                        patchSize,
+                        voteMode,
+                        numPyramidLevels,
+                        numSearchVoteItersPerLevel,
+                        numPatchMatchItersPerLevel,
+                        stopThresholdPerLevel,
+                        extraPass3x3,
+                        targets[i].outputNnfData,
+                        targets[i].outputImageData,
+                        options,
+                        targets[i].stats);
+    }
+  }
+}
+
+EBSYNTH_API
+void ebsynthRunJobs(int numJobs,const EbsynthJob* jobs)
+{
+  std::vector<EbsynthJob> cpuJobs;
+
+  for(int i=0;i<numJobs;i++)
+  {
+    const EbsynthJob& job = jobs[i];
+
+    if (job.backend==EBSYNTH_BACKEND_CPU ||
+        (job.backend==EBSYNTH_BACKEND_AUTO && !ebsynthBackendAvailableCuda()))
+    {
+      cpuJobs.push_back(job);
+      continue;
+    }
+
+    ebsynthRunEx(job.backend,
+                 job.numStyleChannels,
+                 job.numGuideChannels,
+                 job.sourceWidth,
+                 job.sourceHeight,
+                 job.sourceStyleData,
+                 job.sourceGuideData,
+                 job.targetWidth,
+                 job.targetHeight,
+                 job.targetGuideData,
+                 job.targetModulationData,
+                 job.styleWeights,
+                 job.guideWeights,
+                 job.uniformityWeight,
+                 job.patchSize,
+                 job.voteMode,
+                 job.numPyramidLevels,
+                 job.numSearchVoteItersPerLevel,
+                 job.numPatchMatchItersPerLevel,
+                 job.stopThresholdPerLevel,
+                 job.extraPass3x3,
+                 job.outputNnfData,
+                 job.outputImageData,
+                 job.options,
+                 job.stats);
+  }
+
+  ebsynthRunJobsCpu(int(cpuJobs.size()),cpuJobs.data());
+}
+
+EBSYNTH_API
+void ebsynthDestroyContext(EbsynthContext* context)
+{
+  if (context==NULL) { return; }
+
+  ebsynthDestroySourceCpu(context->sourceCpu);
+  delete context;
+}
+
+EBSYNTH_API
+EbsynthState* ebsynthCreateState(void)
+{
+  return ebsynthCreateStateCpu();
+}
+
+EBSYNTH_API
+void ebsynthDestroyState(EbsynthState* state)
+{
+  ebsynthDestroyStateCpu(state);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include <cstdio>
@@ -85,6 +539,28 @@ int ebsynthBackendAvailable(int ebsynthBackend)
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#else
+#include <io.h>
+#endif
 
 #include "jzq.h"
 
@@ -189,6 +665,33 @@ bool tryToParseStringPairArg(const std::vector<std::string>& args,int* inout_arg
   });
 }
 
+bool tryToParseIntPairArg(const std::vector<std::string>& args,int* inout_argi,const char* name,std::pair<int,int>* out_value,bool* out_fail)
+{
+  return tryToParseArg(args,inout_argi,name,out_fail,[&]
+  {
+    int& argi = *inout_argi;
+    if ((argi+1)<args.size())
+    {
+      try
+      {
+        std::size_t pos0 = 0;
+        std::size_t pos1 = 0;
+        *out_value = std::make_pair(std::stoi(args[argi],&pos0),std::stoi(args[argi+1],&pos1));
+        if (pos0!=args[argi].size() || pos1!=args[argi+1].size()) { printf("error: bad %s arguments '%s %s'\n",name,args[argi].c_str(),args[argi+1].c_str()); return false; }
+        argi++;
+        return true;
+      }
+      catch(...)
+      {
+        printf("error: bad %s arguments '%s %s'\n",name,args[argi].c_str(),args[argi+1].c_str());
+        return false;
+      }
+    }
+    printf("error: missing argument for the %s option\n",name);
+    return false;
+  });
+}
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -202,11 +705,125 @@ unsigned char* tryLoad(const std::string& fileName,int* width,int* height)
   {
     printf("error: failed to load '%s'\n",fileName.c_str());
     printf("%s\n",stbi_failure_reason());
-    exit(1);
   }
   return data;
 }
 
+struct Image
+{
+  int id;                                 // unique for every decoded image, 0 if it isn't cached
+  int width;
+  int height;
+  std::vector<unsigned char> data;        // RGBA
+};
+
+// Tells the versions of a file apart: a file counts as modified when its
+// modification time, to the nanosecond where the platform keeps it, or its
+// size changes.
+struct FileStamp
+{
+  long long seconds;
+  long long nanoseconds;
+  long long size;
+
+  bool operator==(const FileStamp& other) const { return seconds==other.seconds && nanoseconds==other.nanoseconds && size==other.size; }
+};
+
+bool fileStamp(const std::string& fileName,FileStamp* out_stamp)
+{
+  struct stat st;
+  if (stat(fileName.c_str(),&st)!=0) { return false; }
+  out_stamp->seconds = (long long)st.st_mtime;
+#if defined(__APPLE__)
+  out_stamp->nanoseconds = (long long)st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  out_stamp->nanoseconds = 0;
+#else
+  out_stamp->nanoseconds = (long long)st.st_mtim.tv_nsec;
+#endif
+  out_stamp->size = (long long)st.st_size;
+  return true;
+}
+
+// Keeps the decoded images around between jobs, an image is decoded again only
+// when its file is modified. The least recently used images are dropped when
+// there are more than maxImages of them.
+class ImageCache
+{
+public:
+  ImageCache(int maxImages) : maxImages(maxImages),lastId(0),useCounter(0) { }
+
+  std::shared_ptr<const Image> load(const std::string& fileName);
+
+private:
+  struct Entry
+  {
+    FileStamp stamp;
+    long long lastUse;
+    std::shared_ptr<const Image> image;
+  };
+
+  int maxImages;
+  int lastId;
+  long long useCounter;
+  std::map<std::string,Entry> entries;
+};
+
+std::shared_ptr<const Image> decodeImage(const std::string& fileName,int id)
+{
+  int width = 0;
+  int height = 0;
+  unsigned char* data = tryLoad(fileName,&width,&height);
+  if (data==NULL) { return std::shared_ptr<const Image>(); }
+
+  std::shared_ptr<Image> image(new Image());
+  image->id = id;
+  image->width = width;
+  image->height = height;
+  image->data.assign(data,data+width*height*4);
+
+  stbi_image_free(data);
+
+  return image;
+}
+
+std::shared_ptr<const Image> ImageCache::load(const std::string& fileName)
+{
+  FileStamp stamp;
+  const bool stampValid = fileStamp(fileName,&stamp);
+
+  std::map<std::string,Entry>::iterator it = entries.find(fileName);
+  if (it!=entries.end() && stampValid && it->second.stamp==stamp)
+  {
+    it->second.lastUse = ++useCounter;
+    return it->second.image;
+  }
+
+  std::shared_ptr<const Image> image = decodeImage(fileName,++lastId);
+  if (!image || !stampValid) { return image; }
+
+  Entry entry;
+  entry.stamp = stamp;
+  entry.lastUse = ++useCounter;
+  entry.image = image;
+  entries[fileName] = entry;
+
+  while (entries.size()>maxImages)
+  {
+    std::map<std::string,Entry>::iterator oldest = entries.begin();
+    for(it=entries.begin();it!=entries.end();it++) { if (it->second.lastUse<oldest->second.lastUse) { oldest = it; } }
+    entries.erase(oldest);
+  }
+
+  return image;
+}
+
+// Goes through the cache when there is one, otherwise just decodes the image.
+std::shared_ptr<const Image> loadImage(const std::string& fileName,ImageCache* cache)
+{
+  return cache!=NULL ? cache->load(fileName) : decodeImage(fileName,0);
+}
+
 int evalNumChannels(const unsigned char* data,const int numPixels)
 {
   bool isGray = true;
@@ -233,6 +850,21 @@ V2i pyramidLevelSize(const V2i& sizeBase,const int level)
   return V2i(V2f(sizeBase)*std::pow(2.0f,-float(level)));
 }
 
+std::string voteModeToString(const int voteMode)
+{
+  if      (voteMode==EBSYNTH_VOTEMODE_PLAIN)    { return "plain";    }
+  else if (voteMode==EBSYNTH_VOTEMODE_WEIGHTED) { return "weighted"; }
+  return "unknown";
+}
+
+std::string scheduleToString(const int schedule)
+{
+  if      (schedule==EBSYNTH_SCHEDULE_AUTO)     { return "auto";     }
+  else if (schedule==EBSYNTH_SCHEDULE_ROWBANDS) { return "rowbands"; }
+  else if (schedule==EBSYNTH_SCHEDULE_TILED)    { return "tiled";    }
+  return "unknown";
+}
+
 std::string backendToString(const int ebsynthBackend)
 {
   if      (ebsynthBackend==EBSYNTH_BACKEND_CPU)  { return "cpu";  }
@@ -241,167 +873,341 @@ std::string backendToString(const int ebsynthBackend)
   return "unknown";
 }
 
-int main(int argc,char** argv)
+struct Guide
 {
-  if (argc<2)
-  {
-    printf("usage: %s [options]\n",argv[0]);
-    printf("\n");
-    printf("options:\n");
-    printf("  -style <style.png>\n");
-    printf("  -guide <source.png> <target.png>\n");
-    printf("  -output <output.png>\n");
-    printf("  -weight <value>\n");
-    printf("  -uniformity <value>\n");
-    printf("  -patchsize <size>\n");
-    printf("  -pyramidlevels <number>\n");
-    printf("  -searchvoteiters <number>\n");
-    printf("  -patchmatchiters <number>\n");
-    printf("  -stopthreshold <value>\n");
-    printf("  -extrapass3x3\n");
-    printf("  -backend [cpu|cuda]\n");
-    printf("\n");
-    return 1;
-  }
+  std::string    sourceFileName;
+  std::string    targetFileName;
+  float          weight;
 
-  std::string styleFileName;
-  float       styleWeight = -1;
-  std::string outputFileName = "output.png";
+  int                  sourceWidth;
+  int                  sourceHeight;
+  const unsigned char* sourceData;
 
-  struct Guide
-  {
-    std::string    sourceFileName;
-    std::string    targetFileName;
-    float          weight;
+  int                  targetWidth;
+  int                  targetHeight;
+  const unsigned char* targetData;
 
-    int            sourceWidth;
-    int            sourceHeight;
-    unsigned char* sourceData;
+  std::shared_ptr<const Image> sourceImage;
+  std::shared_ptr<const Image> targetImage;
+  
+  int            numChannels;
+};
 
-    int            targetWidth;
-    int            targetHeight;
-    unsigned char* targetData;
-    
-    int            numChannels;
-  };
+// Everything one synthesis needs: the options as parsed from the command
+// line, and the packed images and per-level settings once it's loaded.
+struct Job
+{
+  Job() : styleWeight(-1),
+          outputFileName("output.png"),
+          uniformityWeight(3500),
+          patchSize(5),
+          numPyramidLevels(-1),
+          numSearchVoteIters(6),
+          numPatchMatchIters(4),
+          stopThreshold(5),
+          extraPass3x3(0),
+          voteMode(EBSYNTH_VOTEMODE_PLAIN),
+          schedule(EBSYNTH_SCHEDULE_AUTO),
+          seed(-1),
+          memoryBudgetMB(0),
+          statsJson(false),
+          backend(ebsynthBackendAvailable(EBSYNTH_BACKEND_CUDA) ? EBSYNTH_BACKEND_CUDA : EBSYNTH_BACKEND_CPU) { }
+
+  std::string styleFileName;
+  float       styleWeight;
+  std::string outputFileName;
 
   std::vector<Guide> guides;
 
-  float uniformityWeight = 3500;
-  int patchSize = 5; 
-  int numPyramidLevels = -1;
-  int numSearchVoteIters = 6;
-  int numPatchMatchIters = 4;
-  int stopThreshold = 5;
-  int extraPass3x3 = 0;
-  int backend = ebsynthBackendAvailable(EBSYNTH_BACKEND_CUDA) ? EBSYNTH_BACKEND_CUDA : EBSYNTH_BACKEND_CPU;
+  std::string maskFileName;               // no target mask when it's empty
+  std::string baseFileName;
+  std::string sourceMaskFileName;         // the whole source is used when it's empty
+
+  float uniformityWeight;
+  int   patchSize;
+  int   numPyramidLevels;
+  int   numSearchVoteIters;
+  int   numPatchMatchIters;
+  int   stopThreshold;
+  int   extraPass3x3;
+  int   voteMode;
+  int   schedule;
+  int   seed;
+  int   memoryBudgetMB;
+  bool  statsJson;
+  int   backend;
+
+  int sourceWidth;
+  int sourceHeight;
+  int targetWidth;
+  int targetHeight;
+  int numStyleChannelsTotal;
+  int numGuideChannelsTotal;
+
+  std::string sourceKey;                  // identifies the source side when it comes from an ImageCache, empty otherwise
+
+  std::shared_ptr<const Image> styleImage;  // only kept when loadJob doesn't pack the images
+
+  std::vector<unsigned char> sourceStyle;
+  std::vector<unsigned char> sourceGuides;
+  std::vector<unsigned char> targetGuides;
+  std::vector<unsigned char> targetMask;
+  std::vector<unsigned char> baseImage;
+  std::vector<unsigned char> sourceMask;
+  std::vector<float>         styleWeights;
+  std::vector<float>         guideWeights;
+  std::vector<int>           numSearchVoteItersPerLevel;
+  std::vector<int>           numPatchMatchItersPerLevel;
+  std::vector<int>           stopThresholdPerLevel;
+  std::vector<unsigned char> output;
+
+  EbsynthOptions options;
+  EbsynthStats   stats;
+};
 
+// Options that select how the CLI runs rather than what a job does.
+struct Mode
+{
+  Mode() : firstFrame(0),lastFrame(-1),framesInFlight(3) { }
+
+  std::string jobsFileName;
+  std::string serveAddress;
+  int         firstFrame;
+  int         lastFrame;                  // no sequence when it's less than firstFrame
+  int         framesInFlight;
+};
+
+// Parses the options of one job. The options of Mode are only accepted when
+// out_mode is given, i.e. on the command line.
+bool parseArgs(const std::vector<std::string>& args,Job* out_job,Mode* out_mode)
+{
+  Job& job = *out_job;
+
+  bool fail = false;
+  int argi = 0;
+
+  float* precedingStyleOrGuideWeight = 0;
+  while(argi<args.size() && !fail)
   {
-    std::vector<std::string> args(argc);
-    for(int i=0;i<argc;i++) { args[i] = argv[i]; }
-  
-    bool fail = false;
-    int argi = 1;   
+    float weight;
+    std::pair<std::string,std::string> guidePair;
+    std::pair<std::string,std::string> maskPair;
+    std::pair<int,int> frames;
+    std::string backendName;
+    std::string voteModeName;
+    std::string scheduleName;
+    std::string statsFormat;
 
-    float* precedingStyleOrGuideWeight = 0;
-    while(argi<argc && !fail)
+    if      (tryToParseStringArg(args,&argi,"-style",&job.styleFileName,&fail))
     {
-      float weight;
-      std::pair<std::string,std::string> guidePair;
-      std::string backendName;
-
-      if      (tryToParseStringArg(args,&argi,"-style",&styleFileName,&fail))
-      {
-        styleWeight = -1;
-        precedingStyleOrGuideWeight = &styleWeight;
-        argi++;
-      }
-      else if (tryToParseStringPairArg(args,&argi,"-guide",&guidePair,&fail))
-      {
-        Guide guide;
-        guide.sourceFileName = guidePair.first;
-        guide.targetFileName = guidePair.second;
-        guide.weight = -1;
-        guides.push_back(guide);
-        precedingStyleOrGuideWeight = &guides[guides.size()-1].weight;
-        argi++;
-      }
-      else if (tryToParseStringArg(args,&argi,"-output",&outputFileName,&fail))
-      {
-        argi++;
-      }
-      else if (tryToParseFloatArg(args,&argi,"-weight",&weight,&fail))
-      {
-        if (precedingStyleOrGuideWeight!=0)
-        {
-          if (weight>=0) { *precedingStyleOrGuideWeight = weight; }
-          else { printf("error: weights must be non-negaitve!\n"); return 1; }
-        }
-        else { printf("error: at least one -style or -guide option must precede the -weight option!\n"); return 1; }
-        argi++;
-      }
-      else if (tryToParseFloatArg(args,&argi,"-uniformity",&uniformityWeight,&fail)) { argi++; }
-      else if (tryToParseIntArg(args,&argi,"-patchsize",&patchSize,&fail))
-      {
-        if (patchSize<3)    { printf("error: patchsize is too small!\n"); return 1; }
-        if (patchSize%2==0) { printf("error: patchsize must be an odd number!\n"); return 1; }
-        argi++;
-      }
-      else if (tryToParseIntArg(args,&argi,"-pyramidlevels",&numPyramidLevels,&fail))
-      {
-        if (numPyramidLevels<1) { printf("error: bad argument for -pyramidlevels!\n"); return 1; }
-        argi++;
-      }
-      else if (tryToParseIntArg(args,&argi,"-searchvoteiters",&numSearchVoteIters,&fail))
-      {
-        if (numSearchVoteIters<0) { printf("error: bad argument for -searchvoteiters!\n"); return 1; }
-        argi++;
-      }
-      else if (tryToParseIntArg(args,&argi,"-patchmatchiters",&numPatchMatchIters,&fail))
-      {
-        if (numPatchMatchIters<0) { printf("error: bad argument for -patchmatchiters!\n"); return 1; }
-        argi++;
-      }
-      else if (tryToParseIntArg(args,&argi,"-stopthreshold",&stopThreshold,&fail))
+      job.styleWeight = -1;
+      precedingStyleOrGuideWeight = &job.styleWeight;
+      argi++;
+    }
+    else if (tryToParseStringPairArg(args,&argi,"-guide",&guidePair,&fail))
+    {
+      Guide guide;
+      guide.sourceFileName = guidePair.first;
+      guide.targetFileName = guidePair.second;
+      guide.weight = -1;
+      job.guides.push_back(guide);
+      precedingStyleOrGuideWeight = &job.guides[job.guides.size()-1].weight;
+      argi++;
+    }
+    else if (tryToParseStringPairArg(args,&argi,"-mask",&maskPair,&fail))
+    {
+      job.maskFileName = maskPair.first;
+      job.baseFileName = maskPair.second;
+      argi++;
+    }
+    else if (tryToParseStringArg(args,&argi,"-sourcemask",&job.sourceMaskFileName,&fail))
+    {
+      argi++;
+    }
+    else if (tryToParseStringArg(args,&argi,"-output",&job.outputFileName,&fail))
+    {
+      argi++;
+    }
+    else if (tryToParseFloatArg(args,&argi,"-weight",&weight,&fail))
+    {
+      if (precedingStyleOrGuideWeight!=0)
       {
-        if (stopThreshold<0) { printf("error: bad argument for -stopthreshold!\n"); return 1; }
-        argi++;
+        if (weight>=0) { *precedingStyleOrGuideWeight = weight; }
+        else { printf("error: weights must be non-negaitve!\n"); return false; }
       }
-      else if (tryToParseStringArg(args,&argi,"-backend",&backendName,&fail))
-      {
-        if      (backendName=="cpu" ) { backend = EBSYNTH_BACKEND_CPU; }
-        else if (backendName=="cuda") { backend = EBSYNTH_BACKEND_CUDA; }
-        else { printf("error: unrecognized backend '%s'\n",backendName.c_str()); return 1; }
+      else { printf("error: at least one -style or -guide option must precede the -weight option!\n"); return false; }
+      argi++;
+    }
+    else if (tryToParseFloatArg(args,&argi,"-uniformity",&job.uniformityWeight,&fail)) { argi++; }
+    else if (tryToParseIntArg(args,&argi,"-patchsize",&job.patchSize,&fail))
+    {
+      if (job.patchSize<3)    { printf("error: patchsize is too small!\n"); return false; }
+      if (job.patchSize%2==0) { printf("error: patchsize must be an odd number!\n"); return false; }
+      argi++;
+    }
+    else if (tryToParseIntArg(args,&argi,"-pyramidlevels",&job.numPyramidLevels,&fail))
+    {
+      if (job.numPyramidLevels<1) { printf("error: bad argument for -pyramidlevels!\n"); return false; }
+      argi++;
+    }
+    else if (tryToParseIntArg(args,&argi,"-searchvoteiters",&job.numSearchVoteIters,&fail))
+    {
+      if (job.numSearchVoteIters<0) { printf("error: bad argument for -searchvoteiters!\n"); return false; }
+      argi++;
+    }
+    else if (tryToParseIntArg(args,&argi,"-patchmatchiters",&job.numPatchMatchIters,&fail))
+    {
+      if (job.numPatchMatchIters<0) { printf("error: bad argument for -patchmatchiters!\n"); return false; }
+      argi++;
+    }
+    else if (tryToParseIntArg(args,&argi,"-stopthreshold",&job.stopThreshold,&fail))
+    {
+      if (job.stopThreshold<0) { printf("error: bad argument for -stopthreshold!\n"); return false; }
+      argi++;
+    }
+    else if (tryToParseStringArg(args,&argi,"-backend",&backendName,&fail))
+    {
+      if      (backendName=="cpu" ) { job.backend = EBSYNTH_BACKEND_CPU; }
+      else if (backendName=="cuda") { job.backend = EBSYNTH_BACKEND_CUDA; }
+      else { printf("error: unrecognized backend '%s'\n",backendName.c_str()); return false; }
 
-        if (!ebsynthBackendAvailable(backend)) { printf("error: the %s backend is not available!\n",backendToString(backend).c_str()); return 1; }
+      if (!ebsynthBackendAvailable(job.backend)) { printf("error: the %s backend is not available!\n",backendToString(job.backend).c_str()); return false; }
 
-        argi++;
-      }
-      else if (argi<args.size() && args[argi]=="-extrapass3x3")
-      {
-        extraPass3x3 = 1;
-        argi++;
-      }
-      else
-      {
-        printf("error: unrecognized option '%s'\n",args[argi].c_str());
-        fail = true;
-      }
+      argi++;
+    }
+    else if (tryToParseStringArg(args,&argi,"-votemode",&voteModeName,&fail))
+    {
+      if      (voteModeName=="plain"   ) { job.voteMode = EBSYNTH_VOTEMODE_PLAIN; }
+      else if (voteModeName=="weighted") { job.voteMode = EBSYNTH_VOTEMODE_WEIGHTED; }
+      else { printf("error: unrecognized vote mode '%s'\n",voteModeName.c_str()); return false; }
+      argi++;
+    }
+    else if (tryToParseStringArg(args,&argi,"-schedule",&scheduleName,&fail))
+    {
+      if      (scheduleName=="auto"    ) { job.schedule = EBSYNTH_SCHEDULE_AUTO; }
+      else if (scheduleName=="rowbands") { job.schedule = EBSYNTH_SCHEDULE_ROWBANDS; }
+      else if (scheduleName=="tiled"   ) { job.schedule = EBSYNTH_SCHEDULE_TILED; }
+      else { printf("error: unrecognized schedule '%s'\n",scheduleName.c_str()); return false; }
+      argi++;
+    }
+    else if (tryToParseStringArg(args,&argi,"-stats",&statsFormat,&fail))
+    {
+      if (statsFormat=="json") { job.statsJson = true; }
+      else { printf("error: unrecognized stats format '%s'\n",statsFormat.c_str()); return false; }
+      argi++;
+    }
+    else if (tryToParseIntArg(args,&argi,"-seed",&job.seed,&fail))
+    {
+      if (job.seed<0) { printf("error: bad argument for -seed!\n"); return false; }
+      argi++;
+    }
+    else if (tryToParseIntArg(args,&argi,"-memorybudget",&job.memoryBudgetMB,&fail))
+    {
+      if (job.memoryBudgetMB<0) { printf("error: bad argument for -memorybudget!\n"); return false; }
+      argi++;
+    }
+    else if (out_mode!=0 && tryToParseStringArg(args,&argi,"-jobs",&out_mode->jobsFileName,&fail))
+    {
+      argi++;
+    }
+    else if (out_mode!=0 && tryToParseStringArg(args,&argi,"-serve",&out_mode->serveAddress,&fail))
+    {
+      argi++;
+    }
+    else if (out_mode!=0 && tryToParseIntPairArg(args,&argi,"-frames",&frames,&fail))
+    {
+      if (frames.first<0 || frames.second<frames.first) { printf("error: bad arguments for -frames!\n"); return false; }
+      out_mode->firstFrame = frames.first;
+      out_mode->lastFrame = frames.second;
+      argi++;
+    }
+    else if (out_mode!=0 && tryToParseIntArg(args,&argi,"-inflight",&out_mode->framesInFlight,&fail))
+    {
+      if (out_mode->framesInFlight<1) { printf("error: bad argument for -inflight!\n"); return false; }
+      argi++;
+    }
+    else if (argi<args.size() && args[argi]=="-extrapass3x3")
+    {
+      job.extraPass3x3 = 1;
+      argi++;
+    }
+    else
+    {
+      printf("error: unrecognized option '%s'\n",args[argi].c_str());
+      fail = true;
+    }
+  }
 
+  return !fail;
+}
+
+// Splits a line of a job list into arguments, double quotes group words.
+std::vector<std::string> splitArgs(const std::string& line)
+{
+  std::vector<std::string> args;
+
+  int i = 0;
+  while (i<line.size())
+  {
+    while (i<line.size() && isspace((unsigned char)line[i])) { i++; }
+    if (i>=line.size()) { break; }
+
+    std::string arg;
+    bool quoted = false;
+    while (i<line.size() && (quoted || !isspace((unsigned char)line[i])))
+    {
+      if (line[i]=='"') { quoted = !quoted; }
+      else              { arg += line[i]; }
+      i++;
     }
-    
-    if (fail) { return 1; }
+    args.push_back(arg);
+  }
+
+  return args;
+}
+
+// Reads one line without the line break, returns false at the end of the file.
+bool readLine(FILE* file,std::string* out_line)
+{
+  out_line->clear();
+
+  int c = fgetc(file);
+  if (c==EOF) { return false; }
+
+  while (c!=EOF && c!='\n')
+  {
+    if (c!='\r') { (*out_line) += char(c); }
+    c = fgetc(file);
   }
 
+  return true;
+}
+
+// Loads the images of a parsed job and prepares everything ebsynthRunEx needs.
+// The style and the source guides are taken from sourceCache when it's given.
+// Without packImages the decoded images are kept in the job instead of being
+// packed, for ebsynthRunStrided to read them as they are (see stridedImages).
+bool loadJob(Job* inout_job,ImageCache* sourceCache,const bool packImages)
+{
+  Job& job = *inout_job;
+
+  std::vector<Guide>& guides = job.guides;
   const int numGuides = guides.size();
 
-  int sourceWidth = 0;
-  int sourceHeight = 0;
-  unsigned char* sourceStyleData = tryLoad(styleFileName,&sourceWidth,&sourceHeight);
+  if (job.styleFileName.empty()) { printf("error: missing the -style option\n"); return false; }
+  if (numGuides==0) { printf("error: missing the -guide option\n"); return false; }
+
+  std::shared_ptr<const Image> styleImage = loadImage(job.styleFileName,sourceCache);
+  if (!styleImage) { return false; }
+
+  const int sourceWidth = styleImage->width;
+  const int sourceHeight = styleImage->height;
+  const unsigned char* sourceStyleData = styleImage->data.data();
   const int numStyleChannelsTotal = evalNumChannels(sourceStyleData,sourceWidth*sourceHeight);
 
-  std::vector<unsigned char> sourceStyle(sourceWidth*sourceHeight*numStyleChannelsTotal);
-  for(int xy=0;xy<sourceWidth*sourceHeight;xy++)
+  std::vector<unsigned char>& sourceStyle = job.sourceStyle;
+  sourceStyle.resize(packImages ? sourceWidth*sourceHeight*numStyleChannelsTotal : 0);
+  for(int xy=0;xy<sourceWidth*sourceHeight && packImages;xy++)
   {
     if      (numStyleChannelsTotal>0)  { sourceStyle[xy*numStyleChannelsTotal+0] = sourceStyleData[xy*4+0]; }
     if      (numStyleChannelsTotal==2) { sourceStyle[xy*numStyleChannelsTotal+1] = sourceStyleData[xy*4+3]; }           
@@ -409,20 +1215,36 @@ int main(int argc,char** argv)
     if      (numStyleChannelsTotal>2)  { sourceStyle[xy*numStyleChannelsTotal+2] = sourceStyleData[xy*4+2]; }
     if      (numStyleChannelsTotal>3)  { sourceStyle[xy*numStyleChannelsTotal+3] = sourceStyleData[xy*4+3]; }                 
   }
-  
+
   int targetWidth = 0;
   int targetHeight = 0;
   int numGuideChannelsTotal = 0;
 
+  bool ok = true;
   for(int i=0;i<numGuides;i++)
+  {
+    guides[i].sourceData = NULL;
+    guides[i].targetData = NULL;
+  }
+
+  for(int i=0;i<numGuides && ok;i++)
   {
     Guide& guide = guides[i];
 
-    guide.sourceData = tryLoad(guide.sourceFileName,&guide.sourceWidth,&guide.sourceHeight);
-    guide.targetData = tryLoad(guide.targetFileName,&guide.targetWidth,&guide.targetHeight);
+    guide.sourceImage = loadImage(guide.sourceFileName,sourceCache);
+    if (!guide.sourceImage) { ok = false; break; }
+    guide.targetImage = loadImage(guide.targetFileName,NULL);
+    if (!guide.targetImage) { ok = false; break; }
+
+    guide.sourceWidth  = guide.sourceImage->width;
+    guide.sourceHeight = guide.sourceImage->height;
+    guide.sourceData   = guide.sourceImage->data.data();
+    guide.targetWidth  = guide.targetImage->width;
+    guide.targetHeight = guide.targetImage->height;
+    guide.targetData   = guide.targetImage->data.data();
       
-    if              (guide.sourceWidth!=sourceWidth || guide.sourceHeight!=sourceHeight)  { printf("error: source guide '%s' doesn't match the resolution of '%s'\n",guide.sourceFileName.c_str(),styleFileName.c_str()); return 1; }      
-    if      (i>0 && (guide.targetWidth!=targetWidth || guide.targetHeight!=targetHeight)) { printf("error: target guide '%s' doesn't match the resolution of '%s'\n",guide.targetFileName.c_str(),guides[0].targetFileName.c_str()); return 1; }
+    if              (guide.sourceWidth!=sourceWidth || guide.sourceHeight!=sourceHeight)  { printf("error: source guide '%s' doesn't match the resolution of '%s'\n",guide.sourceFileName.c_str(),job.styleFileName.c_str()); ok = false; break; }      
+    if      (i>0 && (guide.targetWidth!=targetWidth || guide.targetHeight!=targetHeight)) { printf("error: target guide '%s' doesn't match the resolution of '%s'\n",guide.targetFileName.c_str(),guides[0].targetFileName.c_str()); ok = false; break; }
     else if (i==0) { targetWidth = guide.targetWidth; targetHeight = guide.targetHeight; }
 
     guide.numChannels = std::max(evalNumChannels(guide.sourceData,sourceWidth*sourceHeight),
@@ -431,52 +1253,139 @@ int main(int argc,char** argv)
     numGuideChannelsTotal += guide.numChannels;
   }
   
-  if (numStyleChannelsTotal>EBSYNTH_MAX_STYLE_CHANNELS) { printf("error: too many style channels (%d), maximum number is %d\n",numStyleChannelsTotal,EBSYNTH_MAX_STYLE_CHANNELS); return 1; }
-  if (numGuideChannelsTotal>EBSYNTH_MAX_GUIDE_CHANNELS) { printf("error: too many guide channels (%d), maximum number is %d\n",numGuideChannelsTotal,EBSYNTH_MAX_GUIDE_CHANNELS); return 1; }
+  if (ok && numStyleChannelsTotal>EBSYNTH_MAX_STYLE_CHANNELS) { printf("error: too many style channels (%d), maximum number is %d\n",numStyleChannelsTotal,EBSYNTH_MAX_STYLE_CHANNELS); ok = false; }
+  if (ok && numGuideChannelsTotal>EBSYNTH_MAX_GUIDE_CHANNELS) { printf("error: too many guide channels (%d), maximum number is %d\n",numGuideChannelsTotal,EBSYNTH_MAX_GUIDE_CHANNELS); ok = false; }
 
-  std::vector<unsigned char> sourceGuides(sourceWidth*sourceHeight*numGuideChannelsTotal);
-  for(int xy=0;xy<sourceWidth*sourceHeight;xy++)
+  // the mask and the base image are always packed, they're passed through EbsynthOptions
+  if (ok && !job.maskFileName.empty())
   {
-    int c = 0;
-    for(int i=0;i<numGuides;i++)
-    { 
-      const int numChannels = guides[i].numChannels;  
+    std::shared_ptr<const Image> maskImage = loadImage(job.maskFileName,NULL);
+    std::shared_ptr<const Image> baseImage = maskImage ? loadImage(job.baseFileName,NULL) : std::shared_ptr<const Image>();
 
-      if      (numChannels>0)  { sourceGuides[xy*numGuideChannelsTotal+c+0] = guides[i].sourceData[xy*4+0]; }
-      if      (numChannels==2) { sourceGuides[xy*numGuideChannelsTotal+c+1] = guides[i].sourceData[xy*4+3]; }           
-      else if (numChannels>1)  { sourceGuides[xy*numGuideChannelsTotal+c+1] = guides[i].sourceData[xy*4+1]; }
-      if      (numChannels>2)  { sourceGuides[xy*numGuideChannelsTotal+c+2] = guides[i].sourceData[xy*4+2]; }
-      if      (numChannels>3)  { sourceGuides[xy*numGuideChannelsTotal+c+3] = guides[i].sourceData[xy*4+3]; }            
-      
-      c += numChannels;
+    if      (!maskImage || !baseImage) { ok = false; }
+    else if (maskImage->width!=targetWidth || maskImage->height!=targetHeight) { printf("error: mask '%s' doesn't match the resolution of '%s'\n",job.maskFileName.c_str(),guides[0].targetFileName.c_str()); ok = false; }
+    else if (baseImage->width!=targetWidth || baseImage->height!=targetHeight) { printf("error: base image '%s' doesn't match the resolution of '%s'\n",job.baseFileName.c_str(),guides[0].targetFileName.c_str()); ok = false; }
+    else
+    {
+      const unsigned char* maskData = maskImage->data.data();
+      const unsigned char* baseData = baseImage->data.data();
+
+      std::vector<unsigned char>& targetMask = job.targetMask;
+      targetMask.resize(targetWidth*targetHeight);
+      for(int xy=0;xy<targetWidth*targetHeight;xy++) { targetMask[xy] = maskData[xy*4+0]!=0 ? 255 : 0; }
+
+      std::vector<unsigned char>& base = job.baseImage;
+      base.resize(targetWidth*targetHeight*numStyleChannelsTotal);
+      for(int xy=0;xy<targetWidth*targetHeight;xy++)
+      {
+        if      (numStyleChannelsTotal>0)  { base[xy*numStyleChannelsTotal+0] = baseData[xy*4+0]; }
+        if      (numStyleChannelsTotal==2) { base[xy*numStyleChannelsTotal+1] = baseData[xy*4+3]; }
+        else if (numStyleChannelsTotal>1)  { base[xy*numStyleChannelsTotal+1] = baseData[xy*4+1]; }
+        if      (numStyleChannelsTotal>2)  { base[xy*numStyleChannelsTotal+2] = baseData[xy*4+2]; }
+        if      (numStyleChannelsTotal>3)  { base[xy*numStyleChannelsTotal+3] = baseData[xy*4+3]; }
+      }
     }
   }
 
-  std::vector<unsigned char> targetGuides(targetWidth*targetHeight*numGuideChannelsTotal);
-  for(int xy=0;xy<targetWidth*targetHeight;xy++)
+  if (ok && !job.sourceMaskFileName.empty())
   {
-    int c = 0;
-    for(int i=0;i<numGuides;i++)
-    { 
-      const int numChannels = guides[i].numChannels;  
+    std::shared_ptr<const Image> sourceMaskImage = loadImage(job.sourceMaskFileName,NULL);
 
-      if      (numChannels>0)  { targetGuides[xy*numGuideChannelsTotal+c+0] = guides[i].targetData[xy*4+0]; }
-      if      (numChannels==2) { targetGuides[xy*numGuideChannelsTotal+c+1] = guides[i].targetData[xy*4+3]; }           
-      else if (numChannels>1)  { targetGuides[xy*numGuideChannelsTotal+c+1] = guides[i].targetData[xy*4+1]; }
-      if      (numChannels>2)  { targetGuides[xy*numGuideChannelsTotal+c+2] = guides[i].targetData[xy*4+2]; }
-      if      (numChannels>3)  { targetGuides[xy*numGuideChannelsTotal+c+3] = guides[i].targetData[xy*4+3]; }            
-      
-      c += numChannels;
+    if      (!sourceMaskImage) { ok = false; }
+    else if (sourceMaskImage->width!=sourceWidth || sourceMaskImage->height!=sourceHeight) { printf("error: source mask '%s' doesn't match the resolution of '%s'\n",job.sourceMaskFileName.c_str(),job.styleFileName.c_str()); ok = false; }
+    else
+    {
+      const unsigned char* maskData = sourceMaskImage->data.data();
+
+      std::vector<unsigned char>& sourceMask = job.sourceMask;
+      sourceMask.resize(sourceWidth*sourceHeight);
+      int numAllowed = 0;
+      for(int xy=0;xy<sourceWidth*sourceHeight;xy++) { sourceMask[xy] = maskData[xy*4+0]!=0 ? 255 : 0; numAllowed += sourceMask[xy]!=0; }
+
+      if (numAllowed==0) { printf("error: source mask '%s' is empty\n",job.sourceMaskFileName.c_str()); ok = false; }
+    }
+  }
+
+  if (ok && packImages)
+  {
+    std::vector<unsigned char>& sourceGuides = job.sourceGuides;
+    sourceGuides.resize(sourceWidth*sourceHeight*numGuideChannelsTotal);
+    for(int xy=0;xy<sourceWidth*sourceHeight;xy++)
+    {
+      int c = 0;
+      for(int i=0;i<numGuides;i++)
+      { 
+        const int numChannels = guides[i].numChannels;  
+
+        if      (numChannels>0)  { sourceGuides[xy*numGuideChannelsTotal+c+0] = guides[i].sourceData[xy*4+0]; }
+        if      (numChannels==2) { sourceGuides[xy*numGuideChannelsTotal+c+1] = guides[i].sourceData[xy*4+3]; }           
+        else if (numChannels>1)  { sourceGuides[xy*numGuideChannelsTotal+c+1] = guides[i].sourceData[xy*4+1]; }
+        if      (numChannels>2)  { sourceGuides[xy*numGuideChannelsTotal+c+2] = guides[i].sourceData[xy*4+2]; }
+        if      (numChannels>3)  { sourceGuides[xy*numGuideChannelsTotal+c+3] = guides[i].sourceData[xy*4+3]; }            
+        
+        c += numChannels;
+      }
+    }
+
+    std::vector<unsigned char>& targetGuides = job.targetGuides;
+    targetGuides.resize(targetWidth*targetHeight*numGuideChannelsTotal);
+    for(int xy=0;xy<targetWidth*targetHeight;xy++)
+    {
+      int c = 0;
+      for(int i=0;i<numGuides;i++)
+      { 
+        const int numChannels = guides[i].numChannels;  
+
+        if      (numChannels>0)  { targetGuides[xy*numGuideChannelsTotal+c+0] = guides[i].targetData[xy*4+0]; }
+        if      (numChannels==2) { targetGuides[xy*numGuideChannelsTotal+c+1] = guides[i].targetData[xy*4+3]; }           
+        else if (numChannels>1)  { targetGuides[xy*numGuideChannelsTotal+c+1] = guides[i].targetData[xy*4+1]; }
+        if      (numChannels>2)  { targetGuides[xy*numGuideChannelsTotal+c+2] = guides[i].targetData[xy*4+2]; }
+        if      (numChannels>3)  { targetGuides[xy*numGuideChannelsTotal+c+3] = guides[i].targetData[xy*4+3]; }            
+        
+        c += numChannels;
+      }
     }
   }
 
-  std::vector<float> styleWeights(numStyleChannelsTotal);
-  if (styleWeight<0) { styleWeight = 1.0f; }
-  for(int i=0;i<numStyleChannelsTotal;i++) { styleWeights[i] = styleWeight / float(numStyleChannelsTotal); }
+  if (ok && sourceCache!=NULL)
+  {
+    std::ostringstream key;
+    key << job.backend << ":" << styleImage->id;
+    for(int i=0;i<numGuides;i++) { key << ":" << guides[i].sourceImage->id << "/" << guides[i].numChannels; }
+    job.sourceKey = key.str();
+  }
+
+  for(int i=0;i<numGuides;i++)
+  {
+    guides[i].sourceData = NULL;
+    guides[i].targetData = NULL;
+    if (packImages || !ok)
+    {
+      guides[i].sourceImage.reset();
+      guides[i].targetImage.reset();
+    }
+  }
+
+  if (!ok) { return false; }
+
+  if (!packImages) { job.styleImage = styleImage; }
+
+  job.sourceWidth = sourceWidth;
+  job.sourceHeight = sourceHeight;
+  job.targetWidth = targetWidth;
+  job.targetHeight = targetHeight;
+  job.numStyleChannelsTotal = numStyleChannelsTotal;
+  job.numGuideChannelsTotal = numGuideChannelsTotal;
+
+  std::vector<float>& styleWeights = job.styleWeights;
+  styleWeights.resize(numStyleChannelsTotal);
+  if (job.styleWeight<0) { job.styleWeight = 1.0f; }
+  for(int i=0;i<numStyleChannelsTotal;i++) { styleWeights[i] = job.styleWeight / float(numStyleChannelsTotal); }
 
   for(int i=0;i<numGuides;i++) { if (guides[i].weight<0) { guides[i].weight = 1.0f/float(numGuides); } }
 
-  std::vector<float> guideWeights(numGuideChannelsTotal);
+  std::vector<float>& guideWeights = job.guideWeights;
+  guideWeights.resize(numGuideChannelsTotal);
   {
     int c = 0;
     for(int i=0;i<numGuides;i++)
@@ -495,72 +1404,799 @@ int main(int argc,char** argv)
   int maxPyramidLevels = 0;
   for(int level=32;level>=0;level--)
   {
-    if (min(pyramidLevelSize(std::min(V2i(sourceWidth,sourceHeight),V2i(targetWidth,targetHeight)),level)) >= (2*patchSize+1))
+    if (min(pyramidLevelSize(std::min(V2i(sourceWidth,sourceHeight),V2i(targetWidth,targetHeight)),level)) >= (2*job.patchSize+1))
     {
       maxPyramidLevels = level+1;
       break;
     }
   }
 
-  if (numPyramidLevels==-1) { numPyramidLevels = maxPyramidLevels; }
-  numPyramidLevels = std::min(numPyramidLevels,maxPyramidLevels); 
-
-  std::vector<int> numSearchVoteItersPerLevel(numPyramidLevels);
-  std::vector<int> numPatchMatchItersPerLevel(numPyramidLevels);
-  std::vector<int> stopThresholdPerLevel(numPyramidLevels);
-  for(int i=0;i<numPyramidLevels;i++)
-  {
-    numSearchVoteItersPerLevel[i] = numSearchVoteIters;
-    numPatchMatchItersPerLevel[i] = numPatchMatchIters;
-    stopThresholdPerLevel[i] = stopThreshold;
-  }
-
-  std::vector<unsigned char> output(targetWidth*targetHeight*numStyleChannelsTotal);
-
-  printf("uniformity: %.0f\n",uniformityWeight);
-  printf("patchsize: %d\n",patchSize);
-  printf("pyramidlevels: %d\n",numPyramidLevels);
-  printf("searchvoteiters: %d\n",numSearchVoteIters);
-  printf("patchmatchiters: %d\n",numPatchMatchIters);
-  printf("stopthreshold: %d\n",stopThreshold);
-  printf("extrapass3x3: %s\n",extraPass3x3!=0?"yes":"no");
-  printf("backend: %s\n",backendToString(backend).c_str());
-
-  ebsynthRun(backend,
-             numStyleChannelsTotal,
-             numGuideChannelsTotal,
-             sourceWidth,
-             sourceHeight,
-             sourceStyle.data(),
-             sourceGuides.data(),
-             targetWidth,
-             targetHeight,
-             targetGuides.data(),
-             NULL,
-             styleWeights.data(),
-             guideWeights.data(),
-             uniformityWeight,
-             patchSize,
-             EBSYNTH_VOTEMODE_PLAIN,
-             numPyramidLevels,
-             numSearchVoteItersPerLevel.data(),
-             numPatchMatchItersPerLevel.data(),
-             stopThresholdPerLevel.data(),
-             extraPass3x3,
-             NULL,
-             output.data());
-
-  stbi_write_png(outputFileName.c_str(),targetWidth,targetHeight,numStyleChannelsTotal,output.data(),numStyleChannelsTotal*targetWidth);
-
-  printf("result was written to %s\n",outputFileName.c_str());
-
-  stbi_image_free(sourceStyleData);
+  if (job.numPyramidLevels==-1) { job.numPyramidLevels = maxPyramidLevels; }
+  job.numPyramidLevels = std::min(job.numPyramidLevels,maxPyramidLevels); 
 
-  for(int i=0;i<numGuides;i++)
+  const int numPyramidLevels = job.numPyramidLevels;
+  job.numSearchVoteItersPerLevel.assign(numPyramidLevels,job.numSearchVoteIters);
+  job.numPatchMatchItersPerLevel.assign(numPyramidLevels,job.numPatchMatchIters);
+  job.stopThresholdPerLevel.assign(numPyramidLevels,job.stopThreshold);
+
+  job.output.resize(targetWidth*targetHeight*numStyleChannelsTotal);
+
+  EbsynthOptions options = { 0 };
+  options.schedule = job.schedule;
+  options.deterministic = job.seed>=0 ? 1 : 0;
+  options.seed = job.seed>=0 ? (unsigned int)job.seed : 0;
+  options.memoryBudgetMB = job.memoryBudgetMB;
+  options.targetMaskData = job.targetMask.empty() ? NULL : job.targetMask.data();
+  options.baseImageData = job.baseImage.empty() ? NULL : job.baseImage.data();
+  options.sourceMaskData = job.sourceMask.empty() ? NULL : job.sourceMask.data();
+  job.options = options;
+
+  EbsynthStats stats = { 0 };
+  job.stats = stats;
+
+  return true;
+}
+
+EbsynthJob ebsynthJob(Job& job)
+{
+  EbsynthJob ej = { 0 };
+
+  ej.backend                    = job.backend;
+  ej.numStyleChannels           = job.numStyleChannelsTotal;
+  ej.numGuideChannels           = job.numGuideChannelsTotal;
+  ej.sourceWidth                = job.sourceWidth;
+  ej.sourceHeight               = job.sourceHeight;
+  ej.sourceStyleData            = job.sourceStyle.data();
+  ej.sourceGuideData            = job.sourceGuides.data();
+  ej.targetWidth                = job.targetWidth;
+  ej.targetHeight               = job.targetHeight;
+  ej.targetGuideData            = job.targetGuides.data();
+  ej.targetModulationData       = NULL;
+  ej.styleWeights               = job.styleWeights.data();
+  ej.guideWeights               = job.guideWeights.data();
+  ej.uniformityWeight           = job.uniformityWeight;
+  ej.patchSize                  = job.patchSize;
+  ej.voteMode                   = job.voteMode;
+  ej.numPyramidLevels           = job.numPyramidLevels;
+  ej.numSearchVoteItersPerLevel = job.numSearchVoteItersPerLevel.data();
+  ej.numPatchMatchItersPerLevel = job.numPatchMatchItersPerLevel.data();
+  ej.stopThresholdPerLevel      = job.stopThresholdPerLevel.data();
+  ej.extraPass3x3               = job.extraPass3x3;
+  ej.outputNnfData              = NULL;
+  ej.outputImageData            = job.output.data();
+  ej.options                    = &job.options;
+  ej.stats                      = &job.stats;
+
+  return ej;
+}
+
+// Adds the channels evalNumChannels picked from a decoded RGBA image (R, RA,
+// RGB or RGBA) to an EbsynthImage as planes pointing right into the image.
+void addPlanes(EbsynthImage* image,const Image& rgba,const int numChannels)
+{
+  unsigned char* data = (unsigned char*)rgba.data.data();
+
+  EbsynthPlane plane = { data,numChannels==2 ? 1 : numChannels,4,rgba.width*4 };
+  image->planes[image->numPlanes++] = plane;
+
+  if (numChannels==2)
+  {
+    plane.data = data+3;
+    image->planes[image->numPlanes++] = plane;
+  }
+}
+
+// Describes the images of a job loaded without packing them, so the library
+// reads the decoded images and writes the output buffer without extra copies.
+void stridedImages(Job& job,EbsynthImage* sourceStyle,EbsynthImage* sourceGuide,EbsynthImage* targetGuide,EbsynthImage* outputImage)
+{
+  addPlanes(sourceStyle,*job.styleImage,job.numStyleChannelsTotal);
+
+  for(int i=0;i<int(job.guides.size());i++)
+  {
+    addPlanes(sourceGuide,*job.guides[i].sourceImage,job.guides[i].numChannels);
+    addPlanes(targetGuide,*job.guides[i].targetImage,job.guides[i].numChannels);
+  }
+
+  const EbsynthPlane output = { job.output.data(),job.numStyleChannelsTotal,job.numStyleChannelsTotal,job.targetWidth*job.numStyleChannelsTotal };
+  outputImage->numPlanes = 1;
+  outputImage->planes[0] = output;
+}
+
+void writeOutput(const Job& job)
+{
+  stbi_write_png(job.outputFileName.c_str(),job.targetWidth,job.targetHeight,job.numStyleChannelsTotal,job.output.data(),job.numStyleChannelsTotal*job.targetWidth);
+}
+
+// Escapes a string for use inside a JSON string literal.
+std::string jsonEscape(const std::string& text)
+{
+  std::string escaped;
+  for(int i=0;i<text.size();i++)
+  {
+    const unsigned char c = text[i];
+    if      (c=='"' || c=='\\') { escaped += '\\'; escaped += char(c); }
+    else if (c<0x20)            { char buffer[8]; snprintf(buffer,sizeof(buffer),"\\u%04x",c); escaped += buffer; }
+    else                        { escaped += char(c); }
+  }
+  return escaped;
+}
+
+// Prints the stats of a finished job as a single line of JSON.
+void printStatsJson(FILE* out,const Job& job)
+{
+  const EbsynthStats& stats = job.stats;
+
+  fprintf(out,"{\"output\":\"%s\",\"backend\":\"%s\",\"sourceWidth\":%d,\"sourceHeight\":%d,\"targetWidth\":%d,\"targetHeight\":%d,",
+          jsonEscape(job.outputFileName).c_str(),backendToString(job.backend).c_str(),job.sourceWidth,job.sourceHeight,job.targetWidth,job.targetHeight);
+  fprintf(out,"\"totalSeconds\":%.6f,\"pyramidSeconds\":%.6f,\"copySeconds\":%.6f,\"memoryBudgetExceeded\":%s,\"levels\":[",
+          stats.totalSeconds,stats.pyramidSeconds,stats.copySeconds,stats.memoryBudgetExceeded ? "true" : "false");
+
+  for(int level=0;level<std::min(stats.numPyramidLevels,EBSYNTH_MAX_PYRAMID_LEVELS);level++)
   {
-    stbi_image_free(guides[i].sourceData);
-    stbi_image_free(guides[i].targetData);
+    const EbsynthLevelStats& ls = stats.levels[level];
+
+    fprintf(out,"%s{\"level\":%d,\"targetWidth\":%d,\"targetHeight\":%d,",level>0?",":"",level,ls.targetWidth,ls.targetHeight);
+    fprintf(out,"\"seconds\":%.6f,\"initSeconds\":%.6f,\"errorSeconds\":%.6f,\"patchmatchSeconds\":%.6f,\"voteSeconds\":%.6f,\"maskSeconds\":%.6f,",
+            ls.seconds,ls.initSeconds,ls.errorSeconds,ls.patchmatchSeconds,ls.voteSeconds,ls.maskSeconds);
+    fprintf(out,"\"skippedPixelFraction\":%.4f,\"patchEvals\":%.0f,\"earlyTerminationRate\":%.4f,\"acceptedPropagation\":%.0f,\"acceptedRandomSearch\":%.0f,\"energy\":[",
+            stats.skippedPixelFraction[level],ls.numPatchEvals,ls.numPatchEvals>0 ? ls.numEarlyTerminations/ls.numPatchEvals : 0.0,ls.numAcceptedPropagation,ls.numAcceptedRandomSearch);
+    for(int i=0;i<std::min(ls.numIterations,EBSYNTH_MAX_STATS_ITERS);i++) { fprintf(out,"%s%.3f",i>0?",":"",ls.energy[i]); }
+    fprintf(out,"]}");
   }
+
+  fprintf(out,"]}\n");
+  fflush(out);
+}
+
+// Runs the jobs listed in a file, one job per line with the same options as
+// on the command line, which act as defaults for every job. The jobs are
+// loaded and run in chunks so that memory stays bounded for long lists.
+int runJobList(const std::string& jobsFileName,const Job& defaultJob)
+{
+  FILE* file = fopen(jobsFileName.c_str(),"rb");
+  if (file==NULL) { printf("error: failed to open '%s'\n",jobsFileName.c_str()); return 1; }
+
+  std::vector<Job> jobs;
+  {
+    std::string line;
+    int lineNumber = 0;
+    while (readLine(file,&line))
+    {
+      lineNumber++;
+      const std::vector<std::string> args = splitArgs(line);
+      if (args.empty() || args[0][0]=='#') { continue; }
+
+      Job job = defaultJob;
+      if (!parseArgs(args,&job,0)) { printf("error: bad job on line %d of '%s'\n",lineNumber,jobsFileName.c_str()); fclose(file); return 1; }
+      jobs.push_back(job);
+    }
+  }
+  fclose(file);
+
+  const int chunkSize = 64;
+
+  const auto startTime = std::chrono::steady_clock::now();
+
+  int numFailedJobs = 0;
+  for(int chunkStart=0;chunkStart<jobs.size();chunkStart+=chunkSize)
+  {
+    const int chunkEnd = std::min(chunkStart+chunkSize,int(jobs.size()));
+
+    std::vector<int> loadedJobs;
+    std::vector<EbsynthJob> ebsynthJobs;
+    for(int i=chunkStart;i<chunkEnd;i++)
+    {
+      if (!loadJob(&jobs[i],NULL,true)) { printf("error: skipping job %d\n",i+1); numFailedJobs++; continue; }
+      loadedJobs.push_back(i);
+      ebsynthJobs.push_back(ebsynthJob(jobs[i]));
+    }
+
+    ebsynthRunJobs(int(ebsynthJobs.size()),ebsynthJobs.data());
+
+    for(int j=0;j<loadedJobs.size();j++)
+    {
+      writeOutput(jobs[loadedJobs[j]]);
+      if (jobs[loadedJobs[j]].statsJson) { printStatsJson(stdout,jobs[loadedJobs[j]]); }
+      else                               { printf("result was written to %s\n",jobs[loadedJobs[j]].outputFileName.c_str()); }
+      jobs[loadedJobs[j]] = Job();
+    }
+  }
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-startTime).count();
+  const int numDoneJobs = int(jobs.size())-numFailedJobs;
+
+  // With -stats json the standard output holds only the stats lines.
+  FILE* summary = defaultJob.statsJson ? stderr : stdout;
+  fprintf(summary,"%d jobs done in %.2f s (%.2f jobs/s)",numDoneJobs,seconds,seconds>0 ? double(numDoneJobs)/seconds : 0.0);
+  if (numFailedJobs>0) { fprintf(summary,", %d failed",numFailedJobs); }
+  fprintf(summary,"\n");
+
+  return numFailedJobs>0 ? 1 : 0;
+}
+
+// Source pyramids of the recently used sources, keyed by Job::sourceKey. The
+// least recently used one is destroyed when there are more than maxContexts.
+class ContextCache
+{
+public:
+  ContextCache(int maxContexts) : maxContexts(maxContexts),useCounter(0) { }
+
+  ~ContextCache()
+  {
+    for(std::map<std::string,Entry>::iterator it=entries.begin();it!=entries.end();it++) { ebsynthDestroyContext(it->second.context); }
+  }
+
+  EbsynthContext* get(Job& job)
+  {
+    std::map<std::string,Entry>::iterator it = entries.find(job.sourceKey);
+    if (it!=entries.end())
+    {
+      it->second.lastUse = ++useCounter;
+      return it->second.context;
+    }
+
+    EbsynthContext* context = ebsynthCreateContext(job.backend);
+    if (context==NULL) { return NULL; }
+
+    ebsynthSetContextSource(context,
+                            job.numStyleChannelsTotal,
+                            job.numGuideChannelsTotal,
+                            job.sourceWidth,
+                            job.sourceHeight,
+                            job.sourceStyle.data(),
+                            job.sourceGuides.data());
+
+    Entry entry;
+    entry.lastUse = ++useCounter;
+    entry.context = context;
+    entries[job.sourceKey] = entry;
+
+    while (entries.size()>maxContexts)
+    {
+      std::map<std::string,Entry>::iterator oldest = entries.begin();
+      for(it=entries.begin();it!=entries.end();it++) { if (it->second.lastUse<oldest->second.lastUse) { oldest = it; } }
+      ebsynthDestroyContext(oldest->second.context);
+      entries.erase(oldest);
+    }
+
+    return context;
+  }
+
+private:
+  struct Entry
+  {
+    long long lastUse;
+    EbsynthContext* context;
+  };
+
+  int maxContexts;
+  long long useCounter;
+  std::map<std::string,Entry> entries;
+};
+
+// Keeps the state of the last run for every output file along with the target
+// guides and the settings it was made with. When a job repeats an earlier one
+// with the target guides partly repainted, only the area around the repainted
+// pixels is synthesized again.
+class StateCache
+{
+public:
+  StateCache(int maxStates) : maxStates(maxStates),useCounter(0) { }
+
+  ~StateCache()
+  {
+    for(std::map<std::string,Entry>::iterator it=entries.begin();it!=entries.end();it++) { ebsynthDestroyState(it->second.state); }
+  }
+
+  // Points the options of the job to its state, and sets up an incremental
+  // run when the state is from the same job with different target guides.
+  void prepare(Job& job)
+  {
+    // the mask and the base image aren't compared, so such jobs always run whole
+    if (!job.maskFileName.empty()) { return; }
+
+    // the source mask isn't cached, so its file stamp tells its versions apart
+    FileStamp sourceMaskStamp = { 0,0,0 };
+    if (!job.sourceMaskFileName.empty()) { fileStamp(job.sourceMaskFileName,&sourceMaskStamp); }
+
+    std::ostringstream key;
+    key << job.sourceKey << ":" << job.sourceMaskFileName << "@" << sourceMaskStamp.seconds << "." << sourceMaskStamp.nanoseconds << "/" << sourceMaskStamp.size
+        << ":" << job.targetWidth << "x" << job.targetHeight << ":" << job.numGuideChannelsTotal;
+    for(int i=0;i<int(job.styleWeights.size());i++) { key << ":" << job.styleWeights[i]; }
+    for(int i=0;i<int(job.guideWeights.size());i++) { key << ":" << job.guideWeights[i]; }
+    key << ":" << job.uniformityWeight << ":" << job.patchSize << ":" << job.numPyramidLevels << ":" << job.numSearchVoteIters
+        << ":" << job.numPatchMatchIters << ":" << job.stopThreshold << ":" << job.extraPass3x3 << ":" << job.voteMode << ":" << job.seed;
+
+    std::map<std::string,Entry>::iterator it = entries.find(job.outputFileName);
+    if (it==entries.end())
+    {
+      while (entries.size()>=maxStates)
+      {
+        std::map<std::string,Entry>::iterator oldest = entries.begin();
+        for(it=entries.begin();it!=entries.end();it++) { if (it->second.lastUse<oldest->second.lastUse) { oldest = it; } }
+        ebsynthDestroyState(oldest->second.state);
+        entries.erase(oldest);
+      }
+
+      Entry entry;
+      entry.state = ebsynthCreateState();
+      it = entries.insert(std::make_pair(job.outputFileName,entry)).first;
+    }
+
+    Entry& entry = it->second;
+    entry.lastUse = ++useCounter;
+
+    job.options.state = entry.state;
+
+    if (entry.key==key.str() && entry.targetGuides.size()==job.targetGuides.size())
+    {
+      const int numChannels = job.numGuideChannelsTotal;
+      int x0 = job.targetWidth;
+      int y0 = job.targetHeight;
+      int x1 = 0;
+      int y1 = 0;
+      for(int y=0;y<job.targetHeight;y++)
+      for(int x=0;x<job.targetWidth;x++)
+      {
+        const int xy = y*job.targetWidth+x;
+        if (memcmp(&entry.targetGuides[xy*numChannels],&job.targetGuides[xy*numChannels],numChannels)!=0)
+        {
+          x0 = std::min(x0,x); x1 = std::max(x1,x+1);
+          y0 = std::min(y0,y); y1 = std::max(y1,y+1);
+        }
+      }
+
+      job.options.incremental = 1;
+      job.options.dirtyRect[0] = x0;
+      job.options.dirtyRect[1] = y0;
+      job.options.dirtyRect[2] = std::max(x1-x0,0);
+      job.options.dirtyRect[3] = std::max(y1-y0,0);
+    }
+
+    entry.key = key.str();
+    entry.targetGuides = job.targetGuides;
+  }
+
+private:
+  struct Entry
+  {
+    long long lastUse;
+    std::string key;
+    std::vector<unsigned char> targetGuides;
+    EbsynthState* state;
+  };
+
+  int maxStates;
+  long long useCounter;
+  std::map<std::string,Entry> entries;
+};
+
+// Runs the jobs coming from one input, one job per line, and answers each of
+// them with a record line on the output:
+//   done <job> <seconds> <output.png>
+//   failed <job>
+// where <seconds> covers the synthesis and writing of the output. With
+// -stats json, every done record is followed by the stats line of the job.
+void serveJobs(FILE* in,FILE* out,const Job& defaultJob,ImageCache* sourceCache,ContextCache* contextCache,StateCache* stateCache,int* inout_jobCounter)
+{
+  std::string line;
+  while (readLine(in,&line))
+  {
+    const std::vector<std::string> args = splitArgs(line);
+    if (args.empty() || args[0][0]=='#') { continue; }
+
+    const int jobNumber = ++(*inout_jobCounter);
+
+    Job job = defaultJob;
+    EbsynthContext* context = NULL;
+    if (!parseArgs(args,&job,0) || !loadJob(&job,sourceCache,true) || (context=contextCache->get(job))==NULL)
+    {
+      fflush(stdout);
+      fprintf(out,"failed %d\n",jobNumber);
+      fflush(out);
+      continue;
+    }
+
+    stateCache->prepare(job);
+
+    const auto startTime = std::chrono::steady_clock::now();
+
+    ebsynthRunContext(context,
+                      job.targetWidth,
+                      job.targetHeight,
+                      job.targetGuides.data(),
+                      NULL,
+                      job.styleWeights.data(),
+                      job.guideWeights.data(),
+                      job.uniformityWeight,
+                      job.patchSize,
+                      job.voteMode,
+                      job.numPyramidLevels,
+                      job.numSearchVoteItersPerLevel.data(),
+                      job.numPatchMatchItersPerLevel.data(),
+                      job.stopThresholdPerLevel.data(),
+                      job.extraPass3x3,
+                      NULL,
+                      job.output.data(),
+                      &job.options,
+                      &job.stats);
+
+    writeOutput(job);
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-startTime).count();
+
+    fprintf(out,"done %d %.3f %s\n",jobNumber,seconds,job.outputFileName.c_str());
+    if (job.statsJson) { printStatsJson(out,job); }
+    fflush(out);
+  }
+}
+
+// Keeps running jobs until the input ends. The address is either - for the
+// standard input and output, or the path of a Unix domain socket that accepts
+// one connection at a time. The decoded sources and their pyramids are kept
+// between the jobs, so a job costs only the target decode and the synthesis.
+int serve(const std::string& address,const Job& defaultJob)
+{
+  ImageCache sourceCache(32);
+  ContextCache contextCache(4);
+  StateCache stateCache(4);
+
+  int jobCounter = 0;
+
+  if (address=="-")
+  {
+    // The records go to the original standard output, and everything else
+    // printed there, like the errors of the failed jobs, goes to the
+    // standard error instead so that it doesn't get mixed into the records.
+    fflush(stdout);
+    FILE* out = fdopen(dup(fileno(stdout)),"wb");
+    if (out==NULL || dup2(fileno(stderr),fileno(stdout))<0) { printf("error: failed to set up the standard output\n"); return 1; }
+
+    serveJobs(stdin,out,defaultJob,&sourceCache,&contextCache,&stateCache,&jobCounter);
+    fclose(out);
+    return 0;
+  }
+
+#if !defined(_WIN32)
+  sockaddr_un sa;
+  memset(&sa,0,sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if (address.size()>=sizeof(sa.sun_path)) { printf("error: socket path '%s' is too long\n",address.c_str()); return 1; }
+  strcpy(sa.sun_path,address.c_str());
+
+  const int listener = socket(AF_UNIX,SOCK_STREAM,0);
+  if (listener<0) { printf("error: failed to create a socket\n"); return 1; }
+
+  // A socket left behind by a previous worker is replaced, anything else at
+  // the path is kept.
+  struct stat st;
+  if (lstat(address.c_str(),&st)==0)
+  {
+    if (!S_ISSOCK(st.st_mode))
+    {
+      printf("error: '%s' exists and is not a socket\n",address.c_str());
+      close(listener);
+      return 1;
+    }
+    unlink(address.c_str());
+  }
+
+  if (bind(listener,(sockaddr*)&sa,sizeof(sa))!=0 || listen(listener,8)!=0)
+  {
+    printf("error: failed to listen on '%s'\n",address.c_str());
+    close(listener);
+    return 1;
+  }
+
+  signal(SIGPIPE,SIG_IGN);
+
+  printf("listening on %s\n",address.c_str());
+  fflush(stdout);
+
+  while (true)
+  {
+    const int connection = accept(listener,NULL,NULL);
+    if (connection<0) { continue; }
+
+    FILE* in = fdopen(connection,"rb");
+    FILE* out = fdopen(dup(connection),"wb");
+    if (in!=NULL && out!=NULL) { serveJobs(in,out,defaultJob,&sourceCache,&contextCache,&stateCache,&jobCounter); }
+    if (in!=NULL) { fclose(in); } else { close(connection); }
+    if (out!=NULL) { fclose(out); }
+  }
+#else
+  printf("error: sockets are not supported on this platform, use -serve -\n");
+  return 1;
+#endif
+}
+
+// Checks that a file name pattern has at most one conversion, and that it's
+// an integer one like %d or %04d, so that it's safe to pass to snprintf.
+bool isFramePattern(const std::string& pattern,bool* out_hasFrame)
+{
+  int numConversions = 0;
+  for(int i=0;i<pattern.size();i++)
+  {
+    if (pattern[i]!='%') { continue; }
+    i++;
+    if (i<pattern.size() && pattern[i]=='%') { continue; }
+    while (i<pattern.size() && (pattern[i]=='0' || pattern[i]=='-' || pattern[i]=='+' || pattern[i]==' ')) { i++; }
+    while (i<pattern.size() && isdigit((unsigned char)pattern[i])) { i++; }
+    if (i>=pattern.size() || pattern[i]!='d') { return false; }
+    numConversions++;
+  }
+  *out_hasFrame = numConversions>0;
+  return numConversions<=1;
+}
+
+std::string formatFrame(const std::string& pattern,int frame)
+{
+  std::vector<char> buffer(pattern.size()+64);
+  snprintf(buffer.data(),buffer.size(),pattern.c_str(),frame);
+  return std::string(buffer.data());
+}
+
+// A queue of frames handed over between the stages of runSequence.
+class FrameQueue
+{
+public:
+  void push(Job* job)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(job);
+    condition.notify_one();
+  }
+
+  Job* pop()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock,[&]{ return !jobs.empty(); });
+    Job* job = jobs.front();
+    jobs.pop_front();
+    return job;
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<Job*> jobs;
+};
+
+// Synthesizes the frames first..last, the target guides and the output are
+// printf patterns of the frame number, e.g. target_%03d.png. While a frame
+// is being synthesized, the next frames are decoded and the previous ones are
+// encoded on background threads; at most framesInFlight frames are loaded at
+// any time. The source is decoded and its pyramid built only once.
+int runSequence(const Job& sequenceJob,int firstFrame,int lastFrame,int framesInFlight)
+{
+  bool hasFrame = false;
+  for(int i=0;i<sequenceJob.guides.size();i++)
+  {
+    bool hasTargetFrame = false;
+    if (!isFramePattern(sequenceJob.guides[i].targetFileName,&hasTargetFrame)) { printf("error: bad frame pattern '%s'\n",sequenceJob.guides[i].targetFileName.c_str()); return 1; }
+    hasFrame = hasFrame || hasTargetFrame;
+  }
+  bool hasOutputFrame = false;
+  if (!isFramePattern(sequenceJob.outputFileName,&hasOutputFrame)) { printf("error: bad frame pattern '%s'\n",sequenceJob.outputFileName.c_str()); return 1; }
+  if (!hasFrame)       { printf("error: none of the target guides has a frame pattern, e.g. target_%%03d.png\n"); return 1; }
+  if (!hasOutputFrame) { printf("error: the output needs a frame pattern, e.g. output_%%03d.png\n"); return 1; }
+
+  const int numFrames = lastFrame-firstFrame+1;
+
+  std::vector<Job> jobs(numFrames,sequenceJob);
+  std::vector<char> loaded(numFrames,0);
+  for(int i=0;i<numFrames;i++)
+  {
+    for(int j=0;j<jobs[i].guides.size();j++) { jobs[i].guides[j].targetFileName = formatFrame(jobs[i].guides[j].targetFileName,firstFrame+i); }
+    jobs[i].outputFileName = formatFrame(jobs[i].outputFileName,firstFrame+i);
+  }
+
+  std::mutex inFlightMutex;
+  std::condition_variable inFlightCondition;
+  int numFramesInFlight = 0;
+
+  FrameQueue decodedFrames;
+  FrameQueue synthesizedFrames;
+
+  const auto startTime = std::chrono::steady_clock::now();
+
+  std::thread decoder([&]
+  {
+    ImageCache sourceCache(16);
+    for(int i=0;i<numFrames;i++)
+    {
+      {
+        std::unique_lock<std::mutex> lock(inFlightMutex);
+        inFlightCondition.wait(lock,[&]{ return numFramesInFlight<framesInFlight; });
+        numFramesInFlight++;
+      }
+      loaded[i] = loadJob(&jobs[i],&sourceCache,true) ? 1 : 0;
+      decodedFrames.push(&jobs[i]);
+    }
+  });
+
+  int numFailedFrames = 0;
+
+  std::thread encoder([&]
+  {
+    for(int i=0;i<numFrames;i++)
+    {
+      Job* job = synthesizedFrames.pop();
+      if (loaded[i])
+      {
+        writeOutput(*job);
+        if (job->statsJson) { printStatsJson(stdout,*job); }
+        else                { printf("frame %d was written to %s\n",firstFrame+i,job->outputFileName.c_str()); }
+      }
+      else
+      {
+        printf("error: skipping frame %d\n",firstFrame+i);
+        numFailedFrames++;
+      }
+      *job = Job();
+
+      std::lock_guard<std::mutex> lock(inFlightMutex);
+      numFramesInFlight--;
+      inFlightCondition.notify_one();
+    }
+  });
+
+  {
+    ContextCache contextCache(1);
+    for(int i=0;i<numFrames;i++)
+    {
+      Job* job = decodedFrames.pop();
+      EbsynthContext* context = loaded[i] ? contextCache.get(*job) : NULL;
+      if (context==NULL) { loaded[i] = 0; }
+      else
+      {
+        ebsynthRunContext(context,
+                          job->targetWidth,
+                          job->targetHeight,
+                          job->targetGuides.data(),
+                          NULL,
+                          job->styleWeights.data(),
+                          job->guideWeights.data(),
+                          job->uniformityWeight,
+                          job->patchSize,
+                          job->voteMode,
+                          job->numPyramidLevels,
+                          job->numSearchVoteItersPerLevel.data(),
+                          job->numPatchMatchItersPerLevel.data(),
+                          job->stopThresholdPerLevel.data(),
+                          job->extraPass3x3,
+                          NULL,
+                          job->output.data(),
+                          &job->options,
+                          &job->stats);
+      }
+      synthesizedFrames.push(job);
+    }
+  }
+
+  decoder.join();
+  encoder.join();
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-startTime).count();
+  const int numDoneFrames = numFrames-numFailedFrames;
+
+  // With -stats json the standard output holds only the stats lines.
+  FILE* summary = sequenceJob.statsJson ? stderr : stdout;
+  fprintf(summary,"%d frames done in %.2f s (%.2f frames/s)",numDoneFrames,seconds,seconds>0 ? double(numDoneFrames)/seconds : 0.0);
+  if (numFailedFrames>0) { fprintf(summary,", %d failed",numFailedFrames); }
+  fprintf(summary,"\n");
+
+  return numFailedFrames>0 ? 1 : 0;
+}
+
+int main(int argc,char** argv)
+{
+  if (argc<2)
+  {
+    printf("usage: %s [options]\n",argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -style <style.png>\n");
+    printf("  -guide <source.png> <target.png>\n");
+    printf("  -mask <mask.png> <base.png>\n");
+    printf("  -sourcemask <mask.png>\n");
+    printf("  -output <output.png>\n");
+    printf("  -weight <value>\n");
+    printf("  -uniformity <value>\n");
+    printf("  -patchsize <size>\n");
+    printf("  -pyramidlevels <number>\n");
+    printf("  -searchvoteiters <number>\n");
+    printf("  -patchmatchiters <number>\n");
+    printf("  -stopthreshold <value>\n");
+    printf("  -extrapass3x3\n");
+    printf("  -votemode [plain|weighted]\n");
+    printf("  -schedule [auto|rowbands|tiled]\n");
+    printf("  -seed <value>\n");
+    printf("  -memorybudget <megabytes>\n");
+    printf("  -stats json\n");
+    printf("  -backend [cpu|cuda]\n");
+    printf("  -jobs <jobs.txt>\n");
+    printf("  -serve [-|<socket>]\n");
+    printf("  -frames <first> <last>\n");
+    printf("  -inflight <number>\n");
+    printf("\n");
+    return 1;
+  }
+
+  Job job;
+  Mode mode;
+
+  {
+    std::vector<std::string> args(argv+1,argv+argc);
+
+    if (!parseArgs(args,&job,&mode)) { return 1; }
+  }
+
+  if (!mode.serveAddress.empty())      { return serve(mode.serveAddress,job); }
+  if (!mode.jobsFileName.empty())      { return runJobList(mode.jobsFileName,job); }
+  if (mode.lastFrame>=mode.firstFrame) { return runSequence(job,mode.firstFrame,mode.lastFrame,mode.framesInFlight); }
+
+  if (!loadJob(&job,NULL,false)) { return 1; }
+
+  // with -stats json the stats are the only thing printed
+  if (!job.statsJson)
+  {
+    printf("uniformity: %.0f\n",job.uniformityWeight);
+    printf("patchsize: %d\n",job.patchSize);
+    printf("pyramidlevels: %d\n",job.numPyramidLevels);
+    printf("searchvoteiters: %d\n",job.numSearchVoteIters);
+    printf("patchmatchiters: %d\n",job.numPatchMatchIters);
+    printf("stopthreshold: %d\n",job.stopThreshold);
+    printf("extrapass3x3: %s\n",job.extraPass3x3!=0?"yes":"no");
+    printf("votemode: %s\n",voteModeToString(job.voteMode).c_str());
+    printf("schedule: %s\n",scheduleToString(job.schedule).c_str());
+    if (job.seed>=0) { printf("seed: %d\n",job.seed); }
+    printf("backend: %s\n",backendToString(job.backend).c_str());
+  }
+
+  EbsynthImage sourceStyle = { 0 };
+  EbsynthImage sourceGuide = { 0 };
+  EbsynthImage targetGuide = { 0 };
+  EbsynthImage outputImage = { 0 };
+  stridedImages(job,&sourceStyle,&sourceGuide,&targetGuide,&outputImage);
+
+  const EbsynthJob ej = ebsynthJob(job);
+  ebsynthRunStrided(ej.backend,
+                    ej.numStyleChannels,
+                    ej.numGuideChannels,
+                    ej.sourceWidth,
+                    ej.sourceHeight,
+                    &sourceStyle,
+                    &sourceGuide,
+                    ej.targetWidth,
+                    ej.targetHeight,
+                    &targetGuide,
+                    NULL,
+                    ej.styleWeights,
+                    ej.guideWeights,
+                    ej.uniformityWeight,
+                    ej.patchSize,
+                    ej.voteMode,
+                    ej.numPyramidLevels,
+                    ej.numSearchVoteItersPerLevel,
+                    ej.numPatchMatchItersPerLevel,
+                    ej.stopThresholdPerLevel,
+                    ej.extraPass3x3,
+                    ej.outputNnfData,
+                    &outputImage,
+                    ej.options,
+                    ej.stats);
+
+  writeOutput(job);
+
+  if (job.statsJson) { printStatsJson(stdout,job); return 0; }
+
+  printf("skipped pixels per level:");
+  for(int i=0;i<std::min(job.stats.numPyramidLevels,EBSYNTH_MAX_PYRAMID_LEVELS);i++) { printf(" %.0f%%",100.0f*job.stats.skippedPixelFraction[i]); }
+  printf("\n");
+
+  printf("result was written to %s\n",job.outputFileName.c_str());
   
   return 0;
 }
@@ -0,0 +1,335 @@
+// This software is in the public domain. Where that dedication is not
+// recognized, you are granted a perpetual, irrevocable license to copy
+// and modify this file as you see fit.
+
+// Benchmark of the CPU backend on synthetic inputs. Every combination of the
+// listed sizes, channel counts and patch sizes is synthesized and the results
+// are printed as JSON, e.g.:
+//
+//   ebsynth-bench -size 512,1024,2048 -stylechannels 3 -guidechannels 3,12 -patchsize 5 > before.json
+
+#include "ebsynth.h"
+#include "ebsynth_cpu.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+
+#if defined(_WIN32)
+  #include <windows.h>
+  #include <psapi.h>
+  #pragma comment(lib,"psapi.lib")
+#else
+  #include <sys/resource.h>
+#endif
+
+#ifdef __APPLE__
+  #include <thread>
+#else
+  #include <omp.h>
+#endif
+
+static long long peakRssBytes()
+{
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (GetProcessMemoryInfo(GetCurrentProcess(),&pmc,sizeof(pmc))) { return (long long)pmc.PeakWorkingSetSize; }
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF,&usage)!=0) { return 0; }
+#ifdef __APPLE__
+  return (long long)usage.ru_maxrss;
+#else
+  return (long long)usage.ru_maxrss*1024;
+#endif
+#endif
+}
+
+static int numThreads()
+{
+#ifdef __APPLE__
+  return int(std::thread::hardware_concurrency());
+#else
+  return omp_get_max_threads();
+#endif
+}
+
+static unsigned int hash(unsigned int x)
+{
+  x ^= x >> 16; x *= 0x7feb352dU;
+  x ^= x >> 15; x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+// Smooth value noise in [0,1], the same for the same arguments on every platform.
+static float valueNoise(float x,float y,unsigned int seed)
+{
+  const int x0 = int(std::floor(x));
+  const int y0 = int(std::floor(y));
+  const float fx = x-float(x0);
+  const float fy = y-float(y0);
+  const float sx = fx*fx*(3.0f-2.0f*fx);
+  const float sy = fy*fy*(3.0f-2.0f*fy);
+
+  #define CORNER(i,j) (float(hash(seed ^ hash(unsigned(x0+(i)) ^ hash(unsigned(y0+(j)))))&0xffff)/65535.0f)
+  const float v00 = CORNER(0,0);
+  const float v10 = CORNER(1,0);
+  const float v01 = CORNER(0,1);
+  const float v11 = CORNER(1,1);
+  #undef CORNER
+
+  return (v00*(1.0f-sx)+v10*sx)*(1.0f-sy) + (v01*(1.0f-sx)+v11*sx)*sy;
+}
+
+// A few octaves of noise, so the images have structure on every pyramid level.
+static unsigned char fractalNoise(float x,float y,unsigned int seed)
+{
+  float value = 0;
+  float amplitude = 0.5f;
+  float scale = 1.0f/64.0f;
+  for(int octave=0;octave<5;octave++)
+  {
+    value += amplitude*valueNoise(x*scale,y*scale,hash(seed+octave));
+    amplitude *= 0.5f;
+    scale *= 2.0f;
+  }
+  return (unsigned char)std::min(std::max(int(value*255.0f/0.97f),0),255);
+}
+
+// The style is fine-grained noise. The source guide is coarse noise, and the
+// target guide is the source guide shifted and slightly rotated, so the
+// synthesis has a plausible but non-trivial correspondence to find.
+static void generateInputs(int width,int height,int numStyleChannels,int numGuideChannels,unsigned int seed,
+                           std::vector<unsigned char>* out_sourceStyle,
+                           std::vector<unsigned char>* out_sourceGuide,
+                           std::vector<unsigned char>* out_targetGuide)
+{
+  std::vector<unsigned char>& sourceStyle = *out_sourceStyle;
+  std::vector<unsigned char>& sourceGuide = *out_sourceGuide;
+  std::vector<unsigned char>& targetGuide = *out_targetGuide;
+
+  sourceStyle.resize(size_t(width)*height*numStyleChannels);
+  sourceGuide.resize(size_t(width)*height*numGuideChannels);
+  targetGuide.resize(size_t(width)*height*numGuideChannels);
+
+  const float angle = 0.1f;
+  const float ca = std::cos(angle);
+  const float sa = std::sin(angle);
+
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<height;y++)
+  for(int x=0;x<width;x++)
+  {
+    const size_t xy = size_t(y)*width+x;
+
+    for(int c=0;c<numStyleChannels;c++)
+    {
+      sourceStyle[xy*numStyleChannels+c] = fractalNoise(4.0f*x,4.0f*y,hash(seed+1000+c));
+    }
+
+    const float tx = ca*(x-0.5f*width) - sa*(y-0.5f*height) + 0.5f*width + 0.1f*width;
+    const float ty = sa*(x-0.5f*width) + ca*(y-0.5f*height) + 0.5f*height;
+
+    for(int c=0;c<numGuideChannels;c++)
+    {
+      sourceGuide[xy*numGuideChannels+c] = fractalNoise(0.5f*x ,0.5f*y ,hash(seed+2000+c));
+      targetGuide[xy*numGuideChannels+c] = fractalNoise(0.5f*tx,0.5f*ty,hash(seed+2000+c));
+    }
+  }
+}
+
+static bool parseList(const char* arg,std::vector<int>* out_values)
+{
+  out_values->clear();
+
+  std::string s(arg);
+  size_t start = 0;
+  while (start<=s.size())
+  {
+    const size_t end = std::min(s.find(',',start),s.size());
+    const std::string item = s.substr(start,end-start);
+    char* itemEnd = NULL;
+    const long value = std::strtol(item.c_str(),&itemEnd,10);
+    if (item.empty() || *itemEnd!='\0' || value<=0) { return false; }
+    out_values->push_back(int(value));
+    start = end+1;
+  }
+
+  return true;
+}
+
+static double now()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc,char** argv)
+{
+  std::vector<int> sizes(1,512);
+  std::vector<int> numStyleChannelsList(1,3);
+  std::vector<int> numGuideChannelsList(1,3);
+  std::vector<int> patchSizes(1,5);
+  int numSearchVoteIters = 6;
+  int numPatchMatchIters = 4;
+  int stopThreshold = 5;
+  int numRepeats = 3;
+  int schedule = EBSYNTH_SCHEDULE_AUTO;
+  unsigned int seed = 1;
+
+  for(int argi=1;argi<argc;argi++)
+  {
+    const std::string arg = argv[argi];
+    const bool hasValue = argi+1<argc;
+    std::vector<int> values;
+
+    if      (arg=="-size"            && hasValue && parseList(argv[argi+1],&values)) { sizes = values; argi++; }
+    else if (arg=="-stylechannels"   && hasValue && parseList(argv[argi+1],&values)) { numStyleChannelsList = values; argi++; }
+    else if (arg=="-guidechannels"   && hasValue && parseList(argv[argi+1],&values)) { numGuideChannelsList = values; argi++; }
+    else if (arg=="-patchsize"       && hasValue && parseList(argv[argi+1],&values)) { patchSizes = values; argi++; }
+    else if (arg=="-searchvoteiters" && hasValue) { numSearchVoteIters = std::atoi(argv[++argi]); }
+    else if (arg=="-patchmatchiters" && hasValue) { numPatchMatchIters = std::atoi(argv[++argi]); }
+    else if (arg=="-stopthreshold"   && hasValue) { stopThreshold = std::atoi(argv[++argi]); }
+    else if (arg=="-repeat"          && hasValue) { numRepeats = std::max(std::atoi(argv[++argi]),1); }
+    else if (arg=="-seed"            && hasValue) { seed = unsigned(std::atoi(argv[++argi])); }
+    else if (arg=="-schedule"        && hasValue)
+    {
+      const std::string name = argv[++argi];
+      if      (name=="auto"    ) { schedule = EBSYNTH_SCHEDULE_AUTO; }
+      else if (name=="rowbands") { schedule = EBSYNTH_SCHEDULE_ROWBANDS; }
+      else if (name=="tiled"   ) { schedule = EBSYNTH_SCHEDULE_TILED; }
+      else { fprintf(stderr,"error: unrecognized schedule '%s'\n",name.c_str()); return 1; }
+    }
+    else
+    {
+      fprintf(stderr,"usage: %s [options]\n",argv[0]);
+      fprintf(stderr,"\n");
+      fprintf(stderr,"options (lists are comma-separated, all combinations are run):\n");
+      fprintf(stderr,"  -size <width>[,<width>...]           square images, e.g. 512,1024,2048,4096,7680\n");
+      fprintf(stderr,"  -stylechannels <n>[,<n>...]          1 to %d\n",EBSYNTH_MAX_STYLE_CHANNELS);
+      fprintf(stderr,"  -guidechannels <n>[,<n>...]          1 to %d\n",EBSYNTH_MAX_GUIDE_CHANNELS);
+      fprintf(stderr,"  -patchsize <n>[,<n>...]              odd, 3 or more\n");
+      fprintf(stderr,"  -searchvoteiters <number>\n");
+      fprintf(stderr,"  -patchmatchiters <number>\n");
+      fprintf(stderr,"  -stopthreshold <value>\n");
+      fprintf(stderr,"  -schedule [auto|rowbands|tiled]\n");
+      fprintf(stderr,"  -repeat <number>                     runs per combination, the fastest one is reported\n");
+      fprintf(stderr,"  -seed <value>\n");
+      return 1;
+    }
+  }
+
+  for(int i=0;i<numStyleChannelsList.size();i++) { if (numStyleChannelsList[i]>EBSYNTH_MAX_STYLE_CHANNELS) { fprintf(stderr,"error: too many style channels\n"); return 1; } }
+  for(int i=0;i<numGuideChannelsList.size();i++) { if (numGuideChannelsList[i]>EBSYNTH_MAX_GUIDE_CHANNELS) { fprintf(stderr,"error: too many guide channels\n"); return 1; } }
+  for(int i=0;i<patchSizes.size();i++) { if (patchSizes[i]<3 || patchSizes[i]%2==0) { fprintf(stderr,"error: patchsize must be an odd number of 3 or more\n"); return 1; } }
+
+  // the peak RSS is that of the whole process, so with the sizes ascending
+  // it's the peak of the largest run so far
+  std::sort(sizes.begin(),sizes.end());
+
+  printf("{\"threads\":%d,\"searchvoteiters\":%d,\"patchmatchiters\":%d,\"stopthreshold\":%d,\"repeat\":%d,\"runs\":[",
+         numThreads(),numSearchVoteIters,numPatchMatchIters,stopThreshold,numRepeats);
+
+  bool first = true;
+  for(int si=0;si<sizes.size();si++)
+  for(int nsi=0;nsi<numStyleChannelsList.size();nsi++)
+  for(int ngi=0;ngi<numGuideChannelsList.size();ngi++)
+  {
+    const int size = sizes[si];
+    const int numStyleChannels = numStyleChannelsList[nsi];
+    const int numGuideChannels = numGuideChannelsList[ngi];
+
+    std::vector<unsigned char> sourceStyle;
+    std::vector<unsigned char> sourceGuide;
+    std::vector<unsigned char> targetGuide;
+    generateInputs(size,size,numStyleChannels,numGuideChannels,seed,&sourceStyle,&sourceGuide,&targetGuide);
+
+    std::vector<unsigned char> output(size_t(size)*size*numStyleChannels);
+
+    std::vector<float> styleWeights(numStyleChannels,1.0f/float(numStyleChannels));
+    std::vector<float> guideWeights(numGuideChannels,1.0f/float(numGuideChannels));
+
+    for(int pi=0;pi<patchSizes.size();pi++)
+    {
+      const int patchSize = patchSizes[pi];
+
+      int numPyramidLevels = 0;
+      for(int level=32;level>=0;level--)
+      {
+        if (int(float(size)*std::pow(2.0f,-float(level))) >= (2*patchSize+1)) { numPyramidLevels = level+1; break; }
+      }
+      numPyramidLevels = std::min(numPyramidLevels,EBSYNTH_MAX_PYRAMID_LEVELS);
+
+      std::vector<int> numSearchVoteItersPerLevel(numPyramidLevels,numSearchVoteIters);
+      std::vector<int> numPatchMatchItersPerLevel(numPyramidLevels,numPatchMatchIters);
+      std::vector<int> stopThresholdPerLevel(numPyramidLevels,stopThreshold);
+
+      EbsynthOptions options = { 0 };
+      options.schedule = schedule;
+
+      double bestSeconds = -1;
+      double numPatchEvals = 0;
+      for(int repeat=0;repeat<numRepeats;repeat++)
+      {
+        srand(seed);
+
+        EbsynthStats stats;
+        memset(&stats,0,sizeof(stats));
+
+        const double start = now();
+
+        ebsynthRunCpu(numStyleChannels,
+                      numGuideChannels,
+                      size,
+                      size,
+                      sourceStyle.data(),
+                      sourceGuide.data(),
+                      size,
+                      size,
+                      targetGuide.data(),
+                      NULL,
+                      styleWeights.data(),
+                      guideWeights.data(),
+                      3500.0f,
+                      patchSize,
+                      EBSYNTH_VOTEMODE_PLAIN,
+                      numPyramidLevels,
+                      numSearchVoteItersPerLevel.data(),
+                      numPatchMatchItersPerLevel.data(),
+                      stopThresholdPerLevel.data(),
+                      0,
+                      NULL,
+                      output.data(),
+                      &options,
+                      &stats);
+
+        const double seconds = now()-start;
+        if (bestSeconds<0 || seconds<bestSeconds)
+        {
+          bestSeconds = seconds;
+          numPatchEvals = 0;
+          for(int level=0;level<std::min(stats.numPyramidLevels,EBSYNTH_MAX_PYRAMID_LEVELS);level++) { numPatchEvals += stats.levels[level].numPatchEvals; }
+        }
+      }
+
+      const double megapixels = double(size)*double(size)/1.0e6;
+
+      printf("%s\n{\"width\":%d,\"height\":%d,\"stylechannels\":%d,\"guidechannels\":%d,\"patchsize\":%d,\"pyramidlevels\":%d,"
+             "\"seconds\":%.6f,\"mpixPerSecond\":%.4f,\"patchEvals\":%.0f,\"patchEvalsPerSecond\":%.0f,\"peakRssBytes\":%lld}",
+             first ? "" : ",",size,size,numStyleChannels,numGuideChannels,patchSize,numPyramidLevels,
+             bestSeconds,megapixels/bestSeconds,numPatchEvals,numPatchEvals/bestSeconds,peakRssBytes());
+      fflush(stdout);
+      first = false;
+    }
+  }
+
+  printf("\n]}\n");
+
+  return 0;
+}
@@ -3,11 +3,16 @@
 // and modify this file as you see fit.
 
 #include "ebsynth.h"
+#include "ebsynth_cpu.h"
 #include "jzq.h"
+#include "ebsynth_cpu_simd.h"
 
+#include <cstdio>
 #include <cmath>
 #include <cfloat>
 #include <cstring>
+#include <cstddef>
+#include <chrono>
 
 #ifdef __APPLE__
   #include <dispatch/dispatch.h>
@@ -15,8 +20,17 @@
   #include <omp.h>
 #endif
 
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
 #define FOR(A,X,Y) for(int Y=0;Y<A.height();Y++) for(int X=0;X<A.width();X++)
 
+static double now()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 A2V2i nnfInit(const V2i& sizeA,
               const V2i& sizeB,
               const int  patchWidth)
@@ -32,23 +46,79 @@ A2V2i nnfInit(const V2i& sizeA,
   return NNF;
 }
 
+// The guides don't change during a pyramid level, so the guide part of the
+// error EG is kept for the current matches across iterations (tryPatch
+// updates it when it accepts a match) and only the style part is recomputed
+// after a vote. EG is computed from scratch when guideErrorValid is false.
+// Only the pixels of mask within [regionMin,regionMax) are evaluated.
+// Returns the number of evaluated patches.
 template<typename FUNC>
-A2f nnfError(const A2V2i& NNF,
+int nnfError(const A2V2i& NNF,
              const int    patchWidth,
-             FUNC         patchError)
+             FUNC         patchError,
+             const A2uc&  mask,
+             const V2i&   regionMin,
+             const V2i&   regionMax,
+             A2f&         E,
+             A2f&         EG,
+             const bool   guideErrorValid)
 {
-  A2f E(size(NNF));
-  
-  #pragma omp parallel for schedule(static)
-  for(int y=0;y<NNF.height();y++)
-  for(int x=0;x<NNF.width();x++)
+  int count = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:count)
+  for(int y=regionMin(1);y<regionMax(1);y++)
+  for(int x=regionMin(0);x<regionMax(0);x++)
   {
-    E(x,y) = patchError(patchWidth,V2i(x,y),NNF(x,y),FLT_MAX);
+    if (mask(x,y)==0) { continue; }
+
+    if (!guideErrorValid) { EG(x,y) = patchError.guideError(patchWidth,V2i(x,y),NNF(x,y)); }
+    E(x,y) = patchError.styleError(patchWidth,V2i(x,y),NNF(x,y))+EG(x,y);
+    count++;
   }
-  
-  return E;
+
+  return count;
+}
+
+// Counter-based RNG for the deterministic mode: instead of advancing a
+// shared state, every random number is a hash of the seed and of the
+// pixel/iteration it is drawn for, so it doesn't depend on the order in
+// which threads get to it (PCG-RXS-M-XS output function).
+static inline unsigned int pcgHash(const unsigned int v)
+{
+  const unsigned int state = v*747796405u+2891336453u;
+  const unsigned int word = ((state >> ((state >> 28u)+4u)) ^ state)*277803737u;
+  return (word >> 22u) ^ word;
 }
 
+// rand() isn't guaranteed to be thread-safe, so the runs of a batch, which
+// go concurrently, each draw from their own generator instead, seeded like
+// the deterministic mode. A run draws its random numbers on the thread it
+// was started on, outside of its parallel loops, so the generator is kept
+// per thread. Runs outside of a batch keep using rand().
+static thread_local unsigned int* runRngState = NULL;
+
+static int runRand()
+{
+  if (runRngState==NULL) { return rand(); }
+
+  *runRngState = *runRngState*747796405u+2891336453u;
+  return int(pcgHash(*runRngState) & 0x7fffffffu);
+}
+
+class RunRng
+{
+public:
+  explicit RunRng(const unsigned int seed) : state(seed),previous(runRngState) { runRngState = &state; }
+  ~RunRng() { runRngState = previous; }
+
+private:
+  RunRng(const RunRng&);
+  RunRng& operator=(const RunRng&);
+
+  unsigned int state;
+  unsigned int* previous;
+};
+
 static A2V2i nnfInitRandom(const V2i& targetSize,
                     const V2i& sourceSize,
                     const int  patchSize)
@@ -60,14 +130,38 @@ static A2V2i nnfInitRandom(const V2i& targetSize,
   {
       NNF[i] = V2i
       (
-          r+(rand()%(sourceSize[0]-2*r)),
-          r+(rand()%(sourceSize[1]-2*r))
+          r+(runRand()%(sourceSize[0]-2*r)),
+          r+(runRand()%(sourceSize[1]-2*r))
       );
   }
 
   return NNF;
 }
 
+static A2V2i nnfInitRandomSeeded(const V2i&         targetSize,
+                                 const V2i&         sourceSize,
+                                 const int          patchSize,
+                                 const unsigned int seed)
+{
+  A2V2i NNF(targetSize);
+  const int r = patchSize/2;
+
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < NNF.numel(); i++)
+  {
+    const unsigned int rndX = pcgHash(seed ^ pcgHash(2*unsigned(i)+0));
+    const unsigned int rndY = pcgHash(seed ^ pcgHash(2*unsigned(i)+1));
+
+    NNF[i] = V2i
+    (
+      r+int(rndX%unsigned(sourceSize[0]-2*r)),
+      r+int(rndY%unsigned(sourceSize[1]-2*r))
+    );
+  }
+
+  return NNF;
+}
+
 static A2V2i nnfUpscale(const A2V2i& NNF,
                  const int    patchSize,
                  const V2i&   targetSize,
@@ -92,129 +186,253 @@ static A2V2i nnfUpscale(const A2V2i& NNF,
   return NNF2x;
 }
 
-template<int N,typename T>
-void krnlVotePlain(      Array2<Vec<N,T>>&   target,
-                   const Array2<Vec<N,T>>&   source,
-                   const Array2<Vec<2,int>>& NNF,
-                   const int                 patchSize)
+// Samples a full resolution NNF down to a coarser level, 'factor' times
+// smaller, to seed that level with the matches of a previous run.
+static A2V2i nnfDownscale(const V2i* NNF,
+                          const V2i& NNFSize,
+                          const int  factor,
+                          const int  patchSize,
+                          const V2i& targetSize,
+                          const V2i& sourceSize)
 {
-  for(int y=0;y<target.height();y++)
-  for(int x=0;x<target.width();x++)
+  A2V2i NNFs(targetSize);
+  const int r = patchSize/2;
+
+  FOR(NNFs,x,y)
   {
-    const int r = patchSize / 2;
+    const V2i nn = NNF[clamp(y*factor,0,NNFSize(1)-1)*NNFSize(0)+
+                       clamp(x*factor,0,NNFSize(0)-1)]/factor;
 
-    Vec<N,float> sumColor = zero<Vec<N,float>>::value();
-    float sumWeight = 0;
+    NNFs(x,y) = V2i(clamp(nn(0),r,sourceSize(0)-r-1),
+                    clamp(nn(1),r,sourceSize(1)-r-1));
+  }
 
-    for (int py = -r; py <= +r; py++)
-    for (int px = -r; px <= +r; px++)
-    {
-      if
-      (
-        x+px >= 0 && x+px < NNF.width () &&
-        y+py >= 0 && y+py < NNF.height()
-      )
-      {
-        const V2i n = NNF(x+px,y+py)-V2i(px,py);
+  return NNFs;
+}
 
-        if
-        (
-          n[0] >= 0 && n[0] < source.width () &&
-          n[1] >= 0 && n[1] < source.height()
-        )
-        {
-          const float weight = 1.0f;
-          sumColor += weight*Vec<N,float>(source(n(0),n(1)));
-          sumWeight += weight;
-        }
-      }
-    }
+// Moves the matches between the coordinates of the whole source and of a
+// part of it starting at offset.
+static void nnfTranslate(A2V2i& NNF,const V2i& offset)
+{
+  if (offset(0)==0 && offset(1)==0) { return; }
 
-    const Vec<N,T> v = Vec<N,T>(sumColor/sumWeight);
-    target(x,y) = v;
+  #pragma omp parallel for schedule(static)
+  for(int xy=0;xy<numel(NNF);xy++)
+  {
+    NNF[xy] += offset;
   }
 }
 
-#if 0
-template<int N, typename T, int M>
-__global__ void krnlVoteWeighted(      TexArray2<N,T,M>   target,
-                                 const TexArray2<N,T,M>   source,
-                                 const TexArray2<2,int>   NNF,
-                                 const TexArray2<1,float> E,
-                                 const int patchSize)
+// Keeps the matches at least a patch radius off the border of a source, or
+// of the part of it a level works on, after they were moved into it.
+static void nnfClamp(A2V2i& NNF,const V2i& sourceSize,const int patchSize)
 {
-  const int x = blockDim.x*blockIdx.x + threadIdx.x;
-  const int y = blockDim.y*blockIdx.y + threadIdx.y;
+  const int r = patchSize/2;
 
-  if (x<target.width && y<target.height)
+  #pragma omp parallel for schedule(static)
+  for(int xy=0;xy<numel(NNF);xy++)
   {
-    const int r = patchSize / 2;
+    NNF[xy] = V2i(clamp(NNF[xy](0),r,sourceSize(0)-r-1),
+                  clamp(NNF[xy](1),r,sourceSize(1)-r-1));
+  }
+}
 
-    Vec<N,float> sumColor = zero<Vec<N,float>>::value();
-    float sumWeight = 0;
+// Replaces the matches that fall outside of the allowed part of the source,
+// be it by the upscale or the initialization, with random allowed ones.
+static void nnfRestrict(A2V2i& NNF,const A2uc& sourceMask,const unsigned int seed)
+{
+  if (numel(sourceMask)==0) { return; }
+
+  std::vector<V2i> allowed;
+  for(int y=0;y<sourceMask.height();y++)
+  for(int x=0;x<sourceMask.width();x++)
+  {
+    if (sourceMask(x,y)!=0) { allowed.push_back(V2i(x,y)); }
+  }
 
-    for (int py = -r; py <= +r; py++)
-    for (int px = -r; px <= +r; px++)
+  #pragma omp parallel for schedule(static)
+  for(int xy=0;xy<numel(NNF);xy++)
+  {
+    const V2i n = NNF[xy];
+    if (n(0)<0 || n(1)<0 || n(0)>=sourceMask.width() || n(1)>=sourceMask.height() || sourceMask(n)==0)
     {
-      /*
-      if
-      (
-        x+px >= 0 && x+px < NNF.width () &&
-        y+py >= 0 && y+py < NNF.height()
-      )
-      */
+      NNF[xy] = allowed[pcgHash(seed ^ pcgHash(unsigned(xy)))%unsigned(allowed.size())];
+    }
+  }
+}
+
+// The votes recompute the pixels of mask within [regionMin,regionMax).
+template<int N,typename T>
+void krnlVotePlain(      Array2<Vec<N,T>>&      target,
+                   const Array2<Vec<N,T>>&      source,
+                   const Array2<Vec<2,int>>&    NNF,
+                   const Array2<unsigned char>& mask,
+                   const V2i&                   regionMin,
+                   const V2i&                   regionMax,
+                   const int                    patchSize)
+{
+  const int r = patchSize / 2;
+  const float numTaps = float(patchSize*patchSize);
+
+  #pragma omp parallel for schedule(static)
+  for(int y=regionMin(1);y<regionMax(1);y++)
+  {
+    const bool rowInside = y-r >= 0 && y+r < NNF.height();
+
+    for(int x=regionMin(0);x<regionMax(0);x++)
+    {
+      if (mask(x,y)==0) { continue; }
+
+      if (rowInside && x-r >= 0 && x+r < NNF.width())
       {
-        const V2i n = NNF(x+px,y+py)-V2i(px,py);
+        // The NNF keeps every match at least r pixels away from the source
+        // border, so none of the taps can fall outside. The colors are summed
+        // in integers, which is exact and therefore identical to the float
+        // accumulation of the border path below.
+        int sumColor[N];
+        for(int k=0;k<N;k++) { sumColor[k] = 0; }
+
+        for (int py = -r; py <= +r; py++)
+        {
+          const V2i* ptrNNF = &NNF(x-r,y+py);
+
+          for (int px = -r; px <= +r; px++)
+          {
+            const V2i n = ptrNNF[px+r];
+            const T* ptrSource = (const T*)&source(n(0)-px,n(1)-py);
 
-        /*if
-        (
-          n[0] >= 0 && n[0] < S.width () &&
-          n[1] >= 0 && n[1] < S.height()
-        )*/
+            for(int k=0;k<N;k++) { sumColor[k] += ptrSource[k]; }
+          }
+        }
+
+        Vec<N,T> v;
+        for(int k=0;k<N;k++) { v[k] = T(float(sumColor[k])/numTaps); }
+        target(x,y) = v;
+      }
+      else
+      {
+        Vec<N,float> sumColor = zero<Vec<N,float>>::value();
+        float sumWeight = 0;
+
+        for (int py = -r; py <= +r; py++)
+        for (int px = -r; px <= +r; px++)
         {
-          const float error = E(x+px,y+py)(0)/(patchSize*patchSize*N);
-          const float weight = 1.0f/(1.0f+error);
-          sumColor += weight*Vec<N,float>(source(n(0),n(1)));
-          sumWeight += weight;
+          if
+          (
+            x+px >= 0 && x+px < NNF.width () &&
+            y+py >= 0 && y+py < NNF.height()
+          )
+          {
+            const V2i n = NNF(x+px,y+py)-V2i(px,py);
+
+            if
+            (
+              n[0] >= 0 && n[0] < source.width () &&
+              n[1] >= 0 && n[1] < source.height()
+            )
+            {
+              const float weight = 1.0f;
+              sumColor += weight*Vec<N,float>(source(n(0),n(1)));
+              sumWeight += weight;
+            }
+          }
         }
+
+        const Vec<N,T> v = Vec<N,T>(sumColor/sumWeight);
+        target(x,y) = v;
       }
     }
-
-    const Vec<N,T> v = Vec<N,T>(sumColor/sumWeight);
-    target.write(x,y,v);
   }
 }
-#endif
 
 template<int N,typename T>
-Vec<N,T> sampleBilinear(const Array2<Vec<N,T>>& I,float x,float y)
+void krnlVoteWeighted(      Array2<Vec<N,T>>&      target,
+                      const Array2<Vec<N,T>>&      source,
+                      const Array2<Vec<2,int>>&    NNF,
+                      const Array2<float>&         E,
+                      const Array2<unsigned char>& mask,
+                      const V2i&                   regionMin,
+                      const V2i&                   regionMax,
+                      const int                    patchSize)
 {
-  const int ix = x;
-  const int iy = y;
+  const int r = patchSize / 2;
+  const float errorScale = 1.0f/float(patchSize*patchSize*N);
 
-  const float s = x-ix;
-  const float t = y-iy;
+  #pragma omp parallel for schedule(static)
+  for(int y=regionMin(1);y<regionMax(1);y++)
+  {
+    const bool rowInside = y-r >= 0 && y+r < NNF.height();
 
-  return Vec<N,T>((1.0f-s)*(1.0f-t)*Vec<N,float>(I(clamp(ix  ,0,I.width()-1),clamp(iy  ,0,I.height()-1)))+
-                  (     s)*(1.0f-t)*Vec<N,float>(I(clamp(ix+1,0,I.width()-1),clamp(iy  ,0,I.height()-1)))+
-                  (1.0f-s)*(     t)*Vec<N,float>(I(clamp(ix  ,0,I.width()-1),clamp(iy+1,0,I.height()-1)))+
-                  (     s)*(     t)*Vec<N,float>(I(clamp(ix+1,0,I.width()-1),clamp(iy+1,0,I.height()-1))));
-};
+    for(int x=regionMin(0);x<regionMax(0);x++)
+    {
+      if (mask(x,y)==0) { continue; }
 
-/*
-template<int N, typename T, int M>
-__global__ void krnlEvalMask(      TexArray2<1,unsigned char> mask,
-                             const TexArray2<N,T,M> style,
-                             const TexArray2<N,T,M> style2,
-                             const int stopThreshold)
-{
-  const int x = blockDim.x*blockIdx.x + threadIdx.x;
-  const int y = blockDim.y*blockIdx.y + threadIdx.y;
+      Vec<N,float> sumColor = zero<Vec<N,float>>::value();
+      float sumWeight = 0;
+
+      if (rowInside && x-r >= 0 && x+r < NNF.width())
+      {
+        for (int py = -r; py <= +r; py++)
+        {
+          const V2i*   ptrNNF = &NNF(x-r,y+py);
+          const float* ptrE   = &E(x-r,y+py);
+
+          for (int px = -r; px <= +r; px++)
+          {
+            const V2i n = ptrNNF[px+r];
+            const T* ptrSource = (const T*)&source(n(0)-px,n(1)-py);
+
+            const float weight = 1.0f/(1.0f+ptrE[px+r]*errorScale);
+            for(int k=0;k<N;k++) { sumColor[k] += weight*float(ptrSource[k]); }
+            sumWeight += weight;
+          }
+        }
+      }
+      else
+      {
+        for (int py = -r; py <= +r; py++)
+        for (int px = -r; px <= +r; px++)
+        {
+          if
+          (
+            x+px >= 0 && x+px < NNF.width () &&
+            y+py >= 0 && y+py < NNF.height()
+          )
+          {
+            const V2i n = NNF(x+px,y+py)-V2i(px,py);
+
+            if
+            (
+              n[0] >= 0 && n[0] < source.width () &&
+              n[1] >= 0 && n[1] < source.height()
+            )
+            {
+              const float weight = 1.0f/(1.0f+E(x+px,y+py)*errorScale);
+              sumColor += weight*Vec<N,float>(source(n(0),n(1)));
+              sumWeight += weight;
+            }
+          }
+        }
+      }
 
-  if (x<mask.width && y<mask.height)
+      const Vec<N,T> v = Vec<N,T>(sumColor/sumWeight);
+      target(x,y) = v;
+    }
+  }
+}
+
+template<int N,typename T>
+void krnlEvalMask(      Array2<unsigned char>& mask,
+                  const Array2<Vec<N,T>>&      style,
+                  const Array2<Vec<N,T>>&      style2,
+                  const int                    stopThreshold)
+{
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<mask.height();y++)
+  for(int x=0;x<mask.width();x++)
   {
-    const Vec<N,T> s  = style(x,y);
-    const Vec<N,T> s2 = style2(x,y);
+    const Vec<N,T>& s  = style(x,y);
+    const Vec<N,T>& s2 = style2(x,y);
 
     int maxDiff = 0;
     for(int c=0;c<N;c++)
@@ -223,49 +441,362 @@ __global__ void krnlEvalMask(      TexArray2<1,unsigned char> mask,
       maxDiff = diff>maxDiff ? diff:maxDiff;
     }
 
-    const Vec<1,unsigned char> msk = maxDiff < stopThreshold ? Vec<1,unsigned char>(0) : Vec<1,unsigned char>(255);
+    mask(x,y) = maxDiff < stopThreshold ? 0 : 255;
+  }
+}
+
+static void krnlDilateMask(      Array2<unsigned char>& mask2,
+                           const Array2<unsigned char>& mask,
+                           const int                    patchSize)
+{
+  const int r = patchSize / 2;
+
+  // The square dilation is separable, so dilate the rows first and then
+  // the columns of the intermediate result.
+  Array2<unsigned char> rows(size(mask));
+
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<mask.height();y++)
+  for(int x=0;x<mask.width();x++)
+  {
+    unsigned char msk = 0;
+    for(int px=std::max(x-r,0);px<=std::min(x+r,mask.width()-1);px++)
+    {
+      if (mask(px,y)==255) { msk = 255; break; }
+    }
+    rows(x,y) = msk;
+  }
+
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<mask.height();y++)
+  for(int x=0;x<mask.width();x++)
+  {
+    unsigned char msk = 0;
+    for(int py=std::max(y-r,0);py<=std::min(y+r,mask.height()-1);py++)
+    {
+      if (rows(x,py)==255) { msk = 255; break; }
+    }
+    mask2(x,y) = msk;
+  }
+}
 
-    mask.write(x,y,msk);
+// Intersects mask with the region of interest, so nothing outside of it is
+// voted.
+static void krnlClipMask(      Array2<unsigned char>& mask,
+                         const Array2<unsigned char>& roi)
+{
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<mask.height();y++)
+  for(int x=0;x<mask.width();x++)
+  {
+    if (roi(x,y)==0) { mask(x,y) = 0; }
   }
 }
 
-__global__ void krnlDilateMask(TexArray2<1,unsigned char> mask2,
-                               const TexArray2<1,unsigned char> mask,
-                               const int patchSize)
+// The bounding box [out_min,out_max) of the nonzero pixels of a mask, an
+// empty box when there are none.
+static void maskBounds(const Array2<unsigned char>& mask,V2i* out_min,V2i* out_max)
 {
-  const int x = blockDim.x*blockIdx.x + threadIdx.x;
-  const int y = blockDim.y*blockIdx.y + threadIdx.y;
+  V2i bmin = size(mask);
+  V2i bmax = V2i(0,0);
 
-  if (x<mask.width && y<mask.height)
+  for(int y=0;y<mask.height();y++)
+  for(int x=0;x<mask.width();x++)
   {
-    const int r = patchSize / 2;
+    if (mask(x,y)==0) { continue; }
+    bmin = std::min(bmin,V2i(x,y));
+    bmax = std::max(bmax,V2i(x+1,y+1));
+  }
 
-    Vec<1,unsigned char> msk = Vec<1,unsigned char>(0);
+  *out_min = bmax(0)>bmin(0) ? bmin : V2i(0,0);
+  *out_max = bmax(0)>bmin(0) ? bmax : V2i(0,0);
+}
 
-    for (int py = -r; py <= +r; py++)
-    for (int px = -r; px <= +r; px++)
+// The centers of the patches that fit into a source mask and keep off its
+// border like every match does, or just the pixels of the mask off the border
+// when no patch fits. Empty when not even that is left.
+static A2uc allowedCenters(const A2uc& mask,const int patchSize)
+{
+  const int r = patchSize/2;
+
+  A2uc outside(size(mask));
+  A2uc grown(size(mask));
+  for(int xy=0;xy<numel(mask);xy++) { outside[xy] = mask[xy]==0 ? 255 : 0; }
+  krnlDilateMask(grown,outside,patchSize);
+
+  for(int pass=0;pass<2;pass++)
+  {
+    const A2uc& blocked = pass==0 ? grown : outside;
+
+    A2uc allowed(size(mask));
+    int count = 0;
+    for(int y=0;y<mask.height();y++)
+    for(int x=0;x<mask.width();x++)
     {
-      if (mask(x+px,y+py)[0]==255) { msk = Vec<1,unsigned char>(255); }
+      const bool inside = x>=r && y>=r && x<mask.width()-r && y<mask.height()-r;
+      allowed(x,y) = (inside && blocked(x,y)==0) ? 255 : 0;
+      if (allowed(x,y)!=0) { count++; }
     }
 
-    mask2.write(x,y,msk);
+    if (count>0) { return allowed; }
   }
+
+  return A2uc();
 }
-*/
 
+template<typename T>
+static Array2<T> cropArray(const Array2<T>& A,const V2i& offset,const V2i& cropSize)
+{
+  Array2<T> C(cropSize);
+  for(int y=0;y<cropSize(1);y++)
+  {
+    memcpy(&C(0,y),&A(offset(0),offset(1)+y),cropSize(0)*sizeof(T));
+  }
+  return C;
+}
+
+// Outside of [regionMin,regionMax) target and source are the same already.
 template<int N,typename T>
-void resampleCPU(      Array2<Vec<N,T>>& O,
+void krnlCopyMasked(      Array2<Vec<N,T>>&      target,
+                    const Array2<Vec<N,T>>&      source,
+                    const Array2<unsigned char>& mask,
+                    const V2i&                   regionMin,
+                    const V2i&                   regionMax)
+{
+  #pragma omp parallel for schedule(static)
+  for(int y=regionMin(1);y<regionMax(1);y++)
+  for(int x=regionMin(0);x<regionMax(0);x++)
+  {
+    if (mask(x,y)==0) { target(x,y) = source(x,y); }
+  }
+}
+
+// the mean over the whole target, or over the region of interest when
+// there's one, as the error is not evaluated outside of it
+static float meanEnergy(const Array2<float>& E,const Array2<unsigned char>& roi)
+{
+  double sum = 0;
+  double count = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:sum,count)
+  for(int y=0;y<E.height();y++)
+  for(int x=0;x<E.width();x++)
+  {
+    if (numel(roi)>0 && roi(x,y)==0) { continue; }
+    sum += E(x,y);
+    count += 1;
+  }
+
+  return count>0 ? float(sum/count) : 0.0f;
+}
+
+static int countMasked(const Array2<unsigned char>& mask)
+{
+  int count = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:count)
+  for(int y=0;y<mask.height();y++)
+  for(int x=0;x<mask.width();x++)
+  {
+    if (mask(x,y)==0) { count++; }
+  }
+
+  return count;
+}
+
+template<int N,typename T>
+static inline void downscaleRow2x(T* ptrO,const T* ptrI0,const T* ptrI1,const int widthO)
+{
+  for(int x=0;x<widthO;x++)
+  {
+    for(int k=0;k<N;k++)
+    {
+      const int sum = int(ptrI0[(2*x+0)*N+k])+int(ptrI0[(2*x+1)*N+k])+
+                      int(ptrI1[(2*x+0)*N+k])+int(ptrI1[(2*x+1)*N+k]);
+      ptrO[x*N+k] = T((sum+2)/4);
+    }
+  }
+}
+
+// Halves an image with a 2x2 box filter; O has to be half the size of I,
+// rounded down. The pyramids are built as a cascade, each level from the
+// finer one, so every pixel contributes to the coarser levels instead of
+// each level point sampling the finest image. The rows are independent and
+// the inner loop runs over plain bytes, which the compiler vectorizes.
+template<int N,typename T>
+void downscale2x(      Array2<Vec<N,T>>& O,
                  const Array2<Vec<N,T>>& I)
 {
-  const float s = float(I.width())/float(O.width());
-  
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<O.height();y++)
+  {
+    downscaleRow2x<N,T>((T*)&O(0,y),(const T*)&I(0,2*y+0),(const T*)&I(0,2*y+1),O.width());
+  }
+}
+
+// Halves a region-of-interest mask; a coarse pixel is in the region when any
+// of the four pixels under it is.
+static void downscaleMask2x(      Array2<unsigned char>& O,
+                            const Array2<unsigned char>& I)
+{
+  #pragma omp parallel for schedule(static)
   for(int y=0;y<O.height();y++)
   for(int x=0;x<O.width();x++)
   {
-    O(x,y) = sampleBilinear(I,s*float(x),s*float(y));
+    O(x,y) = (I(2*x,2*y) | I(2*x+1,2*y) | I(2*x,2*y+1) | I(2*x+1,2*y+1));
+  }
+}
+
+// Allocates P for an image of the given size padded by an apron of 'apron'
+// pixels on every side. The rows are rounded up to a multiple of 16 bytes.
+template<int N,typename T>
+void allocPadded(Array2<Vec<N,T>>& P,const V2i& size,const int apron)
+{
+  int width = size(0)+2*apron;
+  while ((width*int(sizeof(Vec<N,T>)))%16!=0) { width++; }
+  const int height = size(1)+2*apron;
+
+  if (P.width()!=width || P.height()!=height) { P = Array2<Vec<N,T>>(width,height); }
+}
+
+// Fills the apron of a padded image by replicating the border pixels of its
+// inside, the values a clamped read would return, so the patch error can
+// read the target patch around any pixel without bounds checks.
+template<int N,typename T>
+void fillApron(Array2<Vec<N,T>>& P,const V2i& size,const int apron)
+{
+  #pragma omp parallel for schedule(static)
+  for(int y=apron;y<apron+size(1);y++)
+  {
+    Vec<N,T>* row = &P(0,y);
+    for(int x=0;x<apron;x++) { row[x] = row[apron]; }
+    for(int x=apron+size(0);x<P.width();x++) { row[x] = row[apron+size(0)-1]; }
   }
+
+  for(int y=0;y<apron;y++) { memcpy(&P(0,y),&P(0,apron),P.width()*sizeof(Vec<N,T>)); }
+  for(int y=apron+size(1);y<P.height();y++) { memcpy(&P(0,y),&P(0,apron+size(1)-1),P.width()*sizeof(Vec<N,T>)); }
 }
 
+// copies A into the inside of P, see fillApron
+template<int N,typename T>
+void padArray(      Array2<Vec<N,T>>& P,
+              const Array2<Vec<N,T>>& A,
+              const int               apron)
+{
+  allocPadded(P,size(A),apron);
+
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<A.height();y++)
+  {
+    memcpy(&P(apron,apron+y),&A(0,y),A.width()*sizeof(Vec<N,T>));
+  }
+
+  fillApron(P,size(A),apron);
+}
+
+// padArray for a P padded from A before, when A has changed only within
+// [regionMin,regionMax) since: copies just that part and fills the apron.
+template<int N,typename T>
+void padArrayRegion(      Array2<Vec<N,T>>& P,
+                    const Array2<Vec<N,T>>& A,
+                    const int               apron,
+                    const V2i&              regionMin,
+                    const V2i&              regionMax)
+{
+  if (regionMax(0)<=regionMin(0)) { return; }
+
+  #pragma omp parallel for schedule(static)
+  for(int y=regionMin(1);y<regionMax(1);y++)
+  {
+    memcpy(&P(apron+regionMin(0),apron+y),&A(regionMin(0),y),(regionMax(0)-regionMin(0))*sizeof(Vec<N,T>));
+  }
+
+  fillApron(P,size(A),apron);
+}
+
+// downscale2x for padded images: halves the inside of I, which is sizeO*2
+// or one pixel more, into the inside of O, and fills the apron of O.
+template<int N,typename T>
+void downscale2xPadded(      Array2<Vec<N,T>>& O,
+                       const Array2<Vec<N,T>>& I,
+                       const V2i&              sizeO,
+                       const int               apron)
+{
+  allocPadded(O,sizeO,apron);
+
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<sizeO(1);y++)
+  {
+    downscaleRow2x<N,T>((T*)&O(apron,apron+y),(const T*)&I(apron,apron+2*y+0),(const T*)&I(apron,apron+2*y+1),sizeO(0));
+  }
+
+  fillApron(O,sizeO,apron);
+}
+
+// The weighted SSD of the whole patch of A around axy and the patch of B
+// around bxy, with no early termination. The patch error functors use it to
+// evaluate the style and the guide part of the error separately (nnfError).
+// A is padded by apron>=patchSize/2, B is read only where the NNF points,
+// which is never closer than patchSize/2 to its border.
+template<int N,typename T>
+static float patchSSD(const Array2<Vec<N,T>>&  A,
+                      const int                apron,
+                      const Array2<Vec<N,T>>&  B,
+                      const Vec<N,float>&      weights,
+                      const std::vector<float>& weightsRow,
+                      WeightedSSDFunc          weightedSSDRow,
+                      const int                patchSize,
+                      const V2i&               axy,
+                      const V2i&               bxy)
+{
+  const int r = patchSize/2;
+  float error = 0;
+
+  const unsigned char* ptrA = (const unsigned char*)&A(axy(0)-r+apron,axy(1)-r+apron);
+  const unsigned char* ptrB = (const unsigned char*)&B(bxy(0)-r,bxy(1)-r);
+  for(int j=0;j<patchSize;j++)
+  {
+    error += weightedSSDPatchRow(ptrA,ptrB,weights,weightsRow.data(),patchSize,weightedSSDRow);
+    ptrA += A.width()*N;
+    ptrB += B.width()*N;
+  }
+
+  return error;
+}
+
+// Same as patchSSD with every channel difference also weighted by M/255,
+// M is padded like A.
+template<int N,typename T>
+static float patchSSDModulated(const Array2<Vec<N,T>>&  A,
+                               const int                apron,
+                               const Array2<Vec<N,T>>&  B,
+                               const Array2<Vec<N,T>>&  M,
+                               const Vec<N,float>&      weights,
+                               const std::vector<float>& weightsRow,
+                               ModulatedSSDFunc         modulatedSSDRow,
+                               const int                patchSize,
+                               const V2i&               axy,
+                               const V2i&               bxy)
+{
+  const int r = patchSize/2;
+  float error = 0;
+
+  const unsigned char* ptrA = (const unsigned char*)&A(axy(0)-r+apron,axy(1)-r+apron);
+  const unsigned char* ptrB = (const unsigned char*)&B(bxy(0)-r,bxy(1)-r);
+  const unsigned char* ptrM = (const unsigned char*)&M(axy(0)-r+apron,axy(1)-r+apron);
+  for(int j=0;j<patchSize;j++)
+  {
+    error += modulatedSSDPatchRow(ptrA,ptrB,ptrM,weights,weightsRow.data(),patchSize,modulatedSSDRow)*(1.0f/255.0f);
+    ptrA += A.width()*N;
+    ptrB += B.width()*N;
+    ptrM += M.width()*N;
+  }
+
+  return error;
+}
+
+// The target style and guide are padded by 'apron' (see padArray), which
+// has to be at least patchSize/2, so every patch is read the same way.
 template<int NS,int NG,typename T>
 struct PatchSSD_Split
 {
@@ -275,37 +806,92 @@ struct PatchSSD_Split
   const Array2<Vec<NG,T>>& targetGuide;
   const Array2<Vec<NG,T>>& sourceGuide;
 
+  const int apron;
+
   const Vec<NS,float>& styleWeights;
   const Vec<NG,float>& guideWeights;
 
+  const std::vector<float>& styleWeightsRow;
+  const std::vector<float>& guideWeightsRow;
+
+  const WeightedSSDFunc weightedSSDRow;
+
   PatchSSD_Split(const Array2<Vec<NS,T>>& targetStyle,
                  const Array2<Vec<NS,T>>& sourceStyle,
 
                  const Array2<Vec<NG,T>>& targetGuide,
                  const Array2<Vec<NG,T>>& sourceGuide,
 
+                 const int apron,
+
                  const Vec<NS,float>& styleWeights,
-                 const Vec<NG,float>& guideWeights)
+                 const Vec<NG,float>& guideWeights,
+
+                 const std::vector<float>& styleWeightsRow,
+                 const std::vector<float>& guideWeightsRow)
 
   : targetStyle(targetStyle),sourceStyle(sourceStyle),
     targetGuide(targetGuide),sourceGuide(sourceGuide),
-    styleWeights(styleWeights),guideWeights(guideWeights) {}
+    apron(apron),
+    styleWeights(styleWeights),guideWeights(guideWeights),
+    styleWeightsRow(styleWeightsRow),guideWeightsRow(guideWeightsRow),
+    weightedSSDRow(weightedSSD()) {}
+
+  // the style and the guide part of the error of the whole patch, without
+  // early termination; they sum up to operator() with ebest=FLT_MAX
+  float styleError(const int patchSize,const V2i txy,const V2i sxy) const
+  {
+    return patchSSD(targetStyle,apron,sourceStyle,styleWeights,styleWeightsRow,weightedSSDRow,patchSize,txy,sxy);
+  }
 
+  float guideError(const int patchSize,const V2i txy,const V2i sxy) const
+  {
+    return patchSSD(targetGuide,apron,sourceGuide,guideWeights,guideWeightsRow,weightedSSDRow,patchSize,txy,sxy);
+  }
+
+  // The error stops accumulating after the row on which it exceeds ebest;
+  // out_cutShort tells whether that left rows out. out_guideError gets the
+  // guide part of the returned error, the same as guideError() when it
+  // didn't exceed ebest.
   float operator()(const int   patchSize,           
                    const V2i   txy,
                    const V2i   sxy,
-                   const float ebest)
+                   const float ebest,
+                   bool* out_cutShort=0,
+                   float* out_guideError=0)
   {
-    const int tx = txy(0);
-    const int ty = txy(1);
+    const int tx = txy(0)+apron;
+    const int ty = txy(1)+apron;
     const int sx = sxy(0);
     const int sy = sxy(1);
 
     const int r = patchSize/2;
     float error = 0;
-  
-    if(tx-r>=0 && tx+r<targetStyle.width() &&
-       ty-r>=0 && ty+r<targetStyle.height())
+    float guideError = 0;
+
+    if(patchSize*NG>=WEIGHTED_SSD_MIN_SIMD_BYTES)
+    {
+      const unsigned char* ptrTs = (const unsigned char*)&targetStyle(tx-r,ty-r);
+      const unsigned char* ptrSs = (const unsigned char*)&sourceStyle(sx-r,sy-r);
+      const unsigned char* ptrTg = (const unsigned char*)&targetGuide(tx-r,ty-r);
+      const unsigned char* ptrSg = (const unsigned char*)&sourceGuide(sx-r,sy-r);
+      const int strideTs = targetStyle.width()*NS;
+      const int strideSs = sourceStyle.width()*NS;
+      const int strideTg = targetGuide.width()*NG;
+      const int strideSg = sourceGuide.width()*NG;
+      for(int j=0;j<patchSize;j++)
+      {
+        const float guideRow = weightedSSDRow(ptrTg,ptrSg,guideWeightsRow.data(),patchSize*NG);
+        error += weightedSSDPatchRow(ptrTs,ptrSs,styleWeights,styleWeightsRow.data(),patchSize,weightedSSDRow) + guideRow;
+        guideError += guideRow;
+        ptrTs += strideTs;
+        ptrSs += strideSs;
+        ptrTg += strideTg;
+        ptrSg += strideSg;
+        if(error>ebest) { if(out_cutShort) { *out_cutShort = j<patchSize-1; } break; }
+      }
+    }
+    else
     {
       const T* ptrTs = (T*)&targetStyle(tx-r,ty-r);
       const T* ptrSs = (T*)&sourceStyle(sx-r,sy-r);
@@ -317,6 +903,7 @@ struct PatchSSD_Split
       const int ofsSg = (sourceGuide.width()-patchSize)*NG;
       for(int j=0;j<patchSize;j++)
       {
+        float guideRow = 0;
         for(int i=0;i<patchSize;i++)
         {
           for(int k=0;k<NS;k++)
@@ -330,201 +917,484 @@ struct PatchSSD_Split
           {
             const float diff = *ptrTg - *ptrSg;
             error += guideWeights[k]*diff*diff;
+            guideRow += guideWeights[k]*diff*diff;
             ptrTg++;
             ptrSg++;
           }
         }        
+        guideError += guideRow;
         ptrTs += ofsTs;
         ptrSs += ofsSs;
         ptrTg += ofsTg;
         ptrSg += ofsSg;        
-        if(error>ebest) { break; }
-      }
-    }
-    else
-    {
-      for(int py=-r;py<=+r;py++)
-      for(int px=-r;px<=+r;px++)
-      {
-        {
-          const Vec<NS,T> pixTs = targetStyle(clamp(tx + px,0,targetStyle.width()-1),clamp(ty + py,0,targetStyle.height()-1));
-          const Vec<NS,T> pixSs = sourceStyle(clamp(sx + px,0,sourceStyle.width()-1),clamp(sy + py,0,sourceStyle.height()-1));
-          for(int i=0;i<NS;i++)
-          {
-            const float diff = float(pixTs[i]) - float(pixSs[i]);
-            error += styleWeights[i]*diff*diff;
-          }
-        }
-
-        {
-          const Vec<NG,T> pixTg = targetGuide(clamp(tx + px,0,targetGuide.width()-1),clamp(ty + py,0,targetGuide.height()-1));
-          const Vec<NG,T> pixSg = sourceGuide(clamp(sx + px,0,sourceGuide.width()-1),clamp(sy + py,0,sourceGuide.height()-1));
-          for(int i=0;i<NG;i++)
-          {
-            const float diff = float(pixTg[i]) - float(pixSg[i]);
-            error += guideWeights[i]*diff*diff;
-          }
-        }
+        if(error>ebest) { if(out_cutShort) { *out_cutShort = j<patchSize-1; } break; }
       }
     }
 
+    if(out_guideError) { *out_guideError = guideError; }
     return error;
   }
 };
 
-/*
 template<int NS,int NG,typename T>
 struct PatchSSD_Split_Modulation
 {
-  const TexArray2<NS,T> targetStyle;
-  const TexArray2<NS,T> sourceStyle;
+  const Array2<Vec<NS,T>>& targetStyle;
+  const Array2<Vec<NS,T>>& sourceStyle;
 
-  const TexArray2<NG,T> targetGuide;
-  const TexArray2<NG,T> sourceGuide;
+  const Array2<Vec<NG,T>>& targetGuide;
+  const Array2<Vec<NG,T>>& sourceGuide;
+
+  const Array2<Vec<NG,T>>& targetModulation;
 
-  const TexArray2<NG,T> targetModulation;
+  const int apron;
+
+  const Vec<NS,float>& styleWeights;
+  const Vec<NG,float>& guideWeights;
 
-  const Vec<NS,float> styleWeights;
-  const Vec<NG,float> guideWeights;
+  const std::vector<float>& styleWeightsRow;
+  const std::vector<float>& guideWeightsRow;
 
-  PatchSSD_Split_Modulation(const TexArray2<NS,T>& targetStyle,
-                            const TexArray2<NS,T>& sourceStyle,
+  const WeightedSSDFunc  weightedSSDRow;
+  const ModulatedSSDFunc modulatedSSDRow;
 
-                            const TexArray2<NG,T>& targetGuide,
-                            const TexArray2<NG,T>& sourceGuide,
+  PatchSSD_Split_Modulation(const Array2<Vec<NS,T>>& targetStyle,
+                            const Array2<Vec<NS,T>>& sourceStyle,
 
-                            const TexArray2<NG,T>& targetModulation,
+                            const Array2<Vec<NG,T>>& targetGuide,
+                            const Array2<Vec<NG,T>>& sourceGuide,
 
-                            const Vec<NS,float>&   styleWeights,
-                            const Vec<NG,float>&   guideWeights)
+                            const Array2<Vec<NG,T>>& targetModulation,
+
+                            const int apron,
+
+                            const Vec<NS,float>& styleWeights,
+                            const Vec<NG,float>& guideWeights,
+
+                            const std::vector<float>& styleWeightsRow,
+                            const std::vector<float>& guideWeightsRow)
 
   : targetStyle(targetStyle),sourceStyle(sourceStyle),
     targetGuide(targetGuide),sourceGuide(sourceGuide),
     targetModulation(targetModulation),
-    styleWeights(styleWeights),guideWeights(guideWeights) {}
+    apron(apron),
+    styleWeights(styleWeights),guideWeights(guideWeights),
+    styleWeightsRow(styleWeightsRow),guideWeightsRow(guideWeightsRow),
+    weightedSSDRow(weightedSSD()),modulatedSSDRow(modulatedSSD()) {}
 
-   __device__ float operator()(const int   patchSize,
-                               const int   tx,
-                               const int   ty,
-                               const int   sx,
-                               const int   sy,
-                               const float ebest)
+  float styleError(const int patchSize,const V2i txy,const V2i sxy) const
   {
+    return patchSSD(targetStyle,apron,sourceStyle,styleWeights,styleWeightsRow,weightedSSDRow,patchSize,txy,sxy);
+  }
+
+  float guideError(const int patchSize,const V2i txy,const V2i sxy) const
+  {
+    return patchSSDModulated(targetGuide,apron,sourceGuide,targetModulation,guideWeights,guideWeightsRow,modulatedSSDRow,patchSize,txy,sxy);
+  }
+
+  float operator()(const int   patchSize,
+                   const V2i   txy,
+                   const V2i   sxy,
+                   const float ebest,
+                   bool* out_cutShort=0,
+                   float* out_guideError=0)
+  {
+    const int tx = txy(0)+apron;
+    const int ty = txy(1)+apron;
+    const int sx = sxy(0);
+    const int sy = sxy(1);
+
     const int r = patchSize/2;
     float error = 0;
+    float guideError = 0;
+
+    const unsigned char* ptrTs = (const unsigned char*)&targetStyle(tx-r,ty-r);
+    const unsigned char* ptrSs = (const unsigned char*)&sourceStyle(sx-r,sy-r);
+    const unsigned char* ptrTg = (const unsigned char*)&targetGuide(tx-r,ty-r);
+    const unsigned char* ptrSg = (const unsigned char*)&sourceGuide(sx-r,sy-r);
+    const unsigned char* ptrTm = (const unsigned char*)&targetModulation(tx-r,ty-r);
+    const int strideTs = targetStyle.width()*NS;
+    const int strideSs = sourceStyle.width()*NS;
+    const int strideTg = targetGuide.width()*NG;
+    const int strideSg = sourceGuide.width()*NG;
+    const int strideTm = targetModulation.width()*NG;
+    for(int j=0;j<patchSize;j++)
+    {
+      const float guideRow = modulatedSSDPatchRow(ptrTg,ptrSg,ptrTm,guideWeights,guideWeightsRow.data(),patchSize,modulatedSSDRow)*(1.0f/255.0f);
+      error += weightedSSDPatchRow(ptrTs,ptrSs,styleWeights,styleWeightsRow.data(),patchSize,weightedSSDRow) + guideRow;
+      guideError += guideRow;
+      ptrTs += strideTs;
+      ptrSs += strideSs;
+      ptrTg += strideTg;
+      ptrSg += strideSg;
+      ptrTm += strideTm;
+      if(error>ebest) { if(out_cutShort) { *out_cutShort = j<patchSize-1; } break; }
+    }
+
+    if(out_guideError) { *out_guideError = guideError; }
+    return error;
+  }
+};
 
-    for(int py=-r;py<=+r;py++)
+static V2i pyramidLevelSize(const V2i& sizeBase,const int numLevels,const int level)
+{
+  return V2i(V2f(sizeBase)*std::pow(2.0f,-float(numLevels-1-level)));
+}
+
+template<typename T>
+void copy(Array2<T>* out_dst,void* src)
+{
+  Array2<T>& dst = *out_dst;
+  memcpy(dst.data(),src,numel(dst)*sizeof(T));
+}
+
+template<typename T>
+void copy(void** out_dst,const Array2<T>& src)
+{
+  void*& dst = *out_dst;
+  memcpy(dst,src.data(),numel(src)*sizeof(T));
+}
+
+// The inputs are read and the output is written through EbsynthImage
+// descriptors, so the callers don't have to pack their data first; a plane
+// that is already packed the way it's needed is copied row by row.
+void ebsynthGatherImageCpu(const EbsynthImage* image,int width,int height,unsigned char* dst,int dstPixelStride,int dstPitch)
+{
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<height;y++)
+  {
+    unsigned char* rowDst = dst+std::ptrdiff_t(y)*dstPitch;
+
+    int c = 0;
+    for(int i=0;i<image->numPlanes;i++)
     {
-      for(int px=-r;px<=+r;px++)
+      const EbsynthPlane& plane = image->planes[i];
+      const unsigned char* rowSrc = (const unsigned char*)plane.data+std::ptrdiff_t(y)*plane.rowPitch;
+
+      if (plane.numChannels==dstPixelStride && plane.pixelStride==dstPixelStride)
+      {
+        memcpy(rowDst,rowSrc,width*dstPixelStride);
+      }
+      else
       {
+        for(int x=0;x<width;x++)
+        for(int k=0;k<plane.numChannels;k++)
         {
-          const Vec<NS,T> pixTs = targetStyle(tx + px,ty + py);
-          const Vec<NS,T> pixSs = sourceStyle(sx + px,sy + py);
-          for(int i=0;i<NS;i++)
-          {
-            const float diff = float(pixTs[i]) - float(pixSs[i]);
-            error += styleWeights[i]*diff*diff;
-          }
+          rowDst[x*dstPixelStride+c+k] = rowSrc[x*plane.pixelStride+k];
         }
+      }
 
-        {
-          const Vec<NG,T> pixTg = targetGuide(tx + px,ty + py);
-          const Vec<NG,T> pixSg = sourceGuide(sx + px,sy + py);
-          const Vec<NG,float> mult = Vec<NG,float>(targetModulation(tx,ty))/255.0f;
+      c += plane.numChannels;
+    }
+  }
+}
 
-          for(int i=0;i<NG;i++)
-          {
-            const float diff = float(pixTg[i]) - float(pixSg[i]);
-            error += guideWeights[i]*mult[i]*diff*diff;
-          }
+void ebsynthScatterImageCpu(const EbsynthImage* image,int width,int height,const unsigned char* src,int srcPixelStride,int srcPitch)
+{
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<height;y++)
+  {
+    const unsigned char* rowSrc = src+std::ptrdiff_t(y)*srcPitch;
+
+    int c = 0;
+    for(int i=0;i<image->numPlanes;i++)
+    {
+      const EbsynthPlane& plane = image->planes[i];
+      unsigned char* rowDst = (unsigned char*)plane.data+std::ptrdiff_t(y)*plane.rowPitch;
+
+      if (plane.numChannels==srcPixelStride && plane.pixelStride==srcPixelStride)
+      {
+        memcpy(rowDst,rowSrc,width*srcPixelStride);
+      }
+      else
+      {
+        for(int x=0;x<width;x++)
+        for(int k=0;k<plane.numChannels;k++)
+        {
+          rowDst[x*plane.pixelStride+k] = rowSrc[x*srcPixelStride+c+k];
         }
       }
 
-      if (error>ebest) { return error; }
+      c += plane.numChannels;
     }
+  }
+}
 
-    return error;
+// describes a packed buffer of the classic API
+static EbsynthImage packedImage(void* data,const int width,const int numChannels)
+{
+  EbsynthImage image;
+  memset(&image,0,sizeof(image));
+  image.numPlanes = 1;
+  image.planes[0].data = data;
+  image.planes[0].numChannels = numChannels;
+  image.planes[0].pixelStride = numChannels;
+  image.planes[0].rowPitch = width*numChannels;
+  return image;
+}
+
+template<int N,typename T>
+static void gatherImage(Array2<Vec<N,T>>& A,const int apron,const V2i& size,const EbsynthImage* image)
+{
+  ebsynthGatherImageCpu(image,size(0),size(1),(unsigned char*)&A(apron,apron),int(sizeof(Vec<N,T>)),A.width()*int(sizeof(Vec<N,T>)));
+}
+
+static inline void atomicAdd(int* ptr,const int value)
+{
+#ifdef _MSC_VER
+  _InterlockedExchangeAdd((volatile long*)ptr,long(value));
+#else
+  __atomic_fetch_add(ptr,value,__ATOMIC_RELAXED);
+#endif
+}
+
+static inline void atomicAdd(long long* ptr,const long long value)
+{
+#ifdef _MSC_VER
+  _InterlockedExchangeAdd64((volatile __int64*)ptr,__int64(value));
+#else
+  __atomic_fetch_add(ptr,value,__ATOMIC_RELAXED);
+#endif
+}
+
+void updateOmega(A2i& Omega,const V2i& sizeA,const int patchWidth,const V2i& axy,const V2i& bxy,const int incdec)
+{
+  const int r = patchWidth/2;
+  
+  int* ptr = (int*)&Omega(bxy(0)-r,bxy(1)-r);
+  const int ofs = (Omega.width()-patchWidth);
+
+  for(int j=0;j<patchWidth;j++)
+  {
+    for(int i=0;i<patchWidth;i++)
+    {
+      *ptr += incdec;
+      ptr++;
+    }
+    ptr += ofs;
   }
-};
-*/
+}
 
-static V2i pyramidLevelSize(const V2i& sizeBase,const int numLevels,const int level)
+// Patch-Match needs the occupancy of whole patches, i.e. the sum of Omega
+// over the patchWidth x patchWidth window around a source position. Instead
+// of summing the window for every candidate, Omega is kept box filtered:
+// OmegaBox(b) holds that window sum directly. Moving a match at c changes
+// the window sums of all b with |b-c| < patchWidth by the area the two
+// windows overlap, so an update touches (2*patchWidth-1)^2 cells but a
+// query is a single load. Candidates are queried far more often than they
+// are accepted, and the sums are the same integers as before.
+
+static void boxFilterOmega(A2i& OmegaBox,const A2i& Omega,const int patchWidth)
 {
-  return V2i(V2f(sizeBase)*std::pow(2.0f,-float(numLevels-1-level)));
+  const int r = patchWidth/2;
+  const int w = Omega.width();
+  const int h = Omega.height();
+
+  A2i rows(size(Omega));
+
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<h;y++)
+  for(int x=0;x<w;x++)
+  {
+    int sum = 0;
+    for(int i=std::max(x-r,0);i<=std::min(x+r,w-1);i++) { sum += Omega(i,y); }
+    rows(x,y) = sum;
+  }
+
+  #pragma omp parallel for schedule(static)
+  for(int y=0;y<h;y++)
+  for(int x=0;x<w;x++)
+  {
+    int sum = 0;
+    for(int j=std::max(y-r,0);j<=std::min(y+r,h-1);j++) { sum += rows(x,j); }
+    OmegaBox(x,y) = sum;
+  }
+}
+
+template<bool ATOMIC>
+void updateOmegaBox(A2i& OmegaBox,const int patchWidth,const V2i& bxy,const int incdec)
+{
+  const int d = patchWidth-1;
+
+  const int x0 = std::max(bxy(0)-d,0);
+  const int y0 = std::max(bxy(1)-d,0);
+  const int x1 = std::min(bxy(0)+d,OmegaBox.width()-1);
+  const int y1 = std::min(bxy(1)+d,OmegaBox.height()-1);
+
+  for(int y=y0;y<=y1;y++)
+  {
+    const int wy = incdec*(patchWidth-std::abs(y-bxy(1)));
+    int* ptr = &OmegaBox(0,y);
+
+    for(int x=x0;x<=x1;x++)
+    {
+      const int weight = wy*(patchWidth-std::abs(x-bxy(0)));
+      if (ATOMIC) { atomicAdd(&ptr[x],weight); }
+      else        { ptr[x] += weight; }
+    }
+  }
+}
+
+// The tiles of one phase update OmegaBox atomically while the others read
+// it, so the reads are atomic too; a relaxed load is a plain load on x86.
+static inline int atomicLoad(const int* ptr)
+{
+#ifdef _MSC_VER
+  return *(const volatile int*)ptr;
+#else
+  return __atomic_load_n(ptr,__ATOMIC_RELAXED);
+#endif
 }
 
-template<typename T>
-void copy(Array2<T>* out_dst,void* src)
+static int patchOmega(const int patchWidth,const V2i& bxy,const A2i& OmegaBox)
 {
-  Array2<T>& dst = *out_dst;
-  memcpy(dst.data(),src,numel(dst)*sizeof(T));
+  return atomicLoad(&OmegaBox(bxy));
 }
 
-template<typename T>
-void copy(void** out_dst,const Array2<T>& src)
+// What Patch-Match did, for EbsynthLevelStats. Every tile or band counts
+// into its own copy and adds it to the shared one when it's done.
+struct PatchMatchCounters
 {
-  void*& dst = *out_dst;
-  memcpy(dst,src.data(),numel(src)*sizeof(T));
-}
+  PatchMatchCounters() : numPatchEvals(0),numEarlyTerminations(0),numAcceptedPropagation(0),numAcceptedRandomSearch(0),errorSeconds(0) { }
 
-void updateOmega(A2i& Omega,const V2i& sizeA,const int patchWidth,const V2i& axy,const V2i& bxy,const int incdec)
+  long long numPatchEvals;
+  long long numEarlyTerminations;
+  long long numAcceptedPropagation;
+  long long numAcceptedRandomSearch;
+  double    errorSeconds;
+
+  void addAtomic(const PatchMatchCounters& other)
+  {
+    atomicAdd(&numPatchEvals,other.numPatchEvals);
+    atomicAdd(&numEarlyTerminations,other.numEarlyTerminations);
+    atomicAdd(&numAcceptedPropagation,other.numAcceptedPropagation);
+    atomicAdd(&numAcceptedRandomSearch,other.numAcceptedRandomSearch);
+  }
+};
+
+// returns true if the candidate replaced the current match
+template<typename FUNC>
+bool tryPatch(FUNC patchError,const V2i& sizeA,int patchWidth,const V2i& axy,const V2i& bxy,A2V2i& N,A2f& E,A2f& EG,A2i& Omega,const A2i& OmegaRead,float omegaBest,float lambda,bool atomicOmega,PatchMatchCounters& counters)
 {
-  const int r = patchWidth/2;
-  
-  int* ptr = (int*)&Omega(bxy(0)-r,bxy(1)-r);
-  const int ofs = (Omega.width()-patchWidth);
+  const float curOcc = (float(patchOmega(patchWidth,N(axy),OmegaRead))/float(patchWidth*patchWidth))/omegaBest;
+  const float newOcc = (float(patchOmega(patchWidth,   bxy,OmegaRead))/float(patchWidth*patchWidth))/omegaBest;
+    
+  const float curErr = E(axy);
+  bool cutShort = false;
+  float newGuideErr = 0;
+  const float newErr = patchError(patchWidth,axy,bxy,curErr+lambda*curOcc,&cutShort,&newGuideErr);
 
-  for(int j=0;j<patchWidth;j++)
+  // the error stops accumulating once it exceeds the bound it was given;
+  // only count the evaluations that skipped at least one row because of it
+  counters.numPatchEvals++;
+  if (cutShort) { counters.numEarlyTerminations++; }
+
+  if ((newErr+lambda*newOcc) < (curErr+lambda*curOcc))
   {
-    for(int i=0;i<patchWidth;i++)
+    if (atomicOmega)
     {
-      *ptr += incdec;
-      ptr++;
+      updateOmegaBox<true>(Omega,patchWidth,bxy   ,+1);
+      updateOmegaBox<true>(Omega,patchWidth,N(axy),-1);
     }
-    ptr += ofs;
+    else
+    {
+      updateOmegaBox<false>(Omega,patchWidth,bxy   ,+1);
+      updateOmegaBox<false>(Omega,patchWidth,N(axy),-1);
+    }
+    N(axy) = bxy;
+    E(axy) = newErr;
+    // an accepted candidate never exceeded the bound, so newErr and its
+    // guide part are those of the whole patch
+    EG(axy) = newGuideErr;
+
+    return true;
   }
+
+  return false;
 }
 
-static int patchOmega(const int patchWidth,const V2i& bxy,const A2i& Omega)
+// Candidates outside of the allowed part of the source are never tried, an
+// empty mask allows the whole source.
+static inline bool sourceAllowed(const A2uc& sourceMask,const V2i& bxy)
 {
-  const int r = patchWidth/2;
-  
-  int sum = 0;
+  return numel(sourceMask)==0 || sourceMask(bxy)!=0;
+}
 
-  const int* ptr = (int*)&Omega(bxy(0)-r,bxy(1)-r);
-  const int ofs = (Omega.width()-patchWidth);
+template<typename FUNC>
+void patchmatchPixel(FUNC                    patchError,
+                     const V2i&              sizeA,
+                     const V2i&              sizeB,
+                     const int               w,
+                     const std::vector<int>& irad,
+                     const int               x,
+                     const int               y,
+                     const int               q,
+                     const int               iter_seed,
+                     const float             omegaBest,
+                     const float             lambda,
+                     const bool              atomicOmega,
+                     const bool              counterRng,
+                     const A2uc&             sourceMask,
+                     A2V2i& N,
+                     A2f&   E,
+                     A2f&   EG,
+                     A2i&   Omega,
+                     const A2i& OmegaRead,
+                     PatchMatchCounters& counters)
+{
+  const bool odd = (q == 1);
+  const int nir = int(irad.size());
 
-  for(int j=0;j<patchWidth;j++)
+  if (odd ? (x > 0) : (x < sizeA(0)-1))
   {
-    for(int i=0;i<patchWidth;i++)
+    V2i n = N(x-q,y); n[0] += q;
+
+    if ((odd ? (n[0] < sizeB(0)-w/2) : (n[0] >= w/2)) && sourceAllowed(sourceMask,n))
     {
-      sum += (*ptr);
-      ptr++;
+      if (tryPatch(patchError,sizeA,w,V2i(x,y),n,N,E,EG,Omega,OmegaRead,omegaBest,lambda,atomicOmega,counters)) { counters.numAcceptedPropagation++; }
     }
-    ptr += ofs;
   }
 
-  return sum;
-}
+  if (odd ? (y > 0) : (y <sizeA(1)-1))
+  {
+    V2i n = N(x,y-q); n[1] += q;
 
-template<typename FUNC>
-bool tryPatch(FUNC patchError,const V2i& sizeA,int patchWidth,const V2i& axy,const V2i& bxy,A2V2i& N,A2f& E,A2i& Omega,float omegaBest,float lambda)
-{
-  const float curOcc = (float(patchOmega(patchWidth,N(axy),Omega))/float(patchWidth*patchWidth))/omegaBest;
-  const float newOcc = (float(patchOmega(patchWidth,   bxy,Omega))/float(patchWidth*patchWidth))/omegaBest;
-    
-  const float curErr = E(axy);
-  const float newErr = patchError(patchWidth,axy,bxy,curErr+lambda*curOcc);
+    if ((odd ? (n[1] < sizeB(1)-w/2) : (n[1] >= w/2)) && sourceAllowed(sourceMask,n))
+    {
+      if (tryPatch(patchError,sizeA,w,V2i(x,y),n,N,E,EG,Omega,OmegaRead,omegaBest,lambda,atomicOmega,counters)) { counters.numAcceptedPropagation++; }
+    }
+  }
 
-  if ((newErr+lambda*newOcc) < (curErr+lambda*curOcc))
+  #define RANDI(u) (18000 * ((u) & 65535) + ((u) >> 16))
+
+  unsigned int seed = counterRng ? pcgHash(unsigned(iter_seed) ^ pcgHash(unsigned(x) ^ pcgHash(unsigned(y))))
+                                 : (x | (y<<11)) ^ iter_seed;
+  seed = RANDI(seed);
+
+  const V2i pix0 = N(x,y);
+  //for (int i = 0; i < nir; i++)
+  for (int i = nir-1; i >=0; i--)
   {
-    updateOmega(Omega,sizeA,patchWidth,axy,bxy   ,+1);
-    updateOmega(Omega,sizeA,patchWidth,axy,N(axy),-1);
-    N(axy) = bxy;
-    E(axy) = newErr;
+    V2i tl = pix0 - V2i(irad[i], irad[i]);
+    V2i br = pix0 + V2i(irad[i], irad[i]);
+
+    tl = std::max(tl,V2i(w/2,w/2));
+    br = std::min(br,sizeB-V2i(w/2,w/2));
+
+    const int _rndX = RANDI(seed);
+    const int _rndY = RANDI(_rndX);
+    seed=_rndY;
+
+    const V2i n = V2i
+    (
+      tl[0] + (_rndX % (br[0]-tl[0])),
+      tl[1] + (_rndY % (br[1]-tl[1]))
+    );
+
+    if (sourceAllowed(sourceMask,n) && tryPatch(patchError,sizeA,w,V2i(x,y),n,N,E,EG,Omega,OmegaRead,omegaBest,lambda,atomicOmega,counters)) { counters.numAcceptedRandomSearch++; }
   }
 
-  return true;
+  #undef RANDI
 }
 
 template<typename FUNC>
@@ -535,13 +1405,27 @@ void patchmatch(const V2i&  sizeA,
                 const float lambda,
                 const int   numIters,
                 const int   numThreads,
+                const int   schedule,
+                const bool  deterministic,
+                const unsigned int seed,
+                const A2uc& mask,
+                const A2uc& region,
+                const V2i&  regionMin,
+                const V2i&  regionMax,
+                const A2uc& sourceMask,
                 A2V2i& N,
                 A2f&   E,
-                A2i&   Omega)
+                A2f&   EG,
+                bool*  guideErrorValid,
+                A2i&   Omega,
+                PatchMatchCounters* counters)
 {
   const int w = patchWidth;
-    
-  E = nnfError(N,patchWidth,patchError);
+
+  const double errorStart = now();
+  counters->numPatchEvals += nnfError(N,patchWidth,patchError,mask,regionMin,regionMax,E,EG,*guideErrorValid);
+  *guideErrorValid = true;
+  counters->errorSeconds += now()-errorStart;
   
   const float sra = 0.5f;
   
@@ -551,8 +1435,6 @@ void patchmatch(const V2i&  sizeA,
   
   while (irad.back() != 1) irad.push_back(int(std::pow(sra, int(irad.size())) * irad[0]));
   
-  const int nir = int(irad.size());
-  
 #ifdef __APPLE__
   dispatch_queue_t gcdq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH,0);
   const int numThreads_ = 8;
@@ -560,23 +1442,121 @@ void patchmatch(const V2i&  sizeA,
   const int numThreads_ = numThreads<1 ? omp_get_max_threads() : numThreads;
 #endif
 
-  const int minTileHeight = 8;
-  const int numTiles = int(ceil(float(sizeA(1))/float(numThreads_))) > minTileHeight ? numThreads_ : std::max(int(ceil(float(sizeA(1))/float(minTileHeight))),1);
-  const int tileHeight = sizeA(1)/numTiles;
+  // the row bands depend on the number of threads, the tiles don't; the row
+  // bands stay the default, so the output doesn't change unless asked for
+  const bool tiled = (schedule==EBSYNTH_SCHEDULE_TILED) || deterministic;
 
-  const float omegaBest = (float(sizeA(0)*sizeA(1)) /
+  // Only the matches of the pixels that can be searched, those of region
+  // (all of them when it's empty), occupy the source; the rest of a masked
+  // target is the base image and doesn't use the source. The occupancy of a
+  // uniform distribution, omegaBest, is scaled to their number.
+  int numRegionPixels = 0;
+  {
+    A2i OmegaCount(size(Omega));
+    fill(&OmegaCount,(int)0);
+    for(int y=regionMin(1);y<regionMax(1);y++)
+    for(int x=regionMin(0);x<regionMax(0);x++)
+    {
+      if (numel(region)>0 && region(x,y)==0) { continue; }
+      updateOmega(OmegaCount,sizeA,w,V2i(x,y),N(x,y),+1);
+      numRegionPixels++;
+    }
+
+    // from here on Omega holds the box-filtered occupancy, see updateOmegaBox
+    boxFilterOmega(Omega,OmegaCount,w);
+  }
+
+  const float omegaBest = (float(numRegionPixels) /
                            float(sizeB(0)*sizeB(1))) * float(patchWidth*patchWidth);
 
-  fill(&Omega,(int)0);
-  for(int y=0;y<sizeA(1);y++)
-  for(int x=0;x<sizeA(0);x++)
+  if (tiled)
   {
-    updateOmega(Omega,sizeA,w,V2i(x,y),N(x,y),+1);
+    // The target is cut into square tiles colored like a checkerboard. All
+    // tiles of one color are processed concurrently, then all tiles of the
+    // other color, so the left/right/top/bottom neighbors a pixel propagates
+    // from never change under it and each tile sees the matches its
+    // neighbors found in the previous phase. Matches of tiles processed
+    // concurrently can overlap in the source, so Omega is updated atomically.
+    const int tileSize = 32;
+    const int numTilesX = (regionMax(0)-regionMin(0)+tileSize-1)/tileSize;
+    const int numTilesY = (regionMax(1)-regionMin(1)+tileSize-1)/tileSize;
+    const int numTiles = numTilesX*numTilesY;
+    const bool atomicOmega = numThreads_>1;
+
+    // In the deterministic mode the occupancy is read from a snapshot taken
+    // at the start of each phase, so the result doesn't depend on how the
+    // updates of concurrently processed tiles interleave.
+    A2i OmegaSnapshot;
+    if (deterministic) { OmegaSnapshot = A2i(size(Omega)); }
+    const A2i& OmegaRead = deterministic ? OmegaSnapshot : Omega;
+
+    for (int iter = 0; iter < numIters; iter++)
+    {
+      const int iter_seed = deterministic ? int(pcgHash(seed ^ pcgHash(unsigned(iter)))) : runRand();
+      const bool odd = (iter%2 == 0);
+      const int q = odd ? 1 : -1;
+
+      for (int phase = 0; phase < 2; phase++)
+      {
+        // the color of the tile the scan starts from goes first
+        const int firstColor = odd ? 0 : (numTilesX-1+numTilesY-1)%2;
+        const int color = phase==0 ? firstColor : 1-firstColor;
+
+        if (deterministic) { memcpy(OmegaSnapshot.data(),Omega.data(),numel(Omega)*sizeof(int)); }
+
+#ifdef __APPLE__
+        dispatch_apply(numTiles,gcdq,^(size_t tileIdx)
+#else
+        #pragma omp parallel for num_threads(numThreads_) schedule(dynamic)
+        for (int tileIdx = 0; tileIdx < numTiles; tileIdx++)
+#endif
+        {
+          const int t = odd ? int(tileIdx) : numTiles-1-int(tileIdx);
+          const int tx = t%numTilesX;
+          const int ty = t/numTilesX;
+
+          if ((tx+ty)%2 == color)
+          {
+            PatchMatchCounters tileCounters;
+
+            const int _x0 = regionMin(0)+tx*tileSize;
+            const int _y0 = regionMin(1)+ty*tileSize;
+            const int _x1 = std::min(_x0+tileSize,regionMax(0));
+            const int _y1 = std::min(_y0+tileSize,regionMax(1));
+
+            const int x0 = odd ? _x0 : _x1-1;
+            const int y0 = odd ? _y0 : _y1-1;
+            const int x1 = odd ? _x1 : _x0-1;
+            const int y1 = odd ? _y1 : _y0-1;
+
+            for (int y = y0; y != y1; y += q)
+            for (int x = x0; x != x1; x += q)
+            {
+              if (mask(x,y)==0) { continue; }
+
+              patchmatchPixel(patchError,sizeA,sizeB,w,irad,x,y,q,iter_seed,omegaBest,lambda,atomicOmega,deterministic,sourceMask,N,E,EG,Omega,OmegaRead,tileCounters);
+            }
+
+            counters->addAtomic(tileCounters);
+          }
+        }
+#ifdef __APPLE__
+        );
+#endif
+      }
+    }
+
+    return;
   }
 
+  const int minTileHeight = 8;
+  const int regionHeight = regionMax(1)-regionMin(1);
+  const int numTiles = int(ceil(float(regionHeight)/float(numThreads_))) > minTileHeight ? numThreads_ : std::max(int(ceil(float(regionHeight)/float(minTileHeight))),1);
+  const int tileHeight = regionHeight/numTiles;
+
   for (int iter = 0; iter < numIters; iter++)
   {
-    const int iter_seed = rand();
+    const int iter_seed = runRand();
     
 #ifdef __APPLE__
     dispatch_apply(numTiles,gcdq,^(size_t blockIdx)
@@ -592,68 +1572,26 @@ void patchmatch(const V2i&  sizeA,
       const int threadId = omp_get_thread_num();
 #endif
 
-      const int _y0 = threadId*tileHeight;
-      const int _y1 = threadId==numTiles-1 ? sizeA(1) : std::min(_y0+tileHeight,sizeA(1));
+      const int _y0 = regionMin(1)+threadId*tileHeight;
+      const int _y1 = threadId==numTiles-1 ? regionMax(1) : std::min(_y0+tileHeight,regionMax(1));
       
       const int q  = odd ? 1 : -1;
-      const int x0 = odd ? 0 : sizeA(0)-1;
+      const int x0 = odd ? regionMin(0) : regionMax(0)-1;
       const int y0 = odd ? _y0 : _y1-1;
-      const int x1 = odd ? sizeA(0) : -1;
+      const int x1 = odd ? regionMax(0) : regionMin(0)-1;
       const int y1 = odd ? _y1 : _y0-1;
+
+      PatchMatchCounters bandCounters;
       
       for (int y = y0; y != y1; y += q)
       for (int x = x0; x != x1; x += q)
       {        
-        if (odd ? (x > 0) : (x < sizeA(0)-1))
-        {
-          V2i n = N(x-q,y); n[0] += q;
-          
-          if (odd ? (n[0] < sizeB(0)-w/2) : (n[0] >= w/2))
-          {
-            tryPatch(patchError,sizeA,w,V2i(x,y),n,N,E,Omega,omegaBest,lambda);
-          }
-        }
-        
-        if (odd ? (y > 0) : (y <sizeA(1)-1))
-        {
-          V2i n = N(x,y-q); n[1] += q;
-          
-          if (odd ? (n[1] < sizeB(1)-w/2) : (n[1] >= w/2))
-          {
-            tryPatch(patchError,sizeA,w,V2i(x,y),n,N,E,Omega,omegaBest,lambda);
-          }
-        }
-           
-        #define RANDI(u) (18000 * ((u) & 65535) + ((u) >> 16))
-
-        unsigned int seed = (x | (y<<11)) ^ iter_seed;
-        seed = RANDI(seed);
-      
-        const V2i pix0 = N(x,y);
-        //for (int i = 0; i < nir; i++)
-        for (int i = nir-1; i >=0; i--)
-        {
-          V2i tl = pix0 - V2i(irad[i], irad[i]);
-          V2i br = pix0 + V2i(irad[i], irad[i]);
-          
-          tl = std::max(tl,V2i(w/2,w/2));
-          br = std::min(br,sizeB-V2i(w/2,w/2));
-          
-          const int _rndX = RANDI(seed);
-          const int _rndY = RANDI(_rndX);
-          seed=_rndY;
-          
-          const V2i n = V2i
-          (
-            tl[0] + (_rndX % (br[0]-tl[0])),
-            tl[1] + (_rndY % (br[1]-tl[1]))
-          );
-        
-          tryPatch(patchError,sizeA,w,V2i(x,y),n,N,E,Omega,omegaBest,lambda);
-        }
+        if (mask(x,y)==0) { continue; }
 
-        #undef RANDI
+        patchmatchPixel(patchError,sizeA,sizeB,w,irad,x,y,q,iter_seed,omegaBest,lambda,false,false,sourceMask,N,E,EG,Omega,Omega,bandCounters);
       }
+
+      counters->addAtomic(bandCounters);
     } 
 #ifdef __APPLE__
     );
@@ -661,17 +1599,137 @@ void patchmatch(const V2i&  sizeA,
   }
 }
 
+struct EbsynthSourceCpu
+{
+  virtual ~EbsynthSourceCpu() { }
+
+  virtual int numStyleChannels() const = 0;
+  virtual int numGuideChannels() const = 0;
+
+  virtual void run(int    targetWidth,
+                   int    targetHeight,
+                   const EbsynthImage* targetGuide,
+                   const EbsynthImage* targetModulation,
+                   float* styleWeights,
+                   float* guideWeights,
+                   float  uniformityWeight,
+                   int    patchSize,
+                   int    voteMode,
+                   int    numPyramidLevels,
+                   int*   numSearchVoteItersPerLevel,
+                   int*   numPatchMatchItersPerLevel,
+                   int*   stopThresholdPerLevel,
+                   int    extraPass3x3,
+                   void*  outputNnfData,
+                   const EbsynthImage* outputImage,
+                   const EbsynthOptions* options,
+                   EbsynthStats* stats) const = 0;
+};
+
+// What a run leaves behind for incremental re-runs: the NNF and the target
+// style at the end of every level, coarse first, and the settings they're
+// valid for.
+struct EbsynthState
+{
+  int sourceWidth;
+  int sourceHeight;
+  int targetWidth;
+  int targetHeight;
+  int numStyleChannels;
+  int patchSize;
+  int numPyramidLevels;
+  int startPyramidLevel;                           // the levels before it weren't run, their entries are empty
+  int extraPass3x3;
+
+  std::vector<A2V2i> nnf;
+  std::vector<std::vector<unsigned char>> style;
+};
+
+EbsynthState* ebsynthCreateStateCpu()
+{
+  return new EbsynthState();
+}
+
+void ebsynthDestroyStateCpu(EbsynthState* state)
+{
+  delete state;
+}
+
+// The source side of the synthesis, built once and only read by the runs.
+// Level k holds the source scaled by 2^-k, i.e. the finest level comes
+// first, so the same pyramid serves runs with any number of levels.
+template<int NS,int NG>
+struct SourcePyramidCpu : EbsynthSourceCpu
+{
+  std::vector<Array2<Vec<NS,unsigned char>>> style;
+  std::vector<Array2<Vec<NG,unsigned char>>> guide;
+
+  SourcePyramidCpu(int   sourceWidth,
+                   int   sourceHeight,
+                   const EbsynthImage* sourceStyle,
+                   const EbsynthImage* sourceGuide)
+  {
+    const V2i sourceSize = V2i(sourceWidth,sourceHeight);
+
+    int numLevels = 0;
+    while (numLevels<EBSYNTH_MAX_PYRAMID_LEVELS && min(pyramidLevelSize(sourceSize,numLevels+1,0))>=1) { numLevels++; }
+
+    style.resize(numLevels);
+    guide.resize(numLevels);
+
+    style[0] = Array2<Vec<NS,unsigned char>>(sourceSize);
+    guide[0] = Array2<Vec<NG,unsigned char>>(sourceSize);
+
+    gatherImage(style[0],0,sourceSize,sourceStyle);
+    gatherImage(guide[0],0,sourceSize,sourceGuide);
+
+    for(int k=1;k<numLevels;k++)
+    {
+      const V2i levelSize = pyramidLevelSize(sourceSize,k+1,0);
+
+      style[k] = Array2<Vec<NS,unsigned char>>(levelSize);
+      guide[k] = Array2<Vec<NG,unsigned char>>(levelSize);
+
+      downscale2x(style[k],style[k-1]);
+      downscale2x(guide[k],guide[k-1]);
+    }
+  }
+
+  int numStyleChannels() const override { return NS; }
+  int numGuideChannels() const override { return NG; }
+
+  void run(int    targetWidth,
+           int    targetHeight,
+           const EbsynthImage* targetGuide,
+           const EbsynthImage* targetModulation,
+           float* styleWeights,
+           float* guideWeights,
+           float  uniformityWeight,
+           int    patchSize,
+           int    voteMode,
+           int    numPyramidLevels,
+           int*   numSearchVoteItersPerLevel,
+           int*   numPatchMatchItersPerLevel,
+           int*   stopThresholdPerLevel,
+           int    extraPass3x3,
+           void*  outputNnfData,
+           const EbsynthImage* outputImage,
+           const EbsynthOptions* options,
+           EbsynthStats* stats) const override;
+};
+
+// keepColumns and keepRows are for the tiles of ebsynthCpuTiled: the first
+// keepColumns columns and keepRows rows of the finest level keep the matches
+// of initialNnfData as they are. They are neither searched nor voted, but
+// they still vote into the pixels around them. They have to be outside of
+// the target mask.
 template<int NS,int NG>
-void ebsynthCpu(int    numStyleChannels,
-                int    numGuideChannels,
-                int    sourceWidth,
-                int    sourceHeight,
-                void*  sourceStyleData,
-                void*  sourceGuideData,
+void ebsynthCpu(const SourcePyramidCpu<NS,NG>& source,
                 int    targetWidth,
+
                 int    targetHeight,
-                void*  targetGuideData,
-                void*  targetModulationData,
+                const EbsynthImage* targetGuide,
+                const EbsynthImage* targetModulation,
                 float* styleWeights,
                 float* guideWeights,
                 float  uniformityWeight,
@@ -683,10 +1741,63 @@ void ebsynthCpu(int    numStyleChannels,
                 int*   stopThresholdPerLevel,
                 int    extraPass3x3,
                 void*  outputNnfData,
-                void*  outputImageData)
+                const EbsynthImage* outputImage,
+                const EbsynthOptions* options,
+                EbsynthStats* stats,
+                int    keepColumns=0,
+                int    keepRows=0)
 {
   const int levelCount = numPyramidLevels;
 
+  if (levelCount<1 || levelCount>int(source.style.size()))
+  {
+    fprintf(stderr,"error: %d pyramid levels requested, the source allows 1 to %d\n",levelCount,int(source.style.size()));
+    return;
+  }
+
+  const double runStart = now();
+
+  EbsynthStats runStats;
+  memset(&runStats,0,sizeof(runStats));
+
+  const int sourceWidth  = source.style[0].width();
+  const int sourceHeight = source.style[0].height();
+
+  const int schedule = options!=NULL ? options->schedule : EBSYNTH_SCHEDULE_AUTO;
+  const bool deterministic = options!=NULL && options->deterministic!=0;
+  const unsigned int seed = options!=NULL ? options->seed : 0;
+  const V2i* initialNnf = options!=NULL ? (const V2i*)options->initialNnfData : NULL;
+  const int startLevel = options!=NULL ? clamp(options->startPyramidLevel,0,levelCount-1) : 0;
+  const unsigned char* targetMask = options!=NULL && options->baseImageData!=NULL ? (const unsigned char*)options->targetMaskData : NULL;
+
+  const unsigned char* sourceMaskData = options!=NULL ? (const unsigned char*)options->sourceMaskData : NULL;
+
+  EbsynthState* state = options!=NULL ? options->state : NULL;
+  const bool incremental = state!=NULL && options->incremental!=0 &&
+                           state->sourceWidth==sourceWidth && state->sourceHeight==sourceHeight &&
+                           state->targetWidth==targetWidth && state->targetHeight==targetHeight &&
+                           state->numStyleChannels==NS && state->patchSize==patchSize &&
+                           state->numPyramidLevels==levelCount && state->startPyramidLevel==startLevel &&
+                           state->extraPass3x3==extraPass3x3;
+
+  if (state!=NULL && !incremental)
+  {
+    state->sourceWidth = sourceWidth;
+    state->sourceHeight = sourceHeight;
+    state->targetWidth = targetWidth;
+    state->targetHeight = targetHeight;
+    state->numStyleChannels = NS;
+    state->patchSize = patchSize;
+    state->numPyramidLevels = levelCount;
+    state->startPyramidLevel = startLevel;
+    state->extraPass3x3 = extraPass3x3;
+    state->nnf.assign(levelCount,A2V2i());
+    state->style.assign(levelCount,std::vector<unsigned char>());
+  }
+
+  // the target is synthesized only in a region of interest, see below
+  const bool masked = targetMask!=NULL || incremental;
+
   struct PyramidLevel
   {
     PyramidLevel() { }
@@ -696,18 +1807,32 @@ void ebsynthCpu(int    numStyleChannels,
     int targetWidth;
     int targetHeight;
 
-    Array2<Vec<NS,unsigned char>> sourceStyle;
-    Array2<Vec<NG,unsigned char>> sourceGuide;
+    const Array2<Vec<NS,unsigned char>>* sourceStyle;
+    const Array2<Vec<NG,unsigned char>>* sourceGuide;
     Array2<Vec<NS,unsigned char>> targetStyle;
     Array2<Vec<NS,unsigned char>> targetStyle2;
-    //Array2<unsigned char>         mask;
-    //Array2<unsigned char>         mask2;
-    Array2<Vec<NG,unsigned char>> targetGuide;
-    Array2<Vec<NG,unsigned char>> targetModulation;
+    Array2<unsigned char>         mask;
+    Array2<unsigned char>         mask2;
+    Array2<Vec<NG,unsigned char>> targetGuide;      // padded
+    Array2<Vec<NG,unsigned char>> targetModulation; // padded
+    Array2<Vec<NS,unsigned char>> targetStylePadded;
     Array2<Vec<2,int>>            NNF;
     //Array2<Vec<2,int>>            NNF2;
     Array2<float>                 E;
+    Array2<float>                 EG;
     Array2<int>                   Omega;
+    Array2<unsigned char>         roi;              // empty when the whole target is synthesized
+    Array2<unsigned char>         region;           // the pixels that can be searched: roi and the patch radius around it, empty when all can
+    V2i                           regionMin;        // the bounding box of region, the passes over the target stay within it
+    V2i                           regionMax;
+    Array2<unsigned char>         kept;             // the pixels of region kept as they are (keepColumns, keepRows), empty when none
+    V2i                           keptMin;          // the bounding box of kept
+    V2i                           keptMax;
+    Array2<Vec<NS,unsigned char>> base;
+    V2i                           sourceOffset;     // where the part of the source the level works on starts
+    Array2<Vec<NS,unsigned char>> sourceStyleCrop;
+    Array2<Vec<NG,unsigned char>> sourceGuideCrop;
+    Array2<unsigned char>         sourceMask;       // the allowed match positions, empty when all are allowed
   };
 
   std::vector<PyramidLevel> pyramid(levelCount);
@@ -720,28 +1845,212 @@ void ebsynthCpu(int    numStyleChannels,
     pyramid[level].sourceHeight = levelSourceSize(1);
     pyramid[level].targetWidth  = levelTargetSize(0);
     pyramid[level].targetHeight = levelTargetSize(1);
+
+    pyramid[level].sourceStyle = &source.style[levelCount-1-level];
+    pyramid[level].sourceGuide = &source.guide[levelCount-1-level];
+    pyramid[level].sourceOffset = V2i(0,0);
+  }
+
+  // With a source mask, every level works on the bounding box of the allowed
+  // part of the source grown by a patch radius, so the random search and the
+  // occupancy map Omega shrink with it, and only the patches that fit into the
+  // mask are matched. The matches are relative to the box within a level and
+  // to the whole source between the levels and in the output.
+  if (sourceMaskData!=NULL)
+  {
+    int x0 = sourceWidth;
+    int y0 = sourceHeight;
+    int x1 = 0;
+    int y1 = 0;
+    for(int y=0;y<sourceHeight;y++)
+    for(int x=0;x<sourceWidth;x++)
+    {
+      if (sourceMaskData[y*sourceWidth+x]!=0)
+      {
+        x0 = std::min(x0,x); x1 = std::max(x1,x+1);
+        y0 = std::min(y0,y); y1 = std::max(y1,y+1);
+      }
+    }
+
+    if (x1<=x0)
+    {
+      fprintf(stderr,"error: the source mask is empty\n");
+      return;
+    }
+
+    Array2<unsigned char> levelMask(V2i(sourceWidth,sourceHeight));
+    for(int xy=0;xy<numel(levelMask);xy++) { levelMask[xy] = sourceMaskData[xy]!=0 ? 255 : 0; }
+
+    const int r = patchSize/2;
+
+    for (int level=levelCount-1;level>=startLevel;level--)
+    {
+      const V2i levelSourceSize = V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight);
+
+      if (level<levelCount-1)
+      {
+        Array2<unsigned char> coarserMask(levelSourceSize);
+        downscaleMask2x(coarserMask,levelMask);
+        levelMask = coarserMask;
+      }
+
+      const float scale = std::pow(2.0f,-float(levelCount-1-level));
+      V2i boxMin = V2i(clamp(int(std::floor(float(x0)*scale))-r,0,levelSourceSize(0)),
+                       clamp(int(std::floor(float(y0)*scale))-r,0,levelSourceSize(1)));
+      V2i boxMax = V2i(clamp(int(std::ceil(float(x1)*scale))+r,0,levelSourceSize(0)),
+                       clamp(int(std::ceil(float(y1)*scale))+r,0,levelSourceSize(1)));
+
+      // a box too small for a patch is grown around its center until one fits
+      for(int i=0;i<2;i++)
+      {
+        const int minSize = std::min(patchSize+1,levelSourceSize[i]);
+        if (boxMax[i]-boxMin[i]<minSize)
+        {
+          boxMin[i] = clamp((boxMin[i]+boxMax[i]-minSize)/2,0,levelSourceSize[i]-minSize);
+          boxMax[i] = boxMin[i]+minSize;
+        }
+      }
+      const V2i boxSize = boxMax-boxMin;
+
+      // when not even a pixel of the mask is left to match at this level,
+      // the level matches against the whole source
+      const A2uc allowed = allowedCenters(cropArray(levelMask,boxMin,boxSize),patchSize);
+      if (numel(allowed)==0) { continue; }
+
+      pyramid[level].sourceOffset    = boxMin;
+      pyramid[level].sourceStyleCrop = cropArray(*pyramid[level].sourceStyle,boxMin,boxSize);
+      pyramid[level].sourceGuideCrop = cropArray(*pyramid[level].sourceGuide,boxMin,boxSize);
+      pyramid[level].sourceStyle     = &pyramid[level].sourceStyleCrop;
+      pyramid[level].sourceGuide     = &pyramid[level].sourceGuideCrop;
+      pyramid[level].sourceWidth     = boxSize(0);
+      pyramid[level].sourceHeight    = boxSize(1);
+      pyramid[level].sourceMask      = allowed;
+    }
+  }
+
+  // The patch error reads the target through images padded by the patch
+  // radius (see fillApron), the extra 3x3 pass included. The target guide
+  // and modulation are kept padded for the whole run: the finest level is
+  // gathered right from the caller's memory and the coarser levels are
+  // downscaled from it.
+  const int apron = std::max(patchSize,extraPass3x3!=0 ? 3 : 1)/2;
+
+  const double pyramidStart = now();
+
+  {
+    const V2i finestSize = V2i(pyramid[levelCount-1].targetWidth,pyramid[levelCount-1].targetHeight);
+
+    allocPadded(pyramid[levelCount-1].targetGuide,finestSize,apron);
+    gatherImage(pyramid[levelCount-1].targetGuide,apron,finestSize,targetGuide);
+    fillApron(pyramid[levelCount-1].targetGuide,finestSize,apron);
+
+    if (targetModulation)
+    {
+      allocPadded(pyramid[levelCount-1].targetModulation,finestSize,apron);
+      gatherImage(pyramid[levelCount-1].targetModulation,apron,finestSize,targetModulation);
+      fillApron(pyramid[levelCount-1].targetModulation,finestSize,apron);
+    }
+  }
+
+  for (int level=levelCount-2;level>=startLevel;level--)
+  {
+    const V2i levelTargetSize = V2i(pyramid[level].targetWidth,pyramid[level].targetHeight);
+
+    downscale2xPadded(pyramid[level].targetGuide,pyramid[level+1].targetGuide,levelTargetSize,apron);
+
+    if (targetModulation)
+    {
+      downscale2xPadded(pyramid[level].targetModulation,pyramid[level+1].targetModulation,levelTargetSize,apron);
+    }
   }
 
-  pyramid[levelCount-1].sourceStyle  = Array2<Vec<NS,unsigned char>>(V2i(pyramid[levelCount-1].sourceWidth,pyramid[levelCount-1].sourceHeight));
-  pyramid[levelCount-1].sourceGuide  = Array2<Vec<NG,unsigned char>>(V2i(pyramid[levelCount-1].sourceWidth,pyramid[levelCount-1].sourceHeight));
-  pyramid[levelCount-1].targetGuide  = Array2<Vec<NG,unsigned char>>(V2i(pyramid[levelCount-1].targetWidth,pyramid[levelCount-1].targetHeight));
+  // With a target mask, only its pixels are voted, and only the pixels within
+  // the patch radius of them are searched; the rest of the target is the
+  // base image at every level and the patches at the edge of the region are
+  // matched against it.
+  if (targetMask!=NULL)
+  {
+    const V2i finestSize = V2i(pyramid[levelCount-1].targetWidth,pyramid[levelCount-1].targetHeight);
+
+    pyramid[levelCount-1].roi  = Array2<unsigned char>(finestSize);
+    pyramid[levelCount-1].base = Array2<Vec<NS,unsigned char>>(finestSize);
 
-  copy(&pyramid[levelCount-1].sourceStyle,sourceStyleData);
-  copy(&pyramid[levelCount-1].sourceGuide,sourceGuideData);
-  copy(&pyramid[levelCount-1].targetGuide,targetGuideData);
+    #pragma omp parallel for schedule(static)
+    for(int xy=0;xy<numel(pyramid[levelCount-1].roi);xy++)
+    {
+      pyramid[levelCount-1].roi[xy] = targetMask[xy]!=0 ? 255 : 0;
+    }
+    copy(&pyramid[levelCount-1].base,(void*)options->baseImageData);
+
+    for (int level=levelCount-2;level>=startLevel;level--)
+    {
+      const V2i levelTargetSize = V2i(pyramid[level].targetWidth,pyramid[level].targetHeight);
+
+      pyramid[level].roi  = Array2<unsigned char>(levelTargetSize);
+      pyramid[level].base = Array2<Vec<NS,unsigned char>>(levelTargetSize);
+
+      downscaleMask2x(pyramid[level].roi,pyramid[level+1].roi);
+      downscale2x(pyramid[level].base,pyramid[level+1].base);
+    }
+  }
 
-  if (targetModulationData)
+  // An incremental run redoes the dirty rectangle of every level grown by a
+  // patch on each side, since the patches overlapping it see the changed
+  // guide, and takes the rest of the level from the state. The region is
+  // scaled with the level, so a change reaches patchSize*2^k pixels of the
+  // finest level at level k from the top.
+  if (incremental)
   {
-    pyramid[levelCount-1].targetModulation = Array2<Vec<NG,unsigned char>>(V2i(pyramid[levelCount-1].targetWidth,pyramid[levelCount-1].targetHeight));
-    copy(&pyramid[levelCount-1].targetModulation,targetModulationData); 
+    const int* rect = options->dirtyRect;
+
+    for (int level=startLevel;level<levelCount;level++)
+    {
+      const V2i levelTargetSize = V2i(pyramid[level].targetWidth,pyramid[level].targetHeight);
+      const float scale = std::pow(2.0f,-float(levelCount-1-level));
+
+      Array2<unsigned char> roi(levelTargetSize);
+      fill(&roi,(unsigned char)0);
+
+      if (rect[2]>0 && rect[3]>0)
+      {
+        const int x0 = clamp(int(std::floor(float(rect[0])*scale))-patchSize,0,levelTargetSize(0));
+        const int y0 = clamp(int(std::floor(float(rect[1])*scale))-patchSize,0,levelTargetSize(1));
+        const int x1 = clamp(int(std::ceil(float(rect[0]+rect[2])*scale))+patchSize,0,levelTargetSize(0));
+        const int y1 = clamp(int(std::ceil(float(rect[1]+rect[3])*scale))+patchSize,0,levelTargetSize(1));
+
+        for(int y=y0;y<y1;y++)
+        for(int x=x0;x<x1;x++)
+        {
+          roi(x,y) = 255;
+        }
+      }
+
+      if (numel(pyramid[level].roi)>0) { krnlClipMask(roi,pyramid[level].roi); }
+      pyramid[level].roi = roi;
+
+      pyramid[level].base = Array2<Vec<NS,unsigned char>>(levelTargetSize);
+      copy(&pyramid[level].base,(void*)state->style[level].data());
+    }
   }
 
+  runStats.pyramidSeconds = float(now()-pyramidStart);
+
   //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+  std::vector<double> numSkippedPixelsPerLevel(levelCount,0.0);
+  std::vector<double> numPixelsPerLevel(levelCount,0.0);
+
   bool inExtraPass = false;
 
-  for (int level=0;level<pyramid.size();level++)
+  for (int level=startLevel;level<pyramid.size();level++)
   {
+    EbsynthLevelStats& levelStats = runStats.levels[std::min(level,EBSYNTH_MAX_PYRAMID_LEVELS-1)];
+    levelStats.targetWidth  = pyramid[level].targetWidth;
+    levelStats.targetHeight = pyramid[level].targetHeight;
+
+    const double levelStart = now();
+    double phaseStart = levelStart;
+
     if (!inExtraPass)
     {
       const V2i levelSourceSize = V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight);
@@ -749,45 +2058,90 @@ void ebsynthCpu(int    numStyleChannels,
 
       pyramid[level].targetStyle  = Array2<Vec<NS,unsigned char>>(levelTargetSize);
       pyramid[level].targetStyle2 = Array2<Vec<NS,unsigned char>>(levelTargetSize);
-      //pyramid[level].mask         = Array2<unsigned char>(levelTargetSize);
-      //pyramid[level].mask2        = Array2<unsigned char>(levelTargetSize);
+      pyramid[level].mask         = Array2<unsigned char>(levelTargetSize);
+      pyramid[level].mask2        = Array2<unsigned char>(levelTargetSize);
       pyramid[level].NNF          = Array2<Vec<2,int>>(levelTargetSize);
       //pyramid[level].NNF2         = Array2<Vec<2,int>>(levelTargetSize);
-      pyramid[level].Omega        = Array2<int>(levelSourceSize);
-      pyramid[level].E            = Array2<float>(levelTargetSize);
-   
-      if (level<levelCount-1)
-      {
-        pyramid[level].sourceStyle  = Array2<Vec<NS,unsigned char>>(levelSourceSize);
-        pyramid[level].sourceGuide  = Array2<Vec<NG,unsigned char>>(levelSourceSize);
-        pyramid[level].targetGuide  = Array2<Vec<NG,unsigned char>>(levelTargetSize);
-
-        resampleCPU(pyramid[level].sourceStyle,pyramid[levelCount-1].sourceStyle);
-        resampleCPU(pyramid[level].sourceGuide,pyramid[levelCount-1].sourceGuide);
-        resampleCPU(pyramid[level].targetGuide,pyramid[levelCount-1].targetGuide);
+      pyramid[level].Omega        = Array2<int>(levelSourceSize);
+      pyramid[level].E            = Array2<float>(levelTargetSize);
+      pyramid[level].EG           = Array2<float>(levelTargetSize);
 
-        if (targetModulationData)
-        {
-          resampleCPU(pyramid[level].targetModulation,pyramid[levelCount-1].targetModulation);
-          pyramid[level].targetModulation = Array2<Vec<NG,unsigned char>>(levelTargetSize);
-        }
+      if (masked)
+      {
+        pyramid[level].targetStyle  = pyramid[level].base;
+        pyramid[level].targetStyle2 = pyramid[level].base;
       }
-
+   
       A2V2i cpu_NNF;
-      if (level>0)
+      // the previous level left its matches relative to the whole source
+      const V2i fullSourceSize = pyramidLevelSize(V2i(sourceWidth,sourceHeight),levelCount,level);
+
+      if (level>startLevel)
       {
         pyramid[level].NNF = nnfUpscale(pyramid[level-1].NNF,
                                         patchSize,
                                         V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
-                                        V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight));
+                                        fullSourceSize);
+        nnfTranslate(pyramid[level].NNF,-pyramid[level].sourceOffset);
         
         pyramid[level-1].NNF = A2V2i();
       }
+      else if (initialNnf!=NULL)
+      {
+        pyramid[level].NNF = nnfDownscale(initialNnf,
+                                          V2i(targetWidth,targetHeight),
+                                          1<<(levelCount-1-level),
+                                          patchSize,
+                                          V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
+                                          fullSourceSize);
+        nnfTranslate(pyramid[level].NNF,-pyramid[level].sourceOffset);
+      }
       else
       {
-        pyramid[level].NNF = nnfInitRandom(V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
-                                           V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight),
-                                           patchSize);
+        if (deterministic)
+        {
+          pyramid[level].NNF = nnfInitRandomSeeded(V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
+                                                   V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight),
+                                                   patchSize,
+                                                   pcgHash(seed));
+        }
+        else
+        {
+          pyramid[level].NNF = nnfInitRandom(V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
+                                             V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight),
+                                             patchSize);
+        }
+      }
+
+      // outside of the region it redoes, an incremental run keeps the
+      // matches of the previous one
+      if (incremental)
+      {
+        const A2V2i& savedNNF = state->nnf[level];
+        const V2i offset = pyramid[level].sourceOffset;
+
+        #pragma omp parallel for schedule(static)
+        for(int xy=0;xy<numel(pyramid[level].NNF);xy++)
+        {
+          if (pyramid[level].roi[xy]==0) { pyramid[level].NNF[xy] = savedNNF[xy]-offset; }
+        }
+      }
+
+      // the matches moved in from the whole source may fall outside of the
+      // part of it the level works on
+      nnfClamp(pyramid[level].NNF,V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight),patchSize);
+      nnfRestrict(pyramid[level].NNF,pyramid[level].sourceMask,pcgHash(seed ^ pcgHash(unsigned(level))));
+
+      if (level==levelCount-1 && (keepColumns>0 || keepRows>0))
+      {
+        const V2i offset = pyramid[level].sourceOffset;
+
+        #pragma omp parallel for schedule(static)
+        for(int y=0;y<pyramid[level].targetHeight;y++)
+        for(int x=0;x<pyramid[level].targetWidth;x++)
+        {
+          if (x<keepColumns || y<keepRows) { pyramid[level].NNF(x,y) = initialNnf[y*targetWidth+x]-offset; }
+        }
       }
 
       /////////////////////////////////////////////////////////////////////////
@@ -818,22 +2172,72 @@ void ebsynthCpu(int    numStyleChannels,
       /////////////////////////////////////////////////////////////////////////
     }
 
+    // mask marks the pixels patchmatch still works on, mask2 the pixels the
+    // vote recomputes; both start as the whole target, or as the region of
+    // interest and its surroundings within the patch radius, and shrink as
+    // pixels converge
+    if (masked)
+    {
+      pyramid[level].region = Array2<unsigned char>(size(pyramid[level].roi));
+      krnlDilateMask(pyramid[level].region,pyramid[level].roi,patchSize);
+      // the kept pixels aren't searched, but the errors of those around the
+      // region are still evaluated for the weighted vote
+      if (level==levelCount-1 && (keepColumns>0 || keepRows>0))
+      {
+        pyramid[level].kept = Array2<unsigned char>(size(pyramid[level].region));
+        fill(&pyramid[level].kept,(unsigned char)0);
+        for(int y=0;y<pyramid[level].targetHeight;y++)
+        for(int x=0;x<pyramid[level].targetWidth;x++)
+        {
+          if ((x<keepColumns || y<keepRows) && pyramid[level].region(x,y)!=0)
+          {
+            pyramid[level].kept(x,y) = 255;
+            pyramid[level].region(x,y) = 0;
+          }
+        }
+        maskBounds(pyramid[level].kept,&pyramid[level].keptMin,&pyramid[level].keptMax);
+      }
+      maskBounds(pyramid[level].region,&pyramid[level].regionMin,&pyramid[level].regionMax);
+      pyramid[level].mask = pyramid[level].region;
+      pyramid[level].mask2 = pyramid[level].roi;
+    }
+    else
+    {
+      pyramid[level].regionMin = V2i(0,0);
+      pyramid[level].regionMax = V2i(pyramid[level].targetWidth,pyramid[level].targetHeight);
+      fill(&pyramid[level].mask,(unsigned char)255);
+      fill(&pyramid[level].mask2,(unsigned char)255);
+    }
+    const V2i& regionMin = pyramid[level].regionMin;
+    const V2i& regionMax = pyramid[level].regionMax;
+
+    // a threshold of zero can never be undercut, so don't bother evaluating
+    const bool useMask = stopThresholdPerLevel[level]>0;
+
+    levelStats.initSeconds += float(now()-phaseStart);
+    phaseStart = now();
+
     ////////////////////////////////////////////////////////////////////////////
     {
       krnlVotePlain(pyramid[level].targetStyle2,
-                    pyramid[level].sourceStyle,
+                    *pyramid[level].sourceStyle,
                     pyramid[level].NNF,
+                    pyramid[level].mask2,
+                    regionMin,
+                    regionMax,
                     patchSize);
 
       std::swap(pyramid[level].targetStyle2,pyramid[level].targetStyle);
     }
     ////////////////////////////////////////////////////////////////////////////
 
-    //Array2<Vec<1,unsigned char>> cpu_mask(V2i(pyramid[level].targetWidth,pyramid[level].targetHeight));
-    //fill(&cpu_mask,Vec<1,unsigned char>(255));
-    //copy(&pyramid[level].mask,cpu_mask);
+    levelStats.voteSeconds += float(now()-phaseStart);
 
-    ////////////////////////////////////////////////////////////////////////////
+    PatchMatchCounters counters;
+
+    // the guide part of E is computed once per pass, the extra 3x3 pass
+    // changes the patch size
+    bool guideErrorValid = false;
 
     for (int voteIter=0;voteIter<numSearchVoteItersPerLevel[level];voteIter++)
     {
@@ -843,47 +2247,98 @@ void ebsynthCpu(int    numStyleChannels,
       Vec<NG,float> guideWeightsVec;
       for(int i=0;i<NG;i++) { guideWeightsVec[i] = guideWeights[i]; }
 
+      const std::vector<float> styleWeightsRow = replicateWeights(styleWeightsVec,patchSize);
+      const std::vector<float> guideWeightsRow = replicateWeights(guideWeightsVec,patchSize);
+
+      // every patchmatch call of the run draws from its own stream
+      const unsigned int patchmatchSeed = pcgHash(seed ^ pcgHash(unsigned(((2*level+(inExtraPass?1:0))<<16)+voteIter)));
+
+      if (useMask || masked) { numSkippedPixelsPerLevel[level] += countMasked(pyramid[level].mask); }
+      numPixelsPerLevel[level] += double(pyramid[level].targetWidth)*double(pyramid[level].targetHeight);
+
+      phaseStart = now();
+
+      // the votes change only the region, so with a mask only it is padded
+      // again after the first pass
+      if (masked && voteIter>0) { padArrayRegion(pyramid[level].targetStylePadded,pyramid[level].targetStyle,apron,regionMin,regionMax); }
+      else                      { padArray(pyramid[level].targetStylePadded,pyramid[level].targetStyle,apron); }
+
       //if (numPatchMatchItersPerLevel[level]>0)
       {
-        /*if (targetModulationData)
+        if (targetModulation)
         {
-          patchmatchGPU(V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
-                        V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight),
-                        pyramid[level].Omega,
-                        patchSize,
-                        PatchSSD_Split_Modulation<NS,NG,unsigned char>(pyramid[level].targetStyle,
-                                                                       pyramid[level].sourceStyle,
-                                                                       pyramid[level].targetGuide,
-                                                                       pyramid[level].sourceGuide,
-                                                                       pyramid[level].targetModulation,
-                                                                       styleWeightsVec,
-                                                                       guideWeightsVec),
-                        uniformityWeight,
-                        numPatchMatchItersPerLevel[level],
-                        numGpuThreadsPerBlock,
-                        pyramid[level].NNF,
-                        pyramid[level].NNF2,
-                        pyramid[level].E,
-                        pyramid[level].mask,
-                        rngStates);
+          const PatchSSD_Split_Modulation<NS,NG,unsigned char> patchError(pyramid[level].targetStylePadded,
+                                                                          *pyramid[level].sourceStyle,
+                                                                          pyramid[level].targetGuide,
+                                                                          *pyramid[level].sourceGuide,
+                                                                          pyramid[level].targetModulation,
+                                                                          apron,
+                                                                          styleWeightsVec,
+                                                                          guideWeightsVec,
+                                                                          styleWeightsRow,
+                                                                          guideWeightsRow);
+          patchmatch(V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
+                     V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight),
+                     patchSize,
+                     patchError,
+                     uniformityWeight,
+                     numPatchMatchItersPerLevel[level],
+                     -1,
+                     schedule,
+                     deterministic,
+                     patchmatchSeed,
+                     pyramid[level].mask,
+                     pyramid[level].region,
+                     regionMin,
+                     regionMax,
+                     pyramid[level].sourceMask,
+                     pyramid[level].NNF,
+                     pyramid[level].E,
+                     pyramid[level].EG,
+                     &guideErrorValid,
+                     pyramid[level].Omega,
+                     &counters);
+          if (numel(pyramid[level].kept)>0)
+          {
+            counters.numPatchEvals += nnfError(pyramid[level].NNF,patchSize,patchError,pyramid[level].kept,pyramid[level].keptMin,pyramid[level].keptMax,pyramid[level].E,pyramid[level].EG,false);
+          }
         }
-        else*/
+        else
         {
+          const PatchSSD_Split<NS,NG,unsigned char> patchError(pyramid[level].targetStylePadded,
+                                                               *pyramid[level].sourceStyle,
+                                                               pyramid[level].targetGuide,
+                                                               *pyramid[level].sourceGuide,
+                                                               apron,
+                                                               styleWeightsVec,
+                                                               guideWeightsVec,
+                                                               styleWeightsRow,
+                                                               guideWeightsRow);
           patchmatch(V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
                      V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight),
                      patchSize,
-                     PatchSSD_Split<NS,NG,unsigned char>(pyramid[level].targetStyle,
-                                                         pyramid[level].sourceStyle,
-                                                         pyramid[level].targetGuide,
-                                                         pyramid[level].sourceGuide,
-                                                         styleWeightsVec,
-                                                         guideWeightsVec),
+                     patchError,
                      uniformityWeight,                             
                      numPatchMatchItersPerLevel[level],
                      -1,
+                     schedule,
+                     deterministic,
+                     patchmatchSeed,
+                     pyramid[level].mask,
+                     pyramid[level].region,
+                     regionMin,
+                     regionMax,
+                     pyramid[level].sourceMask,
                      pyramid[level].NNF,
                      pyramid[level].E,
-                     pyramid[level].Omega);
+                     pyramid[level].EG,
+                     &guideErrorValid,
+                     pyramid[level].Omega,
+                     &counters);
+          if (numel(pyramid[level].kept)>0)
+          {
+            counters.numPatchEvals += nnfError(pyramid[level].NNF,patchSize,patchError,pyramid[level].kept,pyramid[level].keptMin,pyramid[level].keptMax,pyramid[level].E,pyramid[level].EG,false);
+          }
         }
       }
       /*
@@ -917,67 +2372,133 @@ void ebsynthCpu(int    numStyleChannels,
         checkCudaError( cudaDeviceSynchronize() );        
       }
       */
+
+      levelStats.patchmatchSeconds += float(now()-phaseStart);
+
+      if (stats!=NULL && levelStats.numIterations<EBSYNTH_MAX_STATS_ITERS)
+      {
+        levelStats.energy[levelStats.numIterations] = meanEnergy(pyramid[level].E,pyramid[level].roi);
+      }
+      levelStats.numIterations++;
+
+      phaseStart = now();
+
       {
-        //if      (voteMode==EBSYNTH_VOTEMODE_PLAIN)
+        // pixels the vote skips keep their current color
+        if (useMask) { krnlCopyMasked(pyramid[level].targetStyle2,pyramid[level].targetStyle,pyramid[level].mask2,regionMin,regionMax); }
+
+        if (voteMode==EBSYNTH_VOTEMODE_WEIGHTED)
+        {
+          krnlVoteWeighted(pyramid[level].targetStyle2,
+                           *pyramid[level].sourceStyle,
+                           pyramid[level].NNF,
+                           pyramid[level].E,
+                           pyramid[level].mask2,
+                           regionMin,
+                           regionMax,
+                           patchSize);
+        }
+        else
         {
           krnlVotePlain(pyramid[level].targetStyle2,
-                        pyramid[level].sourceStyle,
+                        *pyramid[level].sourceStyle,
                         pyramid[level].NNF,
+                        pyramid[level].mask2,
+                        regionMin,
+                        regionMax,
                         patchSize);
         }
-        /*else if (voteMode==EBSYNTH_VOTEMODE_WEIGHTED)
-        {
-          krnlVoteWeighted<<<numBlocks,threadsPerBlock>>>(pyramid[level].targetStyle2,
-                                                          pyramid[level].sourceStyle,
-                                                          pyramid[level].NNF,
-                                                          pyramid[level].E,
-                                                          patchSize);
-        }*/
 
         std::swap(pyramid[level].targetStyle2,pyramid[level].targetStyle);
 
-        /*
-        if (voteIter<numSearchVoteItersPerLevel[level]-1)
+        levelStats.voteSeconds += float(now()-phaseStart);
+        phaseStart = now();
+
+        if (useMask && voteIter<numSearchVoteItersPerLevel[level]-1)
         {
-          krnlEvalMask<<<numBlocks,threadsPerBlock>>>(pyramid[level].mask,
-                                                      pyramid[level].targetStyle,
-                                                      pyramid[level].targetStyle2,
-                                                      stopThresholdPerLevel[level]);
-          checkCudaError( cudaDeviceSynchronize() );
-
-          krnlDilateMask<<<numBlocks,threadsPerBlock>>>(pyramid[level].mask2,
-                                                        pyramid[level].mask,
-                                                        patchSize);
-          std::swap(pyramid[level].mask2,pyramid[level].mask);
-          checkCudaError( cudaDeviceSynchronize() );
+          krnlEvalMask(pyramid[level].mask2,
+                       pyramid[level].targetStyle,
+                       pyramid[level].targetStyle2,
+                       stopThresholdPerLevel[level]);
+
+          // A pixel is searched again when anything under its patch changed.
+          // Its vote depends on the matches of every pixel under its patch,
+          // so the vote mask is the search mask dilated once more.
+          krnlDilateMask(pyramid[level].mask,
+                         pyramid[level].mask2,
+                         patchSize);
+
+          krnlDilateMask(pyramid[level].mask2,
+                         pyramid[level].mask,
+                         patchSize);
+
+          if (masked)
+          {
+            krnlClipMask(pyramid[level].mask,pyramid[level].region);
+            krnlClipMask(pyramid[level].mask2,pyramid[level].roi);
+          }
         }
-        */
+
+        levelStats.maskSeconds += float(now()-phaseStart);
       }
     }
 
+    levelStats.errorSeconds            += float(counters.errorSeconds);
+    levelStats.patchmatchSeconds       -= float(counters.errorSeconds);
+    levelStats.numPatchEvals           += double(counters.numPatchEvals);
+    levelStats.numEarlyTerminations    += double(counters.numEarlyTerminations);
+    levelStats.numAcceptedPropagation  += double(counters.numAcceptedPropagation);
+    levelStats.numAcceptedRandomSearch += double(counters.numAcceptedRandomSearch);
+
+    // the level is done, its matches go on relative to the whole source
+    if ((level<levelCount-1) || (extraPass3x3==0) || (extraPass3x3!=0 && inExtraPass))
+    {
+      nnfTranslate(pyramid[level].NNF,pyramid[level].sourceOffset);
+    }
+
     if (level==levelCount-1 && (extraPass3x3==0 || (extraPass3x3!=0 && inExtraPass)))
     {      
+      const double copyStart = now();
       if (outputNnfData!=NULL) { copy(&outputNnfData,pyramid[level].NNF); }
-      copy(&outputImageData,pyramid[level].targetStyle);
+      ebsynthScatterImageCpu(outputImage,pyramid[level].targetWidth,pyramid[level].targetHeight,
+                             (const unsigned char*)pyramid[level].targetStyle.data(),
+                             int(sizeof(Vec<NS,unsigned char>)),pyramid[level].targetWidth*int(sizeof(Vec<NS,unsigned char>)));
+      runStats.copySeconds += float(now()-copyStart);
     }
 
     if ((level<levelCount-1) ||
         (extraPass3x3==0) ||
         (extraPass3x3!=0 && inExtraPass))
     {
-      pyramid[level].sourceStyle = Array2<Vec<NS,unsigned char>>();
-      pyramid[level].sourceGuide = Array2<Vec<NG,unsigned char>>();
+      if (state!=NULL)
+      {
+        const unsigned char* style = (const unsigned char*)pyramid[level].targetStyle.data();
+        state->nnf[level] = pyramid[level].NNF;
+        state->style[level].assign(style,style+numel(pyramid[level].targetStyle)*sizeof(Vec<NS,unsigned char>));
+      }
+
       pyramid[level].targetGuide = Array2<Vec<NG,unsigned char>>();
       pyramid[level].targetStyle = Array2<Vec<NS,unsigned char>>();
       pyramid[level].targetStyle2 = Array2<Vec<NS,unsigned char>>();
-      //pyramid[level].mask = Array2<unsigned char>();
-      //pyramid[level].mask2 = Array2<unsigned char>();
+      pyramid[level].targetStylePadded = Array2<Vec<NS,unsigned char>>();
+      pyramid[level].mask = Array2<unsigned char>();
+      pyramid[level].mask2 = Array2<unsigned char>();
       //pyramid[level].NNF2 = Array2<Vec<2,int>>();
       pyramid[level].Omega = Array2<int>();
       pyramid[level].E = Array2<float>();
-      if (targetModulationData) { pyramid[level].targetModulation = Array2<Vec<NG,unsigned char>>(); }
+      pyramid[level].EG = Array2<float>();
+      pyramid[level].roi = Array2<unsigned char>();
+      pyramid[level].region = Array2<unsigned char>();
+      pyramid[level].kept = Array2<unsigned char>();
+      pyramid[level].base = Array2<Vec<NS,unsigned char>>();
+      pyramid[level].sourceStyleCrop = Array2<Vec<NS,unsigned char>>();
+      pyramid[level].sourceGuideCrop = Array2<Vec<NG,unsigned char>>();
+      pyramid[level].sourceMask = Array2<unsigned char>();
+      if (targetModulation) { pyramid[level].targetModulation = Array2<Vec<NG,unsigned char>>(); }
     }
 
+    levelStats.seconds += float(now()-levelStart);
+
     if (level==levelCount-1 && (extraPass3x3!=0) && !inExtraPass)
     {
       inExtraPass = true;
@@ -988,6 +2509,737 @@ void ebsynthCpu(int    numStyleChannels,
   }
 
   pyramid[levelCount-1].NNF = Array2<Vec<2,int>>();
+
+  if (stats!=NULL)
+  {
+    runStats.numPyramidLevels = levelCount;
+    for(int level=0;level<std::min(levelCount,EBSYNTH_MAX_PYRAMID_LEVELS);level++)
+    {
+      runStats.skippedPixelFraction[level] = numPixelsPerLevel[level]>0 ? float(numSkippedPixelsPerLevel[level]/numPixelsPerLevel[level]) : 0.0f;
+    }
+    runStats.totalSeconds = float(now()-runStart);
+
+    *stats = runStats;
+  }
+}
+
+// the same image starting at pixel (x,y)
+static EbsynthImage cropImage(const EbsynthImage* image,const int x,const int y)
+{
+  EbsynthImage crop = *image;
+  for(int i=0;i<crop.numPlanes;i++)
+  {
+    EbsynthPlane& plane = crop.planes[i];
+    plane.data = (unsigned char*)plane.data+std::ptrdiff_t(x)*plane.pixelStride+std::ptrdiff_t(y)*plane.rowPitch;
+  }
+  return crop;
+}
+
+// Adds the stats of one tile to those of the whole tiled run. Level l of the
+// tile is level l+levelOffset of the run, and the energies and the skipped
+// fractions are averaged with the tile areas as weights.
+static void addTileStats(EbsynthStats* total,const EbsynthStats& tile,const int levelOffset,const float weight)
+{
+  for(int l=0;l<std::min(tile.numPyramidLevels,EBSYNTH_MAX_PYRAMID_LEVELS-levelOffset);l++)
+  {
+    EbsynthLevelStats& dst = total->levels[l+levelOffset];
+    const EbsynthLevelStats& src = tile.levels[l];
+
+    dst.seconds                 += src.seconds;
+    dst.initSeconds             += src.initSeconds;
+    dst.errorSeconds            += src.errorSeconds;
+    dst.patchmatchSeconds       += src.patchmatchSeconds;
+    dst.voteSeconds             += src.voteSeconds;
+    dst.maskSeconds             += src.maskSeconds;
+    dst.numPatchEvals           += src.numPatchEvals;
+    dst.numEarlyTerminations    += src.numEarlyTerminations;
+    dst.numAcceptedPropagation  += src.numAcceptedPropagation;
+    dst.numAcceptedRandomSearch += src.numAcceptedRandomSearch;
+    dst.numIterations = std::max(dst.numIterations,src.numIterations);
+    for(int i=0;i<std::min(src.numIterations,EBSYNTH_MAX_STATS_ITERS);i++) { dst.energy[i] += weight*src.energy[i]; }
+
+    total->skippedPixelFraction[l+levelOffset] += weight*tile.skippedPixelFraction[l];
+  }
+  total->pyramidSeconds += tile.pyramidSeconds;
+  total->copySeconds += tile.copySeconds;
+}
+
+// The tiles of a tiled run overlap by a few patches, so that the patches at
+// the edge of a tile are matched against what the tiles before it left.
+static int tileOverlap(const int patchSize)
+{
+  return std::max(4*patchSize,16);
+}
+
+// Side of the square target tiles whose working set fits the memory budget,
+// or 0 when the whole target does. When even the smallest tiles don't fit,
+// e.g. because the source pyramid alone takes more than the budget, the
+// smallest tiles are used anyway and out_overBudget is set. The source pyramid and the source-sized
+// occupancy map are needed by every tile, so they come off the budget first,
+// and the rest is divided by what ebsynthCpu keeps per target pixel: three
+// style buffers, two masks, the NNF (and a quarter of it while upscaling),
+// the two error maps, the padded guide pyramid and the pyramids of the target
+// mask and the base image, plus the tile's output, its three NNF buffers and
+// its crops of the mask and the base image here. The tiles have a mask and a
+// base image even when the run doesn't, for their overlap with the others.
+template<int NS,int NG>
+static int tileSizeForBudget(const SourcePyramidCpu<NS,NG>& source,
+                             const int  targetWidth,
+                             const int  targetHeight,
+                             const bool modulation,
+                             const bool masked,
+                             const int  memoryBudgetMB,
+                             const int  overlap,
+                             bool*      out_overBudget)
+{
+  double sourceBytes = 0;
+  for(int k=0;k<int(source.style.size());k++)
+  {
+    sourceBytes += double(source.style[k].numel())*sizeof(Vec<NS,unsigned char>)+
+                   double(source.guide[k].numel())*sizeof(Vec<NG,unsigned char>);
+  }
+  sourceBytes += 2.0*double(source.style[0].numel())*sizeof(int);
+
+  const double bytesPerPixel = 4*NS+2+
+                               (1.25+3.0)*sizeof(Vec<2,int>)+
+                               2*sizeof(float)+
+                               (4.0/3.0)*NG*(modulation ? 2 : 1)+
+                               (masked ? (4.0/3.0+1.0)*(NS+1) : 0.0);
+
+  const double targetBytes = double(memoryBudgetMB)*1024.0*1024.0-sourceBytes;
+  *out_overBudget = false;
+  if (targetBytes>=bytesPerPixel*double(targetWidth)*double(targetHeight)) { return 0; }
+
+  const double tileBytesPerPixel = bytesPerPixel+(masked ? 0.0 : (4.0/3.0+1.0)*(NS+1));
+  const int fittingTileSize = int(std::sqrt(std::max(targetBytes,0.0)/tileBytesPerPixel));
+  *out_overBudget = fittingTileSize<4*overlap;
+  const int tileSize = std::max(fittingTileSize,4*overlap);
+
+  return (tileSize>=targetWidth && tileSize>=targetHeight) ? 0 : tileSize;
+}
+
+// Splits a target side into n spans of the same length that overlap by
+// overlap pixels and are at most tileSize long (but for rounding).
+static void tileSpans(const int size,const int tileSize,const int overlap,int* out_n,int* out_length)
+{
+  const int n = size<=tileSize ? 1 : (size-overlap+(tileSize-overlap)-1)/(tileSize-overlap);
+  *out_n = n;
+  *out_length = (size+(n-1)*overlap+n-1)/n;
+}
+
+// Synthesizes the target in overlapping tiles, one after another in scan-line
+// order, so that the target-sized arrays only ever exist for a single tile.
+// The tiles read their guides right from the caller's images. The overlap
+// with the tiles above and to the left of a tile is already done: it is left
+// out of the tile's target mask, with what those tiles wrote to the output
+// as the base image, and at the finest level it keeps their matches too, so
+// the patches reaching into it from the rest of the tile vote the same as
+// they did and propagate their matches on. The NNF of the overlap also seeds
+// the coarsest level of the tile there. The coarsest levels are left out
+// when a tile is too small for them.
+template<int NS,int NG>
+void ebsynthCpuTiled(const SourcePyramidCpu<NS,NG>& source,
+                     int    tileSize,
+                     int    targetWidth,
+                     int    targetHeight,
+                     const EbsynthImage* targetGuide,
+                     const EbsynthImage* targetModulation,
+                     float* styleWeights,
+                     float* guideWeights,
+                     float  uniformityWeight,
+                     int    patchSize,
+                     int    voteMode,
+                     int    numPyramidLevels,
+                     int*   numSearchVoteItersPerLevel,
+                     int*   numPatchMatchItersPerLevel,
+                     int*   stopThresholdPerLevel,
+                     int    extraPass3x3,
+                     void*  outputNnfData,
+                     const EbsynthImage* outputImage,
+                     const EbsynthOptions* options,
+                     EbsynthStats* stats)
+{
+  if (numPyramidLevels<1 || numPyramidLevels>int(source.style.size()))
+  {
+    fprintf(stderr,"error: %d pyramid levels requested, the source allows 1 to %d\n",numPyramidLevels,int(source.style.size()));
+    return;
+  }
+
+  const double runStart = now();
+
+  const int overlap = tileOverlap(patchSize);
+  const V2i sourceSize = V2i(source.style[0].width(),source.style[0].height());
+  const unsigned int seed = options!=NULL ? options->seed : 0;
+  const V2i* initialNnf = options!=NULL ? (const V2i*)options->initialNnfData : NULL;
+  const unsigned char* targetMask = options!=NULL && options->baseImageData!=NULL ? (const unsigned char*)options->targetMaskData : NULL;
+  const unsigned char* baseImage = options!=NULL ? (const unsigned char*)options->baseImageData : NULL;
+  V2i* outputNnf = (V2i*)outputNnfData;
+
+  int numTilesX,numTilesY,tileWidth,tileHeight;
+  tileSpans(targetWidth,tileSize,overlap,&numTilesX,&tileWidth);
+  tileSpans(targetHeight,tileSize,overlap,&numTilesY,&tileHeight);
+
+  EbsynthStats runStats;
+  memset(&runStats,0,sizeof(runStats));
+
+  // the bottom rows of the NNFs of the previous tile row, and of this one
+  std::vector<V2i> stripAbove(targetWidth*overlap);
+  std::vector<V2i> stripBelow(targetWidth*overlap);
+
+  std::vector<V2i> tileNnf;
+  std::vector<V2i> prevTileNnf;
+  std::vector<unsigned char> tileOutput;
+  std::vector<unsigned char> tileMask;
+  std::vector<unsigned char> tileBase;
+  int prevX0 = 0;
+  int prevWidth = 0;
+
+  for(int ty=0;ty<numTilesY;ty++)
+  {
+    for(int tx=0;tx<numTilesX;tx++)
+    {
+      const int x0 = tx*(tileWidth-overlap);
+      const int y0 = ty*(tileHeight-overlap);
+      const int width  = std::min(tileWidth,targetWidth-x0);
+      const int height = std::min(tileHeight,targetHeight-y0);
+
+      int numLevels = numPyramidLevels;
+      while (numLevels>1 && min(pyramidLevelSize(V2i(width,height),numLevels,0))<2*patchSize+1) { numLevels--; }
+      const int levelOffset = numPyramidLevels-numLevels;
+
+      A2V2i seedNnf = nnfInitRandomSeeded(V2i(width,height),sourceSize,patchSize,pcgHash(seed ^ pcgHash(unsigned(ty*numTilesX+tx))));
+      for(int y=0;y<height;y++)
+      for(int x=0;x<width;x++)
+      {
+        if      (tx>0 && x<overlap)   { seedNnf(x,y) = prevTileNnf[y*prevWidth+(x0+x-prevX0)]; }
+        else if (ty>0 && y<overlap)   { seedNnf(x,y) = stripAbove[y*targetWidth+x0+x]; }
+        else if (initialNnf!=NULL)    { seedNnf(x,y) = initialNnf[std::ptrdiff_t(y0+y)*targetWidth+x0+x]; }
+      }
+
+      EbsynthOptions tileOptions;
+      if (options!=NULL) { tileOptions = *options; } else { memset(&tileOptions,0,sizeof(tileOptions)); }
+      tileOptions.initialNnfData = seedNnf.data();
+      tileOptions.startPyramidLevel = std::max(tileOptions.startPyramidLevel-levelOffset,0);
+      tileOptions.memoryBudgetMB = 0;
+      tileOptions.state = NULL;
+      tileOptions.incremental = 0;
+
+      const int overlapX = tx>0 ? overlap : 0;
+      const int overlapY = ty>0 ? overlap : 0;
+      const EbsynthImage tileOutputDst = cropImage(outputImage,x0,y0);
+
+      if (targetMask!=NULL || overlapX>0 || overlapY>0)
+      {
+        tileMask.resize(width*height);
+        tileBase.resize(width*height*NS);
+        ebsynthGatherImageCpu(&tileOutputDst,width,height,tileBase.data(),NS,width*NS);
+        for(int y=0;y<height;y++)
+        {
+          if (targetMask!=NULL) { memcpy(&tileMask[y*width],&targetMask[std::ptrdiff_t(y0+y)*targetWidth+x0],width); }
+          else                  { memset(&tileMask[y*width],255,width); }
+
+          for(int x=0;x<width;x++)
+          {
+            if (x<overlapX || y<overlapY) { tileMask[y*width+x] = 0; }
+            else if (targetMask!=NULL)    { memcpy(&tileBase[(y*width+x)*NS],&baseImage[(std::ptrdiff_t(y0+y)*targetWidth+x0+x)*NS],NS); }
+          }
+        }
+        tileOptions.targetMaskData = tileMask.data();
+        tileOptions.baseImageData = tileBase.data();
+      }
+
+      const EbsynthImage tileGuide = cropImage(targetGuide,x0,y0);
+      const EbsynthImage tileModulation = targetModulation!=NULL ? cropImage(targetModulation,x0,y0) : EbsynthImage();
+
+      tileOutput.resize(width*height*NS);
+      const EbsynthImage tileOutputImage = packedImage(tileOutput.data(),width,NS);
+      tileNnf.resize(width*height);
+
+      EbsynthStats tileStats;
+      ebsynthCpu(source,
+                 width,
+                 height,
+                 &tileGuide,
+                 targetModulation!=NULL ? &tileModulation : NULL,
+                 styleWeights,
+                 guideWeights,
+                 uniformityWeight,
+                 patchSize,
+                 voteMode,
+                 numLevels,
+                 numSearchVoteItersPerLevel+levelOffset,
+                 numPatchMatchItersPerLevel+levelOffset,
+                 stopThresholdPerLevel+levelOffset,
+                 extraPass3x3,
+                 tileNnf.data(),
+                 &tileOutputImage,
+                 &tileOptions,
+                 stats!=NULL ? &tileStats : NULL,
+                 overlapX,
+                 overlapY);
+
+      const double copyStart = now();
+      // outside of its mask the tile's output is its base image, so the
+      // overlap is written back unchanged
+      ebsynthScatterImageCpu(&tileOutputDst,width,height,tileOutput.data(),NS,width*NS);
+      if (outputNnf!=NULL)
+      {
+        for(int y=0;y<height;y++) { memcpy(&outputNnf[std::ptrdiff_t(y0+y)*targetWidth+x0],&tileNnf[y*width],width*sizeof(V2i)); }
+      }
+      if (ty<numTilesY-1)
+      {
+        for(int y=0;y<overlap;y++) { memcpy(&stripBelow[y*targetWidth+x0],&tileNnf[(height-overlap+y)*width],width*sizeof(V2i)); }
+      }
+      runStats.copySeconds += float(now()-copyStart);
+
+      if (stats!=NULL) { addTileStats(&runStats,tileStats,levelOffset,float(double(width*height)/(double(numTilesX*tileWidth)*double(numTilesY*tileHeight)))); }
+
+      std::swap(tileNnf,prevTileNnf);
+      prevX0 = x0;
+      prevWidth = width;
+    }
+
+    std::swap(stripAbove,stripBelow);
+  }
+
+  if (stats!=NULL)
+  {
+    runStats.numPyramidLevels = numPyramidLevels;
+    for(int level=0;level<std::min(numPyramidLevels,EBSYNTH_MAX_PYRAMID_LEVELS);level++)
+    {
+      const V2i levelTargetSize = pyramidLevelSize(V2i(targetWidth,targetHeight),numPyramidLevels,level);
+      runStats.levels[level].targetWidth  = levelTargetSize(0);
+      runStats.levels[level].targetHeight = levelTargetSize(1);
+    }
+    runStats.totalSeconds = float(now()-runStart);
+
+    *stats = runStats;
+  }
+}
+
+template<int NS,int NG>
+void SourcePyramidCpu<NS,NG>::run(int    targetWidth,
+                                  int    targetHeight,
+                                  const EbsynthImage* targetGuide,
+                                  const EbsynthImage* targetModulation,
+                                  float* styleWeights,
+                                  float* guideWeights,
+                                  float  uniformityWeight,
+                                  int    patchSize,
+                                  int    voteMode,
+                                  int    numPyramidLevels,
+                                  int*   numSearchVoteItersPerLevel,
+                                  int*   numPatchMatchItersPerLevel,
+                                  int*   stopThresholdPerLevel,
+                                  int    extraPass3x3,
+                                  void*  outputNnfData,
+                                  const EbsynthImage* outputImage,
+                                  const EbsynthOptions* options,
+                                  EbsynthStats* stats) const
+{
+  const int memoryBudgetMB = options!=NULL ? options->memoryBudgetMB : 0;
+  const bool masked = options!=NULL && options->targetMaskData!=NULL && options->baseImageData!=NULL;
+  bool overBudget = false;
+  const int tileSize = memoryBudgetMB>0 ? tileSizeForBudget(*this,targetWidth,targetHeight,targetModulation!=NULL,masked,memoryBudgetMB,tileOverlap(patchSize),&overBudget) : 0;
+  if (overBudget) { fprintf(stderr,"warning: the run doesn't fit the memory budget of %d MB even in the smallest tiles\n",memoryBudgetMB); }
+
+  if (tileSize>0)
+  {
+    ebsynthCpuTiled(*this,
+                    tileSize,
+                    targetWidth,
+                    targetHeight,
+                    targetGuide,
+                    targetModulation,
+                    styleWeights,
+                    guideWeights,
+                    uniformityWeight,
+                    patchSize,
+                    voteMode,
+                    numPyramidLevels,
+                    numSearchVoteItersPerLevel,
+                    numPatchMatchItersPerLevel,
+                    stopThresholdPerLevel,
+                    extraPass3x3,
+                    outputNnfData,
+                    outputImage,
+                    options,
+                    stats);
+    if (stats!=NULL) { stats->memoryBudgetExceeded = overBudget ? 1 : 0; }
+    return;
+  }
+
+  ebsynthCpu(*this,
+             targetWidth,
+             targetHeight,
+             targetGuide,
+             targetModulation,
+             styleWeights,
+             guideWeights,
+             uniformityWeight,
+             patchSize,
+             voteMode,
+             numPyramidLevels,
+             numSearchVoteItersPerLevel,
+             numPatchMatchItersPerLevel,
+             stopThresholdPerLevel,
+             extraPass3x3,
+             outputNnfData,
+             outputImage,
+             options,
+             stats);
+  if (stats!=NULL) { stats->memoryBudgetExceeded = overBudget ? 1 : 0; }
+}
+
+template<int NS,int NG>
+EbsynthSourceCpu* createSourceCpu(int sourceWidth,int sourceHeight,const EbsynthImage* sourceStyle,const EbsynthImage* sourceGuide)
+{
+  return new SourcePyramidCpu<NS,NG>(sourceWidth,sourceHeight,sourceStyle,sourceGuide);
+}
+
+static EbsynthSourceCpu* createSourceStridedCpu(int   numStyleChannels,
+                                                int   numGuideChannels,
+                                                int   sourceWidth,
+                                                int   sourceHeight,
+                                                const EbsynthImage* sourceStyle,
+                                                const EbsynthImage* sourceGuide)
+{
+  EbsynthSourceCpu* (*const dispatchCreateSource[EBSYNTH_MAX_GUIDE_CHANNELS][EBSYNTH_MAX_STYLE_CHANNELS])(int,int,const EbsynthImage*,const EbsynthImage*) =
+  {
+    { createSourceCpu<1, 1>, createSourceCpu<2, 1>, createSourceCpu<3, 1>, createSourceCpu<4, 1>, createSourceCpu<5, 1>, createSourceCpu<6, 1>, createSourceCpu<7, 1>, createSourceCpu<8, 1> },
+    { createSourceCpu<1, 2>, createSourceCpu<2, 2>, createSourceCpu<3, 2>, createSourceCpu<4, 2>, createSourceCpu<5, 2>, createSourceCpu<6, 2>, createSourceCpu<7, 2>, createSourceCpu<8, 2> },
+    { createSourceCpu<1, 3>, createSourceCpu<2, 3>, createSourceCpu<3, 3>, createSourceCpu<4, 3>, createSourceCpu<5, 3>, createSourceCpu<6, 3>, createSourceCpu<7, 3>, createSourceCpu<8, 3> },
+    { createSourceCpu<1, 4>, createSourceCpu<2, 4>, createSourceCpu<3, 4>, createSourceCpu<4, 4>, createSourceCpu<5, 4>, createSourceCpu<6, 4>, createSourceCpu<7, 4>, createSourceCpu<8, 4> },
+    { createSourceCpu<1, 5>, createSourceCpu<2, 5>, createSourceCpu<3, 5>, createSourceCpu<4, 5>, createSourceCpu<5, 5>, createSourceCpu<6, 5>, createSourceCpu<7, 5>, createSourceCpu<8, 5> },
+    { createSourceCpu<1, 6>, createSourceCpu<2, 6>, createSourceCpu<3, 6>, createSourceCpu<4, 6>, createSourceCpu<5, 6>, createSourceCpu<6, 6>, createSourceCpu<7, 6>, createSourceCpu<8, 6> },
+    { createSourceCpu<1, 7>, createSourceCpu<2, 7>, createSourceCpu<3, 7>, createSourceCpu<4, 7>, createSourceCpu<5, 7>, createSourceCpu<6, 7>, createSourceCpu<7, 7>, createSourceCpu<8, 7> },
+    { createSourceCpu<1, 8>, createSourceCpu<2, 8>, createSourceCpu<3, 8>, createSourceCpu<4, 8>, createSourceCpu<5, 8>, createSourceCpu<6, 8>, createSourceCpu<7, 8>, createSourceCpu<8, 8> },
+    { createSourceCpu<1, 9>, createSourceCpu<2, 9>, createSourceCpu<3, 9>, createSourceCpu<4, 9>, createSourceCpu<5, 9>, createSourceCpu<6, 9>, createSourceCpu<7, 9>, createSourceCpu<8, 9> },
+    { createSourceCpu<1,10>, createSourceCpu<2,10>, createSourceCpu<3,10>, createSourceCpu<4,10>, createSourceCpu<5,10>, createSourceCpu<6,10>, createSourceCpu<7,10>, createSourceCpu<8,10> },
+    { createSourceCpu<1,11>, createSourceCpu<2,11>, createSourceCpu<3,11>, createSourceCpu<4,11>, createSourceCpu<5,11>, createSourceCpu<6,11>, createSourceCpu<7,11>, createSourceCpu<8,11> },
+    { createSourceCpu<1,12>, createSourceCpu<2,12>, createSourceCpu<3,12>, createSourceCpu<4,12>, createSourceCpu<5,12>, createSourceCpu<6,12>, createSourceCpu<7,12>, createSourceCpu<8,12> },
+    { createSourceCpu<1,13>, createSourceCpu<2,13>, createSourceCpu<3,13>, createSourceCpu<4,13>, createSourceCpu<5,13>, createSourceCpu<6,13>, createSourceCpu<7,13>, createSourceCpu<8,13> },
+    { createSourceCpu<1,14>, createSourceCpu<2,14>, createSourceCpu<3,14>, createSourceCpu<4,14>, createSourceCpu<5,14>, createSourceCpu<6,14>, createSourceCpu<7,14>, createSourceCpu<8,14> },
+    { createSourceCpu<1,15>, createSourceCpu<2,15>, createSourceCpu<3,15>, createSourceCpu<4,15>, createSourceCpu<5,15>, createSourceCpu<6,15>, createSourceCpu<7,15>, createSourceCpu<8,15> },
+    { createSourceCpu<1,16>, createSourceCpu<2,16>, createSourceCpu<3,16>, createSourceCpu<4,16>, createSourceCpu<5,16>, createSourceCpu<6,16>, createSourceCpu<7,16>, createSourceCpu<8,16> },
+    { createSourceCpu<1,17>, createSourceCpu<2,17>, createSourceCpu<3,17>, createSourceCpu<4,17>, createSourceCpu<5,17>, createSourceCpu<6,17>, createSourceCpu<7,17>, createSourceCpu<8,17> },
+    { createSourceCpu<1,18>, createSourceCpu<2,18>, createSourceCpu<3,18>, createSourceCpu<4,18>, createSourceCpu<5,18>, createSourceCpu<6,18>, createSourceCpu<7,18>, createSourceCpu<8,18> },
+    { createSourceCpu<1,19>, createSourceCpu<2,19>, createSourceCpu<3,19>, createSourceCpu<4,19>, createSourceCpu<5,19>, createSourceCpu<6,19>, createSourceCpu<7,19>, createSourceCpu<8,19> },
+    { createSourceCpu<1,20>, createSourceCpu<2,20>, createSourceCpu<3,20>, createSourceCpu<4,20>, createSourceCpu<5,20>, createSourceCpu<6,20>, createSourceCpu<7,20>, createSourceCpu<8,20> },
+    { createSourceCpu<1,21>, createSourceCpu<2,21>, createSourceCpu<3,21>, createSourceCpu<4,21>, createSourceCpu<5,21>, createSourceCpu<6,21>, createSourceCpu<7,21>, createSourceCpu<8,21> },
+    { createSourceCpu<1,22>, createSourceCpu<2,22>, createSourceCpu<3,22>, createSourceCpu<4,22>, createSourceCpu<5,22>, createSourceCpu<6,22>, createSourceCpu<7,22>, createSourceCpu<8,22> },
+    { createSourceCpu<1,23>, createSourceCpu<2,23>, createSourceCpu<3,23>, createSourceCpu<4,23>, createSourceCpu<5,23>, createSourceCpu<6,23>, createSourceCpu<7,23>, createSourceCpu<8,23> },
+    { createSourceCpu<1,24>, createSourceCpu<2,24>, createSourceCpu<3,24>, createSourceCpu<4,24>, createSourceCpu<5,24>, createSourceCpu<6,24>, createSourceCpu<7,24>, createSourceCpu<8,24> }
+  };
+
+  if (numStyleChannels>=1 && numStyleChannels<=EBSYNTH_MAX_STYLE_CHANNELS &&
+      numGuideChannels>=1 && numGuideChannels<=EBSYNTH_MAX_GUIDE_CHANNELS)
+  {
+    return dispatchCreateSource[numGuideChannels-1][numStyleChannels-1](sourceWidth,sourceHeight,sourceStyle,sourceGuide);
+  }
+
+  return NULL;
+}
+
+EbsynthSourceCpu* ebsynthCreateSourceCpu(int   numStyleChannels,
+                                         int   numGuideChannels,
+                                         int   sourceWidth,
+                                         int   sourceHeight,
+                                         void* sourceStyleData,
+                                         void* sourceGuideData)
+{
+  const EbsynthImage sourceStyle = packedImage(sourceStyleData,sourceWidth,numStyleChannels);
+  const EbsynthImage sourceGuide = packedImage(sourceGuideData,sourceWidth,numGuideChannels);
+
+  return createSourceStridedCpu(numStyleChannels,numGuideChannels,sourceWidth,sourceHeight,&sourceStyle,&sourceGuide);
+}
+
+void ebsynthDestroySourceCpu(EbsynthSourceCpu* source)
+{
+  delete source;
+}
+
+void ebsynthRunSourceCpu(const EbsynthSourceCpu* source,
+                         int    targetWidth,
+                         int    targetHeight,
+                         void*  targetGuideData,
+                         void*  targetModulationData,
+                         float* styleWeights,
+                         float* guideWeights,
+                         float  uniformityWeight,
+                         int    patchSize,
+                         int    voteMode,
+                         int    numPyramidLevels,
+                         int*   numSearchVoteItersPerLevel,
+                         int*   numPatchMatchItersPerLevel,
+                         int*   stopThresholdPerLevel,
+                         int    extraPass3x3,
+                         void*  outputNnfData,
+                         void*  outputImageData,
+                         const EbsynthOptions* options,
+                         EbsynthStats* stats)
+{
+  if (source!=NULL)
+  {
+    const int numStyleChannels = source->numStyleChannels();
+    const int numGuideChannels = source->numGuideChannels();
+
+    const EbsynthImage targetGuide = packedImage(targetGuideData,targetWidth,numGuideChannels);
+    const EbsynthImage targetModulation = packedImage(targetModulationData,targetWidth,numGuideChannels);
+    const EbsynthImage outputImage = packedImage(outputImageData,targetWidth,numStyleChannels);
+
+    source->run(targetWidth,
+                targetHeight,
+                &targetGuide,
+                targetModulationData!=NULL ? &targetModulation : NULL,
+                styleWeights,
+                guideWeights,
+                uniformityWeight,
+                patchSize,
+                voteMode,
+                numPyramidLevels,
+                numSearchVoteItersPerLevel,
+                numPatchMatchItersPerLevel,
+                stopThresholdPerLevel,
+                extraPass3x3,
+                outputNnfData,
+                &outputImage,
+                options,
+                stats);
+  }
+}
+
+static int maxThreads()
+{
+#ifdef __APPLE__
+  return 8;
+#else
+  return omp_get_max_threads();
+#endif
+}
+
+// Runs up to maxConcurrentTasks tasks at a time and splits the threads
+// evenly between them, each task uses its share for its own parallel loops.
+// With GCD (Apple) there is no thread count to split: the tasks' own
+// dispatch_apply calls share the system pool, so only the number of tasks
+// running at a time is limited.
+template<typename FUNC>
+void runConcurrently(const int numTasks,const int maxConcurrentTasks,FUNC task)
+{
+  if (numTasks<1) { return; }
+
+#ifdef __APPLE__
+  dispatch_queue_t gcdq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH,0);
+  dispatch_semaphore_t slots = dispatch_semaphore_create(std::max(maxConcurrentTasks,1));
+  dispatch_apply(numTasks,gcdq,^(size_t i)
+  {
+    dispatch_semaphore_wait(slots,DISPATCH_TIME_FOREVER);
+    task(int(i));
+    dispatch_semaphore_signal(slots);
+  });
+  dispatch_release(slots);
+#else
+  const int numThreads = omp_get_max_threads();
+  const int numConcurrentTasks = clamp(maxConcurrentTasks,1,std::min(numTasks,numThreads));
+  const int numThreadsPerTask = std::max(numThreads/numConcurrentTasks,1);
+
+  // the active levels are OpenMP 3.0, MSVC has only 2.0 and its nesting switch
+#if _OPENMP>=200805
+  const int maxActiveLevels = omp_get_max_active_levels();
+  omp_set_max_active_levels(2);
+#else
+  const int nested = omp_get_nested();
+  omp_set_nested(1);
+#endif
+
+  #pragma omp parallel for num_threads(numConcurrentTasks) schedule(dynamic)
+  for (int i=0;i<numTasks;i++)
+  {
+    omp_set_num_threads(numThreadsPerTask);
+    task(i);
+  }
+
+#if _OPENMP>=200805
+  omp_set_max_active_levels(maxActiveLevels);
+#else
+  omp_set_nested(nested);
+#endif
+#endif
+}
+
+void ebsynthRunSourceBatchCpu(const EbsynthSourceCpu* source,
+                              int    numTargets,
+                              const EbsynthTarget* targets,
+                              float* styleWeights,
+                              float* guideWeights,
+                              float  uniformityWeight,
+                              int    patchSize,
+                              int    voteMode,
+                              int    numPyramidLevels,
+                              int*   numSearchVoteItersPerLevel,
+                              int*   numPatchMatchItersPerLevel,
+                              int*   stopThresholdPerLevel,
+                              int    extraPass3x3,
+                              const EbsynthOptions* options)
+{
+  if (source==NULL) { return; }
+
+  // A small target can't keep all the threads busy on its own, so the
+  // targets run concurrently instead, up to one per thread.
+  runConcurrently(numTargets,numTargets,[&](const int i)
+  {
+    const RunRng rng(pcgHash((options!=NULL ? options->seed : 0) ^ pcgHash(unsigned(i))));
+
+    const EbsynthImage targetGuide = packedImage(targets[i].guideData,targets[i].width,source->numGuideChannels());
+    const EbsynthImage targetModulation = packedImage(targets[i].modulationData,targets[i].width,source->numGuideChannels());
+    const EbsynthImage outputImage = packedImage(targets[i].outputImageData,targets[i].width,source->numStyleChannels());
+
+    source->run(targets[i].width,
+                targets[i].height,
+                &targetGuide,
+                targets[i].modulationData!=NULL ? &targetModulation : NULL,
+                styleWeights,
+                guideWeights,
+                uniformityWeight,
+                patchSize,
+                voteMode,
+                numPyramidLevels,
+                numSearchVoteItersPerLevel,
+                numPatchMatchItersPerLevel,
+                stopThresholdPerLevel,
+                extraPass3x3,
+                targets[i].outputNnfData,
+                &outputImage,
+                options,
+                targets[i].stats);
+  });
+}
+
+void ebsynthRunJobsCpu(int numJobs,const EbsynthJob* jobs)
+{
+  // The number of target pixels that keeps one thread busy. A job gets as
+  // many threads as its size can keep busy, rounded down to a power of two,
+  // and jobs with the same share run together, numThreads/share at a time.
+  // Large jobs thus run one after another with all the threads, while
+  // thumbnails run one per thread.
+  const int numPixelsPerThread = 256*256;
+  const int numThreads = maxThreads();
+
+  std::vector<std::vector<int>> jobsPerShare(numThreads+1);
+  for(int i=0;i<numJobs;i++)
+  {
+    const double numPixels = double(jobs[i].targetWidth)*double(jobs[i].targetHeight);
+
+    int share = 1;
+    while (share*2<=numThreads && numPixels>=double(share*2)*double(numPixelsPerThread)) { share *= 2; }
+    if (numPixels>=double(numThreads)*double(numPixelsPerThread)) { share = numThreads; }
+
+    jobsPerShare[share].push_back(i);
+  }
+
+  for(int share=numThreads;share>=1;share--)
+  {
+    const std::vector<int>& group = jobsPerShare[share];
+
+    runConcurrently(int(group.size()),numThreads/share,[&](const int i)
+    {
+      const EbsynthJob& job = jobs[group[i]];
+      const RunRng rng(pcgHash((job.options!=NULL ? job.options->seed : 0) ^ pcgHash(unsigned(group[i]))));
+
+      ebsynthRunCpu(job.numStyleChannels,
+                    job.numGuideChannels,
+                    job.sourceWidth,
+                    job.sourceHeight,
+                    job.sourceStyleData,
+                    job.sourceGuideData,
+                    job.targetWidth,
+                    job.targetHeight,
+                    job.targetGuideData,
+                    job.targetModulationData,
+                    job.styleWeights,
+                    job.guideWeights,
+                    job.uniformityWeight,
+                    job.patchSize,
+                    job.voteMode,
+                    job.numPyramidLevels,
+                    job.numSearchVoteItersPerLevel,
+                    job.numPatchMatchItersPerLevel,
+                    job.stopThresholdPerLevel,
+                    job.extraPass3x3,
+                    job.outputNnfData,
+                    job.outputImageData,
+                    job.options,
+                    job.stats);
+    });
+  }
+}
+
+void ebsynthRunStridedCpu(int    numStyleChannels,
+                          int    numGuideChannels,
+                          int    sourceWidth,
+                          int    sourceHeight,
+                          const EbsynthImage* sourceStyle,
+                          const EbsynthImage* sourceGuide,
+                          int    targetWidth,
+                          int    targetHeight,
+                          const EbsynthImage* targetGuide,
+                          const EbsynthImage* targetModulation,
+                          float* styleWeights,
+                          float* guideWeights,
+                          float  uniformityWeight,
+                          int    patchSize,
+                          int    voteMode,
+                          int    numPyramidLevels,
+                          int*   numSearchVoteItersPerLevel,
+                          int*   numPatchMatchItersPerLevel,
+                          int*   stopThresholdPerLevel,
+                          int    extraPass3x3,
+                          void*  outputNnfData,
+                          const EbsynthImage* outputImage,
+                          const EbsynthOptions* options,
+                          EbsynthStats* stats)
+{
+  const double sourceStart = now();
+
+  EbsynthSourceCpu* source = createSourceStridedCpu(numStyleChannels,
+                                                    numGuideChannels,
+                                                    sourceWidth,
+                                                    sourceHeight,
+                                                    sourceStyle,
+                                                    sourceGuide);
+
+  const float sourceSeconds = float(now()-sourceStart);
+
+  if (source!=NULL)
+  {
+    source->run(targetWidth,
+                targetHeight,
+                targetGuide,
+                targetModulation,
+                styleWeights,
+                guideWeights,
+                uniformityWeight,
+                patchSize,
+                voteMode,
+                numPyramidLevels,
+                numSearchVoteItersPerLevel,
+                numPatchMatchItersPerLevel,
+                stopThresholdPerLevel,
+                extraPass3x3,
+                outputNnfData,
+                outputImage,
+                options,
+                stats);
+  }
+
+  // the source pyramid is part of the run here, unlike with a context
+  if (stats!=NULL)
+  {
+    stats->pyramidSeconds += sourceSeconds;
+    stats->totalSeconds += sourceSeconds;
+  }
+
+  ebsynthDestroySourceCpu(source);
 }
 
 void ebsynthRunCpu(int    numStyleChannels,
@@ -1011,62 +3263,40 @@ void ebsynthRunCpu(int    numStyleChannels,
                    int*   stopThresholdPerLevel,
                    int    extraPass3x3,
                    void*  outputNnfData,
-                   void*  outputImageData)
-{
-  void (*const dispatchEbsynth[EBSYNTH_MAX_GUIDE_CHANNELS][EBSYNTH_MAX_STYLE_CHANNELS])(int,int,int,int,void*,void*,int,int,void*,void*,float*,float*,float,int,int,int,int*,int*,int*,int,void*,void*) =
-  {
-    { ebsynthCpu<1, 1>, ebsynthCpu<2, 1>, ebsynthCpu<3, 1>, ebsynthCpu<4, 1>, ebsynthCpu<5, 1>, ebsynthCpu<6, 1>, ebsynthCpu<7, 1>, ebsynthCpu<8, 1> },
-    { ebsynthCpu<1, 2>, ebsynthCpu<2, 2>, ebsynthCpu<3, 2>, ebsynthCpu<4, 2>, ebsynthCpu<5, 2>, ebsynthCpu<6, 2>, ebsynthCpu<7, 2>, ebsynthCpu<8, 2> },
-    { ebsynthCpu<1, 3>, ebsynthCpu<2, 3>, ebsynthCpu<3, 3>, ebsynthCpu<4, 3>, ebsynthCpu<5, 3>, ebsynthCpu<6, 3>, ebsynthCpu<7, 3>, ebsynthCpu<8, 3> },
-    { ebsynthCpu<1, 4>, ebsynthCpu<2, 4>, ebsynthCpu<3, 4>, ebsynthCpu<4, 4>, ebsynthCpu<5, 4>, ebsynthCpu<6, 4>, ebsynthCpu<7, 4>, ebsynthCpu<8, 4> },
-    { ebsynthCpu<1, 5>, ebsynthCpu<2, 5>, ebsynthCpu<3, 5>, ebsynthCpu<4, 5>, ebsynthCpu<5, 5>, ebsynthCpu<6, 5>, ebsynthCpu<7, 5>, ebsynthCpu<8, 5> },
-    { ebsynthCpu<1, 6>, ebsynthCpu<2, 6>, ebsynthCpu<3, 6>, ebsynthCpu<4, 6>, ebsynthCpu<5, 6>, ebsynthCpu<6, 6>, ebsynthCpu<7, 6>, ebsynthCpu<8, 6> },
-    { ebsynthCpu<1, 7>, ebsynthCpu<2, 7>, ebsynthCpu<3, 7>, ebsynthCpu<4, 7>, ebsynthCpu<5, 7>, ebsynthCpu<6, 7>, ebsynthCpu<7, 7>, ebsynthCpu<8, 7> },
-    { ebsynthCpu<1, 8>, ebsynthCpu<2, 8>, ebsynthCpu<3, 8>, ebsynthCpu<4, 8>, ebsynthCpu<5, 8>, ebsynthCpu<6, 8>, ebsynthCpu<7, 8>, ebsynthCpu<8, 8> },
-    { ebsynthCpu<1, 9>, ebsynthCpu<2, 9>, ebsynthCpu<3, 9>, ebsynthCpu<4, 9>, ebsynthCpu<5, 9>, ebsynthCpu<6, 9>, ebsynthCpu<7, 9>, ebsynthCpu<8, 9> },
-    { ebsynthCpu<1,10>, ebsynthCpu<2,10>, ebsynthCpu<3,10>, ebsynthCpu<4,10>, ebsynthCpu<5,10>, ebsynthCpu<6,10>, ebsynthCpu<7,10>, ebsynthCpu<8,10> },
-    { ebsynthCpu<1,11>, ebsynthCpu<2,11>, ebsynthCpu<3,11>, ebsynthCpu<4,11>, ebsynthCpu<5,11>, ebsynthCpu<6,11>, ebsynthCpu<7,11>, ebsynthCpu<8,11> },
-    { ebsynthCpu<1,12>, ebsynthCpu<2,12>, ebsynthCpu<3,12>, ebsynthCpu<4,12>, ebsynthCpu<5,12>, ebsynthCpu<6,12>, ebsynthCpu<7,12>, ebsynthCpu<8,12> },
-    { ebsynthCpu<1,13>, ebsynthCpu<2,13>, ebsynthCpu<3,13>, ebsynthCpu<4,13>, ebsynthCpu<5,13>, ebsynthCpu<6,13>, ebsynthCpu<7,13>, ebsynthCpu<8,13> },
-    { ebsynthCpu<1,14>, ebsynthCpu<2,14>, ebsynthCpu<3,14>, ebsynthCpu<4,14>, ebsynthCpu<5,14>, ebsynthCpu<6,14>, ebsynthCpu<7,14>, ebsynthCpu<8,14> },
-    { ebsynthCpu<1,15>, ebsynthCpu<2,15>, ebsynthCpu<3,15>, ebsynthCpu<4,15>, ebsynthCpu<5,15>, ebsynthCpu<6,15>, ebsynthCpu<7,15>, ebsynthCpu<8,15> },
-    { ebsynthCpu<1,16>, ebsynthCpu<2,16>, ebsynthCpu<3,16>, ebsynthCpu<4,16>, ebsynthCpu<5,16>, ebsynthCpu<6,16>, ebsynthCpu<7,16>, ebsynthCpu<8,16> },
-    { ebsynthCpu<1,17>, ebsynthCpu<2,17>, ebsynthCpu<3,17>, ebsynthCpu<4,17>, ebsynthCpu<5,17>, ebsynthCpu<6,17>, ebsynthCpu<7,17>, ebsynthCpu<8,17> },
-    { ebsynthCpu<1,18>, ebsynthCpu<2,18>, ebsynthCpu<3,18>, ebsynthCpu<4,18>, ebsynthCpu<5,18>, ebsynthCpu<6,18>, ebsynthCpu<7,18>, ebsynthCpu<8,18> },
-    { ebsynthCpu<1,19>, ebsynthCpu<2,19>, ebsynthCpu<3,19>, ebsynthCpu<4,19>, ebsynthCpu<5,19>, ebsynthCpu<6,19>, ebsynthCpu<7,19>, ebsynthCpu<8,19> },
-    { ebsynthCpu<1,20>, ebsynthCpu<2,20>, ebsynthCpu<3,20>, ebsynthCpu<4,20>, ebsynthCpu<5,20>, ebsynthCpu<6,20>, ebsynthCpu<7,20>, ebsynthCpu<8,20> },
-    { ebsynthCpu<1,21>, ebsynthCpu<2,21>, ebsynthCpu<3,21>, ebsynthCpu<4,21>, ebsynthCpu<5,21>, ebsynthCpu<6,21>, ebsynthCpu<7,21>, ebsynthCpu<8,21> },
-    { ebsynthCpu<1,22>, ebsynthCpu<2,22>, ebsynthCpu<3,22>, ebsynthCpu<4,22>, ebsynthCpu<5,22>, ebsynthCpu<6,22>, ebsynthCpu<7,22>, ebsynthCpu<8,22> },
-    { ebsynthCpu<1,23>, ebsynthCpu<2,23>, ebsynthCpu<3,23>, ebsynthCpu<4,23>, ebsynthCpu<5,23>, ebsynthCpu<6,23>, ebsynthCpu<7,23>, ebsynthCpu<8,23> },
-    { ebsynthCpu<1,24>, ebsynthCpu<2,24>, ebsynthCpu<3,24>, ebsynthCpu<4,24>, ebsynthCpu<5,24>, ebsynthCpu<6,24>, ebsynthCpu<7,24>, ebsynthCpu<8,24> }
-  };
-
-  if (numStyleChannels>=1 && numStyleChannels<=EBSYNTH_MAX_STYLE_CHANNELS &&
-      numGuideChannels>=1 && numGuideChannels<=EBSYNTH_MAX_GUIDE_CHANNELS)
-  {
-    dispatchEbsynth[numGuideChannels-1][numStyleChannels-1](numStyleChannels,
-                                                            numGuideChannels,
-                                                            sourceWidth,
-                                                            sourceHeight,
-                                                            sourceStyleData,
-                                                            sourceGuideData,
-                                                            targetWidth,
-                                                            targetHeight,
-                                                            targetGuideData,
-                                                            targetModulationData,
-                                                            styleWeights,
-                                                            guideWeights,
-                                                            uniformityWeight,
-                                                            patchSize,
-                                                            voteMode,
-                                                            numPyramidLevels,
-                                                            numSearchVoteItersPerLevel,
-                                                            numPatchMatchItersPerLevel,
-                                                            stopThresholdPerLevel,
-                                                            extraPass3x3,
-                                                            outputNnfData,
-                                                            outputImageData);
-  }
+                   void*  outputImageData,
+                   const EbsynthOptions* options,
+                   EbsynthStats* stats)
+{
+  const EbsynthImage sourceStyle = packedImage(sourceStyleData,sourceWidth,numStyleChannels);
+  const EbsynthImage sourceGuide = packedImage(sourceGuideData,sourceWidth,numGuideChannels);
+  const EbsynthImage targetGuide = packedImage(targetGuideData,targetWidth,numGuideChannels);
+  const EbsynthImage targetModulation = packedImage(targetModulationData,targetWidth,numGuideChannels);
+  const EbsynthImage outputImage = packedImage(outputImageData,targetWidth,numStyleChannels);
+
+  ebsynthRunStridedCpu(numStyleChannels,
+                       numGuideChannels,
+                       sourceWidth,
+                       sourceHeight,
+                       &sourceStyle,
+                       &sourceGuide,
+                       targetWidth,
+                       targetHeight,
+                       &targetGuide,
+                       targetModulationData!=NULL ? &targetModulation : NULL,
+                       styleWeights,
+                       guideWeights,
+                       uniformityWeight,
+                       patchSize,
+                       voteMode,
+                       numPyramidLevels,
+                       numSearchVoteItersPerLevel,
+                       numPatchMatchItersPerLevel,
+                       stopThresholdPerLevel,
+                       extraPass3x3,
+                       outputNnfData,
+                       &outputImage,
+                       options,
+                       stats);
 }
 
 int ebsynthBackendAvailableCpu()
@@ -5,6 +5,14 @@
 #ifndef EBSYNTH_CPU_H_
 #define EBSYNTH_CPU_H_
 
+struct EbsynthOptions;
+struct EbsynthStats;
+struct EbsynthSourceCpu;
+struct EbsynthTarget;
+struct EbsynthJob;
+struct EbsynthImage;
+struct EbsynthState;
+
 void ebsynthRunCpu(int    numStyleChannels,
                    int    numGuideChannels,
                    int    sourceWidth,
@@ -26,7 +34,89 @@ void ebsynthRunCpu(int    numStyleChannels,
                    int*   stopThresholdPerLevel,
                    int    extraPass3x3,
                    void*  outputNnfData,
-                   void*  outputImageData);
+                   void*  outputImageData,
+                   const EbsynthOptions* options,
+                   EbsynthStats* stats);
+
+void ebsynthRunStridedCpu(int    numStyleChannels,
+                          int    numGuideChannels,
+                          int    sourceWidth,
+                          int    sourceHeight,
+                          const EbsynthImage* sourceStyle,
+                          const EbsynthImage* sourceGuide,
+                          int    targetWidth,
+                          int    targetHeight,
+                          const EbsynthImage* targetGuide,
+                          const EbsynthImage* targetModulation,
+                          float* styleWeights,
+                          float* guideWeights,
+                          float  uniformityWeight,
+                          int    patchSize,
+                          int    voteMode,
+                          int    numPyramidLevels,
+                          int*   numSearchVoteItersPerLevel,
+                          int*   numPatchMatchItersPerLevel,
+                          int*   stopThresholdPerLevel,
+                          int    extraPass3x3,
+                          void*  outputNnfData,
+                          const EbsynthImage* outputImage,
+                          const EbsynthOptions* options,
+                          EbsynthStats* stats);
+
+// copy the channels of an image to/from an interleaved buffer with the given
+// pixel stride and row pitch in bytes
+void ebsynthGatherImageCpu(const EbsynthImage* image,int width,int height,unsigned char* dst,int dstPixelStride,int dstPitch);
+void ebsynthScatterImageCpu(const EbsynthImage* image,int width,int height,const unsigned char* src,int srcPixelStride,int srcPitch);
+
+EbsynthSourceCpu* ebsynthCreateSourceCpu(int   numStyleChannels,
+                                         int   numGuideChannels,
+                                         int   sourceWidth,
+                                         int   sourceHeight,
+                                         void* sourceStyleData,
+                                         void* sourceGuideData);
+
+void ebsynthRunSourceCpu(const EbsynthSourceCpu* source,
+                         int    targetWidth,
+                         int    targetHeight,
+                         void*  targetGuideData,
+                         void*  targetModulationData,
+                         float* styleWeights,
+                         float* guideWeights,
+                         float  uniformityWeight,
+                         int    patchSize,
+                         int    voteMode,
+                         int    numPyramidLevels,
+                         int*   numSearchVoteItersPerLevel,
+                         int*   numPatchMatchItersPerLevel,
+                         int*   stopThresholdPerLevel,
+                         int    extraPass3x3,
+                         void*  outputNnfData,
+                         void*  outputImageData,
+                         const EbsynthOptions* options,
+                         EbsynthStats* stats);
+
+void ebsynthRunSourceBatchCpu(const EbsynthSourceCpu* source,
+                              int    numTargets,
+                              const EbsynthTarget* targets,
+                              float* styleWeights,
+                              float* guideWeights,
+                              float  uniformityWeight,
+                              int    patchSize,
+                              int    voteMode,
+                              int    numPyramidLevels,
+                              int*   numSearchVoteItersPerLevel,
+                              int*   numPatchMatchItersPerLevel,
+                              int*   stopThresholdPerLevel,
+                              int    extraPass3x3,
+                              const EbsynthOptions* options);
+
+void ebsynthDestroySourceCpu(EbsynthSourceCpu* source);
+
+EbsynthState* ebsynthCreateStateCpu();
+
+void ebsynthDestroyStateCpu(EbsynthState* state);
+
+void ebsynthRunJobsCpu(int numJobs,const EbsynthJob* jobs);
 
 int ebsynthBackendAvailableCpu();
 
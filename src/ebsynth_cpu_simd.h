@@ -0,0 +1,401 @@
+// This software is in the public domain. Where that dedication is not
+// recognized, you are granted a perpetual, irrevocable license to copy
+// and modify this file as you see fit.
+
+#ifndef EBSYNTH_CPU_SIMD_H_
+#define EBSYNTH_CPU_SIMD_H_
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+  #define EBSYNTH_SIMD_X86
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #endif
+#endif
+
+#if defined(EBSYNTH_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+  #define EBSYNTH_TARGET(ISA) __attribute__((target(ISA)))
+#else
+  #define EBSYNTH_TARGET(ISA)
+#endif
+
+// Weighted sum of squared differences over n consecutive bytes:
+//
+//   sum_i w[i]*(a[i]-b[i])^2
+//
+// A patch row of interleaved pixels is contiguous in memory, so the per-channel
+// weights only need to be replicated across the row once (see replicateWeights)
+// and the whole row can be processed as a flat byte array.
+
+typedef float (*WeightedSSDFunc)(const unsigned char* a,const unsigned char* b,const float* w,const int n);
+
+// Rows shorter than this are faster to do inline, with the channel count known
+// at compile time, than through the dispatched kernel, whose call and horizontal
+// reduction overhead would dominate.
+#define WEIGHTED_SSD_MIN_SIMD_BYTES 12
+
+static float weightedSSD_Scalar(const unsigned char* a,const unsigned char* b,const float* w,const int n)
+{
+  float sum = 0;
+  for(int i=0;i<n;i++)
+  {
+    const float diff = int(a[i]) - int(b[i]);
+    sum += w[i]*diff*diff;
+  }
+  return sum;
+}
+
+// Same as above with an additional per-byte modulation factor:
+//
+//   sum_i w[i]*m[i]*(a[i]-b[i])^2
+//
+// The caller is responsible for the 1/255 normalization of the modulation.
+
+typedef float (*ModulatedSSDFunc)(const unsigned char* a,const unsigned char* b,const unsigned char* m,const float* w,const int n);
+
+static float modulatedSSD_Scalar(const unsigned char* a,const unsigned char* b,const unsigned char* m,const float* w,const int n)
+{
+  float sum = 0;
+  for(int i=0;i<n;i++)
+  {
+    const float diff = int(a[i]) - int(b[i]);
+    sum += w[i]*float(m[i])*diff*diff;
+  }
+  return sum;
+}
+
+#ifdef EBSYNTH_SIMD_X86
+
+// The squared difference of two bytes is at most 255^2 = 65025, which still fits
+// into an unsigned 16-bit lane, so the squaring is done exactly in integers
+// with mullo_epi16 and only the weighting happens in float.
+
+EBSYNTH_TARGET("sse4.1")
+static float weightedSSD_SSE41(const unsigned char* a,const unsigned char* b,const float* w,const int n)
+{
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+    const __m128i a16 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(a+i)));
+    const __m128i b16 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(b+i)));
+    const __m128i d16 = _mm_sub_epi16(a16,b16);
+    const __m128i sq  = _mm_mullo_epi16(d16,d16);
+    const __m128  lo  = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(sq));
+    const __m128  hi  = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(sq,8)));
+    acc0 = _mm_add_ps(acc0,_mm_mul_ps(_mm_loadu_ps(w+i  ),lo));
+    acc1 = _mm_add_ps(acc1,_mm_mul_ps(_mm_loadu_ps(w+i+4),hi));
+  }
+
+  acc0 = _mm_add_ps(acc0,acc1);
+  acc0 = _mm_add_ps(acc0,_mm_movehl_ps(acc0,acc0));
+  acc0 = _mm_add_ss(acc0,_mm_shuffle_ps(acc0,acc0,1));
+
+  return _mm_cvtss_f32(acc0) + weightedSSD_Scalar(a+i,b+i,w+i,n-i);
+}
+
+EBSYNTH_TARGET("sse4.1")
+static float modulatedSSD_SSE41(const unsigned char* a,const unsigned char* b,const unsigned char* m,const float* w,const int n)
+{
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+    const __m128i a16 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(a+i)));
+    const __m128i b16 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(b+i)));
+    const __m128i m8  = _mm_loadl_epi64((const __m128i*)(m+i));
+    const __m128i d16 = _mm_sub_epi16(a16,b16);
+    const __m128i sq  = _mm_mullo_epi16(d16,d16);
+    const __m128  lo  = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(sq));
+    const __m128  hi  = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(sq,8)));
+    const __m128  mlo = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(m8));
+    const __m128  mhi = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(m8,4)));
+    acc0 = _mm_add_ps(acc0,_mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(w+i  ),mlo),lo));
+    acc1 = _mm_add_ps(acc1,_mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(w+i+4),mhi),hi));
+  }
+
+  acc0 = _mm_add_ps(acc0,acc1);
+  acc0 = _mm_add_ps(acc0,_mm_movehl_ps(acc0,acc0));
+  acc0 = _mm_add_ss(acc0,_mm_shuffle_ps(acc0,acc0,1));
+
+  return _mm_cvtss_f32(acc0) + modulatedSSD_Scalar(a+i,b+i,m+i,w+i,n-i);
+}
+
+EBSYNTH_TARGET("avx2,fma")
+static float weightedSSD_AVX2(const unsigned char* a,const unsigned char* b,const float* w,const int n)
+{
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+
+  int i = 0;
+  for(;i+16<=n;i+=16)
+  {
+    const __m256i a16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a+i)));
+    const __m256i b16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b+i)));
+    const __m256i d16 = _mm256_sub_epi16(a16,b16);
+    const __m256i sq  = _mm256_mullo_epi16(d16,d16);
+    const __m256  lo  = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(sq)));
+    const __m256  hi  = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(sq,1)));
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(w+i  ),lo,acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(w+i+8),hi,acc1);
+  }
+  for(;i+8<=n;i+=8)
+  {
+    const __m256i a32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(a+i)));
+    const __m256i b32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(b+i)));
+    const __m256i d32 = _mm256_sub_epi32(a32,b32);
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(w+i),_mm256_cvtepi32_ps(_mm256_mullo_epi32(d32,d32)),acc0);
+  }
+
+  acc0 = _mm256_add_ps(acc0,acc1);
+  __m128 acc = _mm_add_ps(_mm256_castps256_ps128(acc0),_mm256_extractf128_ps(acc0,1));
+  acc = _mm_add_ps(acc,_mm_movehl_ps(acc,acc));
+  acc = _mm_add_ss(acc,_mm_shuffle_ps(acc,acc,1));
+
+  return _mm_cvtss_f32(acc) + weightedSSD_Scalar(a+i,b+i,w+i,n-i);
+}
+
+EBSYNTH_TARGET("avx2,fma")
+static float modulatedSSD_AVX2(const unsigned char* a,const unsigned char* b,const unsigned char* m,const float* w,const int n)
+{
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+
+  int i = 0;
+  for(;i+16<=n;i+=16)
+  {
+    const __m256i a16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a+i)));
+    const __m256i b16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b+i)));
+    const __m128i m8  = _mm_loadu_si128((const __m128i*)(m+i));
+    const __m256i d16 = _mm256_sub_epi16(a16,b16);
+    const __m256i sq  = _mm256_mullo_epi16(d16,d16);
+    const __m256  lo  = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(sq)));
+    const __m256  hi  = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(sq,1)));
+    const __m256  mlo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(m8));
+    const __m256  mhi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(m8,8)));
+    acc0 = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(w+i  ),mlo),lo,acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(w+i+8),mhi),hi,acc1);
+  }
+  for(;i+8<=n;i+=8)
+  {
+    const __m256i a32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(a+i)));
+    const __m256i b32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(b+i)));
+    const __m256  m32 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(m+i))));
+    const __m256i d32 = _mm256_sub_epi32(a32,b32);
+    acc0 = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(w+i),m32),_mm256_cvtepi32_ps(_mm256_mullo_epi32(d32,d32)),acc0);
+  }
+
+  acc0 = _mm256_add_ps(acc0,acc1);
+  __m128 acc = _mm_add_ps(_mm256_castps256_ps128(acc0),_mm256_extractf128_ps(acc0,1));
+  acc = _mm_add_ps(acc,_mm_movehl_ps(acc,acc));
+  acc = _mm_add_ss(acc,_mm_shuffle_ps(acc,acc,1));
+
+  return _mm_cvtss_f32(acc) + modulatedSSD_Scalar(a+i,b+i,m+i,w+i,n-i);
+}
+
+// The AVX-512 kernel handles the row tail with masked loads, so short rows
+// (e.g. 5 pixels x 3 channels) take a single iteration without a scalar epilogue.
+
+EBSYNTH_TARGET("avx512f,avx512bw,avx512vl")
+static float weightedSSD_AVX512(const unsigned char* a,const unsigned char* b,const float* w,const int n)
+{
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+
+  for(int i=0;i<n;i+=32)
+  {
+    const int m = n-i < 32 ? n-i : 32;
+    const __mmask32 mask = m==32 ? __mmask32(0xFFFFFFFFu) : __mmask32((1u<<m)-1u);
+
+    const __m512i a16 = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask,a+i));
+    const __m512i b16 = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask,b+i));
+    const __m512i d16 = _mm512_sub_epi16(a16,b16);
+    const __m512i sq  = _mm512_mullo_epi16(d16,d16);
+    const __m512  lo  = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm512_castsi512_si256(sq)));
+    const __m512  hi  = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(sq,1)));
+    acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(__mmask16(mask    ),w+i   ),lo,acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(__mmask16(mask>>16),w+i+16),hi,acc1);
+  }
+
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0,acc1));
+}
+
+EBSYNTH_TARGET("avx512f,avx512bw,avx512vl")
+static float modulatedSSD_AVX512(const unsigned char* a,const unsigned char* b,const unsigned char* m,const float* w,const int n)
+{
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+
+  for(int i=0;i<n;i+=32)
+  {
+    const int k = n-i < 32 ? n-i : 32;
+    const __mmask32 mask = k==32 ? __mmask32(0xFFFFFFFFu) : __mmask32((1u<<k)-1u);
+
+    const __m512i a16 = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask,a+i));
+    const __m512i b16 = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask,b+i));
+    const __m256i m8  = _mm256_maskz_loadu_epi8(mask,m+i);
+    const __m512i d16 = _mm512_sub_epi16(a16,b16);
+    const __m512i sq  = _mm512_mullo_epi16(d16,d16);
+    const __m512  lo  = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm512_castsi512_si256(sq)));
+    const __m512  hi  = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(sq,1)));
+    const __m512  mlo = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm256_castsi256_si128(m8)));
+    const __m512  mhi = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm256_extracti128_si256(m8,1)));
+    acc0 = _mm512_fmadd_ps(_mm512_mul_ps(_mm512_maskz_loadu_ps(__mmask16(mask    ),w+i   ),mlo),lo,acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_mul_ps(_mm512_maskz_loadu_ps(__mmask16(mask>>16),w+i+16),mhi),hi,acc1);
+  }
+
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0,acc1));
+}
+
+struct CpuFeatures
+{
+  bool sse41;
+  bool avx2;
+  bool avx512;
+};
+
+static CpuFeatures detectCpuFeatures()
+{
+  CpuFeatures features;
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info,0);
+  const int maxLeaf = info[0];
+
+  __cpuid(info,1);
+  const bool sse41   = (info[2] & (1<<19))!=0;
+  const bool osxsave = (info[2] & (1<<27))!=0;
+  const bool fma     = (info[2] & (1<<12))!=0;
+
+  const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+  const bool osAvx    = (xcr0 & 0x06)==0x06;
+  const bool osAvx512 = (xcr0 & 0xE6)==0xE6;
+
+  int info7[4] = { 0,0,0,0 };
+  if (maxLeaf>=7) { __cpuidex(info7,7,0); }
+
+  features.sse41  = sse41;
+  features.avx2   = osAvx && fma && (info7[1] & (1<<5))!=0;
+  features.avx512 = osAvx512 && (info7[1] & (1<<16))!=0 &&   // AVX512F
+                                (info7[1] & (1<<30))!=0 &&   // AVX512BW
+                                (info7[1] & (1<<31))!=0;     // AVX512VL
+#else
+  __builtin_cpu_init();
+  features.sse41  = __builtin_cpu_supports("sse4.1");
+  features.avx2   = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  features.avx512 = __builtin_cpu_supports("avx512f") &&
+                    __builtin_cpu_supports("avx512bw") &&
+                    __builtin_cpu_supports("avx512vl");
+#endif
+  return features;
+}
+
+#endif
+
+static WeightedSSDFunc selectWeightedSSD()
+{
+#ifdef EBSYNTH_SIMD_X86
+  const CpuFeatures features = detectCpuFeatures();
+
+  if (features.avx512) { return weightedSSD_AVX512; }
+  if (features.avx2)   { return weightedSSD_AVX2;   }
+  if (features.sse41)  { return weightedSSD_SSE41;  }
+#endif
+  return weightedSSD_Scalar;
+}
+
+// The CPU is probed only once, the first time each kernel is requested.
+static WeightedSSDFunc weightedSSD()
+{
+  static const WeightedSSDFunc func = selectWeightedSSD();
+  return func;
+}
+
+static ModulatedSSDFunc selectModulatedSSD()
+{
+#ifdef EBSYNTH_SIMD_X86
+  const CpuFeatures features = detectCpuFeatures();
+
+  if (features.avx512) { return modulatedSSD_AVX512; }
+  if (features.avx2)   { return modulatedSSD_AVX2;   }
+  if (features.sse41)  { return modulatedSSD_SSE41;  }
+#endif
+  return modulatedSSD_Scalar;
+}
+
+static ModulatedSSDFunc modulatedSSD()
+{
+  static const ModulatedSSDFunc func = selectModulatedSSD();
+  return func;
+}
+
+// Repeats the N per-channel weights across a row of patchSize interleaved pixels.
+template<int N>
+std::vector<float> replicateWeights(const Vec<N,float>& weights,const int patchSize)
+{
+  std::vector<float> row(patchSize*N);
+  for(int i=0;i<patchSize;i++)
+  for(int k=0;k<N;k++)
+  {
+    row[i*N+k] = weights[k];
+  }
+  return row;
+}
+
+// Weighted SSD of one patch row of interleaved N-channel pixels, using the
+// dispatched kernel only when the row is long enough to benefit from it.
+template<int N>
+inline float weightedSSDPatchRow(const unsigned char* a,
+                                 const unsigned char* b,
+                                 const Vec<N,float>&  weights,
+                                 const float*         weightsRow,
+                                 const int            patchSize,
+                                 WeightedSSDFunc      kernel)
+{
+  if (patchSize*N>=WEIGHTED_SSD_MIN_SIMD_BYTES) { return kernel(a,b,weightsRow,patchSize*N); }
+
+  float error = 0;
+  for(int i=0;i<patchSize;i++)
+  {
+    for(int k=0;k<N;k++)
+    {
+      const float diff = int(*a) - int(*b);
+      error += weights[k]*diff*diff;
+      a++;
+      b++;
+    }
+  }
+  return error;
+}
+
+template<int N>
+inline float modulatedSSDPatchRow(const unsigned char* a,
+                                  const unsigned char* b,
+                                  const unsigned char* m,
+                                  const Vec<N,float>&  weights,
+                                  const float*         weightsRow,
+                                  const int            patchSize,
+                                  ModulatedSSDFunc     kernel)
+{
+  if (patchSize*N>=WEIGHTED_SSD_MIN_SIMD_BYTES) { return kernel(a,b,m,weightsRow,patchSize*N); }
+
+  float error = 0;
+  for(int i=0;i<patchSize;i++)
+  {
+    for(int k=0;k<N;k++)
+    {
+      const float diff = int(*a) - int(*b);
+      error += weights[k]*float(*m)*diff*diff;
+      a++;
+      b++;
+      m++;
+    }
+  }
+  return error;
+}
+
+#endif
@@ -408,6 +408,30 @@ static A2V2i nnfUpscale(const A2V2i& NNF,
   return NNF2x;
 }
 
+// Samples a full resolution NNF down to a coarser level, 'factor' times
+// smaller, to seed that level with the matches of a previous run.
+static A2V2i nnfDownscale(const V2i* NNF,
+                          const V2i& NNFSize,
+                          const int  factor,
+                          const int  patchSize,
+                          const V2i& targetSize,
+                          const V2i& sourceSize)
+{
+  A2V2i NNFs(targetSize);
+  const int r = patchSize/2;
+
+  FOR(NNFs,x,y)
+  {
+    const V2i nn = NNF[clamp(y*factor,0,NNFSize(1)-1)*NNFSize(0)+
+                       clamp(x*factor,0,NNFSize(0)-1)]/factor;
+
+    NNFs(x,y) = V2i(clamp(nn(0),r,sourceSize(0)-r-1),
+                    clamp(nn(1),r,sourceSize(1)-r-1));
+  }
+
+  return NNFs;
+}
+
 template<int N, typename T, int M>
 __global__ void krnlVotePlain(      TexArray2<N,T,M> target,
                               const TexArray2<N,T,M> source,
@@ -766,10 +790,15 @@ void ebsynthCuda(int    numStyleChannels,
                  int*   stopThresholdPerLevel,
                  int    extraPass3x3,
                  void*  outputNnfData,
-                 void*  outputImageData)
+                 void*  outputImageData,
+                 const EbsynthOptions* options,
+                 EbsynthStats* stats)
 {
   const int levelCount = numPyramidLevels;
 
+  const V2i* initialNnf = options!=NULL ? (const V2i*)options->initialNnfData : NULL;
+  const int startLevel = options!=NULL ? clamp(options->startPyramidLevel,0,levelCount-1) : 0;
+
   struct PyramidLevel
   {
     PyramidLevel() { }
@@ -794,6 +823,9 @@ void ebsynthCuda(int    numStyleChannels,
   };
 
   std::vector<PyramidLevel> pyramid(levelCount);
+
+  std::vector<double> numSkippedPixelsPerLevel(levelCount,0.0);
+  std::vector<double> numPixelsPerLevel(levelCount,0.0);
   for(int level=0;level<levelCount;level++)
   {
     const V2i levelSourceSize = pyramidLevelSize(V2i(sourceWidth,sourceHeight),levelCount,level);
@@ -825,7 +857,7 @@ void ebsynthCuda(int    numStyleChannels,
 
   pcgState* rngStates = initGpuRng(targetWidth,targetHeight);
 
-  for (int level=0;level<pyramid.size();level++)
+  for (int level=startLevel;level<pyramid.size();level++)
   {
     if (!inExtraPass)
     {
@@ -859,7 +891,7 @@ void ebsynthCuda(int    numStyleChannels,
       }
 
       A2V2i cpu_NNF;
-      if (level>0)
+      if (level>startLevel)
       {
         A2V2i prevLevelNNF(pyramid[level-1].targetWidth,
                            pyramid[level-1].targetHeight);
@@ -873,6 +905,15 @@ void ebsynthCuda(int    numStyleChannels,
         
         pyramid[level-1].NNF.destroy();
       }
+      else if (initialNnf!=NULL)
+      {
+        cpu_NNF = nnfDownscale(initialNnf,
+                               V2i(targetWidth,targetHeight),
+                               1<<(levelCount-1-level),
+                               patchSize,
+                               V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
+                               V2i(pyramid[level].sourceWidth,pyramid[level].sourceHeight));
+      }
       else
       {
         cpu_NNF = nnfInitRandom(V2i(pyramid[level].targetWidth,pyramid[level].targetHeight),
@@ -938,6 +979,13 @@ void ebsynthCuda(int    numStyleChannels,
       Vec<NG,float> guideWeightsVec;
       for(int i=0;i<NG;i++) { guideWeightsVec[i] = guideWeights[i]; }
 
+      if (stats!=NULL)
+      {
+        copy(&cpu_mask,pyramid[level].mask);
+        for(int xy=0;xy<cpu_mask.numel();xy++) { if (cpu_mask[xy][0]==0) { numSkippedPixelsPerLevel[level] += 1.0; } }
+        numPixelsPerLevel[level] += double(cpu_mask.numel());
+      }
+
       const int numGpuThreadsPerBlock = 24;
 
       if (numPatchMatchItersPerLevel[level]>0)
@@ -1098,6 +1146,15 @@ void ebsynthCuda(int    numStyleChannels,
   pyramid[levelCount-1].NNF.destroy();
 
   checkCudaError( cudaFree(rngStates) );
+
+  if (stats!=NULL)
+  {
+    stats->numPyramidLevels = levelCount;
+    for(int level=0;level<std::min(levelCount,EBSYNTH_MAX_PYRAMID_LEVELS);level++)
+    {
+      stats->skippedPixelFraction[level] = numPixelsPerLevel[level]>0 ? float(numSkippedPixelsPerLevel[level]/numPixelsPerLevel[level]) : 0.0f;
+    }
+  }
 }
 
 void ebsynthRunCuda(int    numStyleChannels,
@@ -1121,9 +1178,11 @@ void ebsynthRunCuda(int    numStyleChannels,
                     int*   stopThresholdPerLevel,
                     int    extraPass3x3,
                     void*  outputNnfData,
-                    void*  outputImageData)
+                    void*  outputImageData,
+                    const EbsynthOptions* options,
+                    EbsynthStats* stats)
 {
-  void (*const dispatchEbsynth[EBSYNTH_MAX_GUIDE_CHANNELS][EBSYNTH_MAX_STYLE_CHANNELS])(int,int,int,int,void*,void*,int,int,void*,void*,float*,float*,float,int,int,int,int*,int*,int*,int,void*,void*) =
+  void (*const dispatchEbsynth[EBSYNTH_MAX_GUIDE_CHANNELS][EBSYNTH_MAX_STYLE_CHANNELS])(int,int,int,int,void*,void*,int,int,void*,void*,float*,float*,float,int,int,int,int*,int*,int*,int,void*,void*,const EbsynthOptions*,EbsynthStats*) =
   {
     { ebsynthCuda<1, 1>, ebsynthCuda<2, 1>, ebsynthCuda<3, 1>, ebsynthCuda<4, 1>, ebsynthCuda<5, 1>, ebsynthCuda<6, 1>, ebsynthCuda<7, 1>, ebsynthCuda<8, 1> },
     { ebsynthCuda<1, 2>, ebsynthCuda<2, 2>, ebsynthCuda<3, 2>, ebsynthCuda<4, 2>, ebsynthCuda<5, 2>, ebsynthCuda<6, 2>, ebsynthCuda<7, 2>, ebsynthCuda<8, 2> },
@@ -1175,7 +1234,9 @@ void ebsynthRunCuda(int    numStyleChannels,
                                                             stopThresholdPerLevel,
                                                             extraPass3x3,
                                                             outputNnfData,
-                                                            outputImageData);
+                                                            outputImageData,
+                                                            options,
+                                                            stats);
   }
 }
 
@@ -5,6 +5,9 @@
 #ifndef EBSYNTH_CUDA_H_
 #define EBSYNTH_CUDA_H_
 
+struct EbsynthOptions;
+struct EbsynthStats;
+
 void ebsynthRunCuda(int    numStyleChannels,
                     int    numGuideChannels,
                     int    sourceWidth,
@@ -26,7 +29,9 @@ void ebsynthRunCuda(int    numStyleChannels,
                     int*   stopThresholdPerLevel,
                     int    extraPass3x3,
                     void*  outputNnfData,
-                    void*  outputImageData);
+                    void*  outputImageData,
+                    const EbsynthOptions* options,
+                    EbsynthStats* stats);
 
 int ebsynthBackendAvailableCuda();
 
@@ -0,0 +1,348 @@
+// This software is in the public domain. Where that dedication is not
+// recognized, you are granted a perpetual, irrevocable license to copy
+// and modify this file as you see fit.
+
+// Microbenchmarks of the individual CPU kernels. The kernels are internal to
+// ebsynth_cpu.cpp, so it's compiled right into this file. Every kernel runs on
+// random data for representative channel counts and patch sizes, and the time
+// and the memory traffic per operation are printed, e.g.:
+//
+//   OMP_NUM_THREADS=1 ebsynth-kernelbench
+//
+// The byte counts are the data a kernel has to touch per operation, not what
+// actually comes from memory, so they're meant for comparing kernels, not for
+// measuring bandwidth.
+
+#include "ebsynth_cpu.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <string>
+
+static unsigned int benchRandom(unsigned int* state)
+{
+  *state = *state*1664525U+1013904223U;
+  return *state>>8;
+}
+
+template<int N>
+static void fillRandom(Array2<Vec<N,unsigned char>>& A,unsigned int seed)
+{
+  for(int xy=0;xy<A.numel();xy++)
+  for(int i=0;i<N;i++)
+  {
+    A[xy][i] = (unsigned char)benchRandom(&seed);
+  }
+}
+
+static A2V2i randomNnf(const V2i& targetSize,const V2i& sourceSize,const int patchSize,unsigned int seed)
+{
+  A2V2i NNF(targetSize);
+  for(int xy=0;xy<NNF.numel();xy++)
+  {
+    NNF[xy] = V2i(patchSize+benchRandom(&seed)%(sourceSize(0)-2*patchSize),
+                  patchSize+benchRandom(&seed)%(sourceSize(1)-2*patchSize));
+  }
+  return NNF;
+}
+
+// Runs the kernel until at least minSeconds have passed and returns the time
+// of one operation in nanoseconds. The first run only warms up.
+template<typename FUNC>
+static double nsPerOp(FUNC kernel,const double numOpsPerRun)
+{
+  const double minSeconds = 0.25;
+
+  kernel();
+
+  int numRuns = 0;
+  const double start = now();
+  double elapsed = 0;
+  do
+  {
+    kernel();
+    numRuns++;
+    elapsed = now()-start;
+  }
+  while (elapsed<minSeconds);
+
+  return 1.0e9*elapsed/(double(numRuns)*numOpsPerRun);
+}
+
+static void report(const char* kernel,const char* config,double ns,double bytes)
+{
+  if (bytes>0) { printf("%-24s %-26s %12.2f %12.0f %10.2f\n",kernel,config,ns,bytes,bytes/ns); }
+  else         { printf("%-24s %-26s %12.2f %12s %10s\n",kernel,config,ns,"-","-"); }
+  fflush(stdout);
+}
+
+static volatile float sink;
+
+template<int NS,int NG>
+static void benchKernels(const int size,const int patchSize)
+{
+  const V2i sizeA(size,size);
+  const V2i sizeB(size,size);
+  const int numPixels = size*size;
+
+  Array2<Vec<NS,unsigned char>> targetStyle(sizeA);
+  Array2<Vec<NS,unsigned char>> sourceStyle(sizeB);
+  Array2<Vec<NG,unsigned char>> targetGuide(sizeA);
+  Array2<Vec<NG,unsigned char>> sourceGuide(sizeB);
+  fillRandom(targetStyle,1);
+  fillRandom(sourceStyle,2);
+  fillRandom(targetGuide,3);
+  fillRandom(sourceGuide,4);
+
+  Vec<NS,float> styleWeights;
+  Vec<NG,float> guideWeights;
+  for(int i=0;i<NS;i++) { styleWeights[i] = 1.0f/float(NS); }
+  for(int i=0;i<NG;i++) { guideWeights[i] = 1.0f/float(NG); }
+  const std::vector<float> styleWeightsRow = replicateWeights(styleWeights,patchSize);
+  const std::vector<float> guideWeightsRow = replicateWeights(guideWeights,patchSize);
+
+  Array2<Vec<NS,unsigned char>> targetStylePadded;
+  Array2<Vec<NG,unsigned char>> targetGuidePadded;
+  padArray(targetStylePadded,targetStyle,patchSize/2);
+  padArray(targetGuidePadded,targetGuide,patchSize/2);
+
+  PatchSSD_Split<NS,NG,unsigned char> patchError(targetStylePadded,sourceStyle,targetGuidePadded,sourceGuide,patchSize/2,
+                                                  styleWeights,guideWeights,styleWeightsRow,guideWeightsRow);
+
+  const A2V2i NNF = randomNnf(sizeA,sizeB,patchSize,5);
+
+  A2uc mask(sizeA);
+  fill(&mask,(unsigned char)255);
+
+  char config[64];
+  snprintf(config,sizeof(config),"NS=%d NG=%d patch=%d",NS,NG,patchSize);
+
+  const double patchBytesStyle = double(patchSize*patchSize*NS);
+  const double patchBytesGuide = double(patchSize*patchSize*NG);
+
+  // the error of whole patches, no early termination
+  {
+    const int numEvals = 1<<16;
+    const A2V2i pairs = randomNnf(V2i(numEvals,2),sizeB,patchSize,6);
+    const double ns = nsPerOp([&]
+    {
+      float sum = 0;
+      for(int i=0;i<numEvals;i++) { sum += patchError(patchSize,pairs(i,0),pairs(i,1),FLT_MAX); }
+      sink = sum;
+    },numEvals);
+    report("PatchSSD_Split",config,ns,2*(patchBytesStyle+patchBytesGuide));
+  }
+
+  {
+    Array2<Vec<NS,unsigned char>> target(sizeA);
+    const double ns = nsPerOp([&]{ krnlVotePlain(target,sourceStyle,NNF,mask,V2i(0,0),sizeA,patchSize); },numPixels);
+    report("krnlVotePlain",config,ns,patchBytesStyle+double(patchSize*patchSize*sizeof(V2i))+NS);
+  }
+
+  {
+    A2f E(sizeA);
+    A2f EG(sizeA);
+    const double ns = nsPerOp([&]{ nnfError(NNF,patchSize,patchError,mask,V2i(0,0),sizeA,E,EG,false); },numPixels);
+    report("nnfError",config,ns,2*(patchBytesStyle+patchBytesGuide)+sizeof(V2i)+sizeof(float));
+  }
+
+  // one Patch-Match iteration over the whole target, its setup (the error of
+  // the current matches and the occupancy) included
+  {
+    A2V2i N(sizeA);
+    A2f   E(sizeA);
+    A2f   EG(sizeA);
+    A2i   Omega(sizeB);
+    const double ns = nsPerOp([&]
+    {
+      N = NNF;
+      PatchMatchCounters counters;
+      bool guideErrorValid = false;
+      patchmatch(sizeA,sizeB,patchSize,patchError,3500.0f,1,-1,EBSYNTH_SCHEDULE_AUTO,false,1,mask,A2uc(),V2i(0,0),sizeA,A2uc(),N,E,EG,&guideErrorValid,Omega,&counters);
+    },numPixels);
+    report("patchmatch (1 iter)",config,ns,0); // too data dependent for a byte count
+  }
+}
+
+template<int N>
+static void benchResample(const int size)
+{
+  Array2<Vec<N,unsigned char>> I(V2i(size,size));
+  Array2<Vec<N,unsigned char>> O(V2i(size/2,size/2));
+  fillRandom(I,7);
+
+  const double ns = nsPerOp([&]{ downscale2x(O,I); },double(O.numel()));
+  char config[64];
+  snprintf(config,sizeof(config),"channels=%d",N);
+  report("downscale2x",config,ns,5*N);
+}
+
+// The occupancy query Patch-Match used before Omega was kept box filtered:
+// the sum of the raw Omega over the window around bxy. It's only kept here,
+// as the baseline of the candidate benchmark below.
+static int patchOmegaWindow(const int patchWidth,const V2i& bxy,const A2i& Omega)
+{
+  const int r = patchWidth/2;
+
+  int sum = 0;
+
+  const int* ptr = (const int*)&Omega(bxy(0)-r,bxy(1)-r);
+  const int ofs = (Omega.width()-patchWidth);
+
+  for(int j=0;j<patchWidth;j++)
+  {
+    for(int i=0;i<patchWidth;i++)
+    {
+      sum += (*ptr);
+      ptr++;
+    }
+    ptr += ofs;
+  }
+
+  return sum;
+}
+
+// The occupancy bookkeeping of one Patch-Match candidate the way tryPatch
+// does it: the occupancy of the current and of the candidate match, and for
+// every 20th candidate, which is about the rate Patch-Match accepts them at,
+// moving the match. The window sum is the baseline, the box-filtered Omega
+// is what Patch-Match uses; both are reported in ns per candidate.
+static void benchOccupancy(const int size,const int patchSize)
+{
+  const V2i sizeB(size,size);
+  const int numCandidates = 1<<16;
+  const A2V2i current = randomNnf(V2i(numCandidates,1),sizeB,patchSize,10);
+  const A2V2i candidates = randomNnf(V2i(numCandidates,1),sizeB,patchSize,11);
+
+  char config[64];
+  snprintf(config,sizeof(config),"patch=%d",patchSize);
+
+  {
+    A2i Omega(sizeB);
+    fill(&Omega,(int)0);
+    const double ns = nsPerOp([&]
+    {
+      int sum = 0;
+      for(int i=0;i<numCandidates;i++)
+      {
+        sum += patchOmegaWindow(patchSize,current[i],Omega)-patchOmegaWindow(patchSize,candidates[i],Omega);
+        if (i%20==0)
+        {
+          updateOmega(Omega,sizeB,patchSize,V2i(0,0),candidates[i],+1);
+          updateOmega(Omega,sizeB,patchSize,V2i(0,0),current[i],-1);
+        }
+      }
+      sink = float(sum);
+    },numCandidates);
+    report("candidate window sum",config,ns,0);
+  }
+
+  {
+    A2i Omega(sizeB);
+    fill(&Omega,(int)0);
+    const double ns = nsPerOp([&]
+    {
+      int sum = 0;
+      for(int i=0;i<numCandidates;i++)
+      {
+        sum += patchOmega(patchSize,current[i],Omega)-patchOmega(patchSize,candidates[i],Omega);
+        if (i%20==0)
+        {
+          updateOmegaBox<false>(Omega,patchSize,candidates[i],+1);
+          updateOmegaBox<false>(Omega,patchSize,current[i],-1);
+        }
+      }
+      sink = float(sum);
+    },numCandidates);
+    report("candidate box filtered",config,ns,0);
+  }
+}
+
+static void benchNnfAndOmega(const int size,const int patchSize)
+{
+  const V2i sizeA(size,size);
+  const V2i sizeB(size,size);
+
+  char config[64];
+  snprintf(config,sizeof(config),"patch=%d",patchSize);
+
+  {
+    const A2V2i NNF = randomNnf(sizeA/2,sizeB/2,patchSize,8);
+    const double ns = nsPerOp([&]
+    {
+      const A2V2i NNF2x = nnfUpscale(NNF,patchSize,sizeA,sizeB);
+      sink = float(NNF2x(0,0)(0));
+    },double(size*size));
+    report("nnfUpscale",config,ns,sizeof(V2i)/4+sizeof(V2i));
+  }
+
+  const int numOps = 1<<16;
+  const A2V2i positions = randomNnf(V2i(numOps,1),sizeB,patchSize,9);
+
+  A2i Omega(sizeB);
+  fill(&Omega,(int)0);
+
+  {
+    const double ns = nsPerOp([&]
+    {
+      for(int i=0;i<numOps;i++) { updateOmegaBox<false>(Omega,patchSize,positions[i],(i%2) ? -1 : +1); }
+    },numOps);
+    const int d = 2*patchSize-1;
+    report("updateOmegaBox",config,ns,2*d*d*sizeof(int));
+  }
+
+  {
+    const double ns = nsPerOp([&]
+    {
+      for(int i=0;i<numOps;i++) { updateOmegaBox<true>(Omega,patchSize,positions[i],(i%2) ? -1 : +1); }
+    },numOps);
+    const int d = 2*patchSize-1;
+    report("updateOmegaBox atomic",config,ns,2*d*d*sizeof(int));
+  }
+
+  {
+    const double ns = nsPerOp([&]
+    {
+      int sum = 0;
+      for(int i=0;i<numOps;i++) { sum += patchOmega(patchSize,positions[i],Omega); }
+      sink = float(sum);
+    },numOps);
+    report("patchOmega",config,ns,sizeof(int));
+  }
+}
+
+int main(int argc,char** argv)
+{
+  int size = 512;
+  if (argc>2 && std::string(argv[1])=="-size") { size = std::max(atoi(argv[2]),64); }
+  else if (argc>1) { printf("usage: %s [-size <width>]\n",argv[0]); return 1; }
+
+#ifdef __APPLE__
+  printf("images: %dx%d\n",size,size);
+#else
+  printf("images: %dx%d, threads: %d\n",size,size,omp_get_max_threads());
+#endif
+  printf("%-24s %-26s %12s %12s %10s\n","kernel","config","ns/op","bytes/op","bytes/ns");
+
+  const int patchSizes[] = { 3,5,7,9 };
+  const int numPatchSizes = int(sizeof(patchSizes)/sizeof(patchSizes[0]));
+  for(int i=0;i<numPatchSizes;i++)
+  {
+    const int patchSize = patchSizes[i];
+    benchKernels<1,3 >(size,patchSize);
+    benchKernels<3,3 >(size,patchSize);
+    benchKernels<3,12>(size,patchSize);
+    benchKernels<8,24>(size,patchSize);
+  }
+
+  benchResample<1 >(size);
+  benchResample<3 >(size);
+  benchResample<8 >(size);
+  benchResample<24>(size);
+
+  for(int i=0;i<numPatchSizes;i++) { benchNnfAndOmega(size,patchSizes[i]); }
+  for(int i=0;i<numPatchSizes;i++) { benchOccupancy(size,patchSizes[i]); }
+
+  return 0;
+}
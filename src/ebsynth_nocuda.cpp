@@ -2,6 +2,8 @@
 // recognized, you are granted a perpetual, irrevocable license to copy
 // and modify this file as you see fit.
 
+#include "ebsynth.h"
+
 void ebsynthRunCuda(int    numStyleChannels,
                     int    numGuideChannels,
                     int    sourceWidth,
@@ -23,7 +25,9 @@ void ebsynthRunCuda(int    numStyleChannels,
                     int*   stopThresholdPerLevel,
                     int    extraPass3x3,
                     void*  outputNnfData,
-                    void*  outputImageData)
+                    void*  outputImageData,
+                    const EbsynthOptions* options,
+                    EbsynthStats* stats)
 {
 
 }
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Checks that -seed makes the CPU backend produce the same output whatever
+# the number of threads: runs the texbynum example with 1, 4 and all the
+# available threads, in plain mode and in weighted mode with the extra 3x3
+# pass, and compares the results byte by byte.
+#
+# usage: test/deterministic.sh [path/to/ebsynth]   (run from anywhere)
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+EBSYNTH=${1:-$ROOT/bin/ebsynth}
+EXAMPLE=$ROOT/examples/texbynum
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+NPROC=$(nproc 2>/dev/null || getconf _NPROCESSORS_ONLN 2>/dev/null || echo 8)
+
+run()
+{
+  OMP_NUM_THREADS=$1 "$EBSYNTH" -seed 7 -backend cpu -patchsize 3 -uniformity 1000 \
+    -style "$EXAMPLE/source_photo.png" \
+    -guide "$EXAMPLE/source_segment.png" "$EXAMPLE/target_segment.png" \
+    $3 -output "$2" > /dev/null
+}
+
+status=0
+
+for mode in plain weighted; do
+  if [ $mode = weighted ]; then extra="-votemode weighted -extrapass3x3"; else extra="-votemode plain"; fi
+
+  for threads in 1 4 $NPROC; do
+    if ! run $threads "$OUT/${mode}_$threads.png" "$extra"; then
+      echo "FAIL: $mode with $threads threads didn't run"; status=1; continue
+    fi
+    if ! cmp -s "$OUT/${mode}_1.png" "$OUT/${mode}_$threads.png"; then
+      echo "FAIL: $mode with $threads threads differs from 1 thread"; status=1
+    fi
+  done
+
+  [ $status -eq 0 ] && echo "ok: $mode is identical with 1, 4 and $NPROC threads"
+done
+
+exit $status